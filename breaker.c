@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "breaker.h"
+
+void breaker_init(breaker_t *b) {
+    memset(b, 0, sizeof(*b));
+}
+
+int breaker_available(const breaker_t *b, uint64_t now) {
+    return b->state == BREAKER_CLOSED || now >= b->retry_at;
+}
+
+static uint64_t ejection_time(const breaker_t *b) {
+    uint64_t ns = BREAKER_BASE_EJECTION_NS;
+    for (uint32_t i = 1; i < b->ejections && ns < BREAKER_MAX_EJECTION_NS; i++) {
+        ns *= 2;
+    }
+    return ns < BREAKER_MAX_EJECTION_NS ? ns : BREAKER_MAX_EJECTION_NS;
+}
+
+// Until the probe is answered no other request goes, and if it never is,
+// another probe goes after the same wait
+void breaker_sent(breaker_t *b, uint64_t now) {
+    if (b->state != BREAKER_CLOSED && now >= b->retry_at) {
+        b->state = BREAKER_HALF_OPEN;
+        b->retry_at = now + ejection_time(b);
+    }
+}
+
+// A late answer to a request sent before the ejection is no probe, so only
+// a half-open backend is reinstated
+int breaker_success(breaker_t *b) {
+    b->failures = 0;
+    if (b->state != BREAKER_HALF_OPEN) {
+        return 0;
+    }
+    b->state = BREAKER_CLOSED;
+    b->ejections = 0;
+    return 1;
+}
+
+int breaker_failure(breaker_t *b, uint64_t now) {
+    if (b->state == BREAKER_OPEN) {
+        return 0;
+    }
+    if (b->state == BREAKER_CLOSED && ++b->failures < BREAKER_FAILURE_THRESHOLD) {
+        return 0;
+    }
+    return breaker_eject(b, now);
+}
+
+int breaker_eject(breaker_t *b, uint64_t now) {
+    if (b->state == BREAKER_OPEN && now < b->retry_at) {
+        return 0;
+    }
+    b->state = BREAKER_OPEN;
+    b->failures = 0;
+    b->ejections++;
+    b->retry_at = now + ejection_time(b);
+    return 1;
+}
+
+void breaker_latency(breaker_t *b, uint64_t latency_ns) {
+    b->latency_sum_ns += latency_ns;
+    b->latency_samples++;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double *values, int n) {
+    qsort(values, n, sizeof(double), compare_doubles);
+    return n % 2 == 1 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// Each backend is compared with the median of the others, so that with two
+// backends the slow one does not pull the median up to itself
+uint64_t breaker_eject_outliers(breaker_t *const *group, int n, uint64_t now) {
+    double means[64];
+    int ejected = 0;
+    for (int i = 0; i < n; i++) {
+        const breaker_t *b = group[i];
+        ejected += b->state != BREAKER_CLOSED;
+        means[i] = b->state == BREAKER_CLOSED && b->latency_samples >= BREAKER_MIN_SAMPLES
+                   ? (double)b->latency_sum_ns / b->latency_samples : -1.0;
+    }
+
+    uint64_t outliers = 0;
+    double peers[64];
+    for (int i = 0; i < n && 2 * (ejected + 1) <= n; i++) {
+        if (means[i] < BREAKER_OUTLIER_MIN_NS) {
+            continue;
+        }
+        int num_peers = 0;
+        for (int j = 0; j < n; j++) {
+            if (j != i && means[j] >= 0.0) {
+                peers[num_peers++] = means[j];
+            }
+        }
+        if (num_peers > 0 && means[i] > BREAKER_OUTLIER_FACTOR * median(peers, num_peers) &&
+            breaker_eject(group[i], now)) {
+            outliers |= 1ULL << i;
+            ejected++;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        group[i]->latency_sum_ns = 0;
+        group[i]->latency_samples = 0;
+    }
+    return outliers;
+}
@@ -0,0 +1,67 @@
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include <stdint.h>
+
+// Circuit breaker with outlier ejection for one backend. A run of failures,
+// or a latency far above that of its peers over an interval, ejects the
+// backend: it gets no traffic until its ejection time is up, and then a
+// single request goes through as a probe. An answer to the probe reinstates
+// the backend, so one the watchdog respawned is back in rotation with its
+// first response; a failed probe ejects it again for twice as long.
+
+#define BREAKER_FAILURE_THRESHOLD 5            // failures in a row that eject
+#define BREAKER_BASE_EJECTION_NS 50000000ULL   // 50 ms, doubled with every ejection in a row
+#define BREAKER_MAX_EJECTION_NS 2000000000ULL  // 2 s
+#define BREAKER_INTERVAL_NS 100000000ULL       // 100 ms between latency comparisons
+#define BREAKER_MIN_SAMPLES 20                 // answers a backend needs in an interval to be compared
+#define BREAKER_OUTLIER_FACTOR 3.0             // mean latency over this many times the peers' median
+#define BREAKER_OUTLIER_MIN_NS 1000000.0       // and over 1 ms, or fast backends would count as slow
+
+typedef enum {
+    BREAKER_CLOSED,
+    BREAKER_OPEN,     // ejected
+    BREAKER_HALF_OPEN // a probe is out
+} breaker_state_t;
+
+typedef struct {
+    breaker_state_t state;
+    uint32_t failures;  // in a row
+    uint32_t ejections; // in a row, without a successful probe in between
+    uint64_t retry_at;  // when ejected, the time the next probe may go
+    uint64_t latency_sum_ns; // answers in the current interval
+    uint32_t latency_samples;
+} breaker_t;
+
+void breaker_init(breaker_t *b);
+
+// Whether a request may go to the backend now: always while it is in
+// rotation, and once its ejection time is up to probe it. A probe that
+// gets no verdict in time lets another one go.
+int breaker_available(const breaker_t *b, uint64_t now);
+
+// Called for every request sent. The first one after the ejection time is
+// the probe.
+void breaker_sent(breaker_t *b, uint64_t now);
+
+// The backend answered. Returns 1 when this reinstated it.
+int breaker_success(breaker_t *b);
+
+// The backend failed a request or a connection. Returns 1 when this
+// ejected it.
+int breaker_failure(breaker_t *b, uint64_t now);
+
+// Takes the backend out of rotation right away, or again once its time is
+// up. Returns 0 when it is out and not due for a probe yet.
+int breaker_eject(breaker_t *b, uint64_t now);
+
+// Adds the latency of an answer to the current interval
+void breaker_latency(breaker_t *b, uint64_t latency_ns);
+
+// Ends the interval of a group of at most 64 peers: ejects those whose mean
+// latency is an outlier next to the others', but never more than half of
+// the group, so a group that is slow as a whole keeps its traffic. Returns
+// the ejected backends, a bit per index.
+uint64_t breaker_eject_outliers(breaker_t *const *group, int n, uint64_t now);
+
+#endif
@@ -1,20 +1,21 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/time.h>
 #include <string.h>
+#include <errno.h>
 
-#define LOAD_BALANCER_SOCKET "/tmp/load_balancer"
+#include "protocol.h"
 
-typedef struct {
-    int client_id;
-    double value;
-} request_t;
+#define LOAD_BALANCER_SOCKET "/tmp/load_balancer"
+#define DEFAULT_TIMEOUT_MS 5000
+#define DEADLINE_GRACE_MS 100 // lets the tiers' expired answer arrive before we stop waiting
 
-typedef struct {
-    double result;
-} response_t;
+static unsigned long timeout_ms = DEFAULT_TIMEOUT_MS; // 0 waits forever
 
 // prompt : Client must be able to connect to the load balancer. Implement the required logic inside the client.c file.
 int connect_to_load_balancer() {
@@ -38,15 +39,127 @@ int connect_to_load_balancer() {
     return sock;
 }
 
+// Sends a request whose payload has room for a deadline after its first
+// `length` bytes, and receives its response. Exits when the request fails.
+void send_request(uint32_t flags, char *payload, size_t length, void *response, size_t response_length) {
+    // Connect to load balancer
+    int sock = connect_to_load_balancer();
+    if (sock == -1) {
+        printf("Failed to connect to load balancer\n");
+        exit(1);
+    }
+    
+    // The deadline travels with the request so no tier works on it after
+    // we have given up waiting
+    if (timeout_ms > 0) {
+        uint64_t deadline = trace_now() + timeout_ms * 1000000ULL;
+        memcpy(payload + length, &deadline, sizeof(deadline));
+        length += sizeof(deadline);
+        flags |= FRAME_FLAG_DEADLINE;
+    
+        unsigned long wait_ms = timeout_ms + DEADLINE_GRACE_MS;
+        struct timeval tv = {wait_ms / 1000, (wait_ms % 1000) * 1000};
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) {
+            perror("setsockopt");
+        }
+    }
+    
+    frame_header_t hdr;
+    if (frame_send(sock, FRAME_REQUEST, flags, 1, payload, length) == -1) {
+        perror("send");
+        close(sock);
+        exit(1);
+    }
+    if (frame_recv(sock, &hdr, response, response_length) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            printf("Request timed out\n");
+            close(sock);
+            exit(3);
+        }
+        printf("Error receiving response\n");
+        close(sock);
+        exit(1);
+    }
+    close(sock);
+    
+    if (hdr.flags & FRAME_FLAG_OVERLOAD) {
+        printf("Server overloaded, try again later\n");
+        exit(2);
+    }
+    if (hdr.flags & FRAME_FLAG_EXPIRED) {
+        printf("Request timed out\n");
+        exit(3);
+    }
+    if (hdr.length != response_length) {
+        printf("Error receiving response\n");
+        exit(1);
+    }
+}
+
+// Sends `count` values in one batch frame and prints one result per value
+int run_batch(int client_id, int count) {
+    size_t length = sizeof(batch_header_t) + count * sizeof(double);
+    char *payload = malloc(length + sizeof(uint64_t));
+    double *results = malloc(count * sizeof(double));
+    if (payload == NULL || results == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    
+    batch_header_t batch;
+    batch.client_id = client_id;
+    batch.count = count;
+    memcpy(payload, &batch, sizeof(batch));
+    
+    // Get input from user
+    printf("Enter %d non-negative floats: ", count);
+    for (int i = 0; i < count; i++) {
+        double value;
+        if (scanf("%lf", &value) != 1) {
+            printf("Invalid input\n");
+            exit(1);
+        }
+        memcpy(payload + sizeof(batch) + i * sizeof(double), &value, sizeof(value));
+    }
+    
+    send_request(FRAME_FLAG_BATCH, payload, length, results, count * sizeof(double));
+    free(payload);
+    
+    // Display results
+    for (int i = 0; i < count; i++) {
+        printf("      Result: %.1f\n", results[i]);
+    }
+    
+    free(results);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <client_id>\n", argv[0]);
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt != 't') {
+            optind = argc + 1; // Force the usage message below
+            break;
+        }
+        timeout_ms = strtoul(optarg, NULL, 10);
+    }
+    if (argc - optind != 1 && argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-t timeout_ms] <client_id> [batch_size]\n", argv[0]);
         exit(1);
     }
     
-    int client_id = atoi(argv[1]);
+    int client_id = atoi(argv[optind]);
     printf("This is client #%d\n", client_id);
     
+    if (argc - optind == 2) {
+        int count = atoi(argv[optind + 1]);
+        if (count < 1 || (size_t)count > MAX_BATCH_SIZE) {
+            fprintf(stderr, "Batch size must be between 1 and %zu\n", (size_t)MAX_BATCH_SIZE);
+            exit(1);
+        }
+        return run_batch(client_id, count);
+    }
+    
     // Get input from user
     double value;
     printf("Enter a non-negative float: ");
@@ -55,37 +168,18 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
     
-    // Connect to load balancer
-    int sock = connect_to_load_balancer();
-    if (sock == -1) {
-        printf("Failed to connect to load balancer\n");
-        exit(1);
-    }
-    
-    // Prepare request
+    // Prepare request, leaving room for the deadline
     request_t req;
     req.client_id = client_id;
     req.value = value;
+    char payload[sizeof(req) + sizeof(uint64_t)];
+    memcpy(payload, &req, sizeof(req));
     
-    // Send request
-    if (send(sock, &req, sizeof(req), 0) == -1) {
-        perror("send");
-        close(sock);
-        exit(1);
-    }
-    
-    // Receive response
     response_t resp;
-    ssize_t bytes_received = recv(sock, &resp, sizeof(resp), 0);
-    if (bytes_received != sizeof(resp)) {
-        printf("Error receiving response\n");
-        close(sock);
-        exit(1);
-    }
+    send_request(0, payload, sizeof(req), &resp, sizeof(resp));
     
     // Display result
     printf("      Result: %.1f\n", resp.result);
     
-    close(sock);
     return 0;
 } 
\ No newline at end of file
@@ -0,0 +1,62 @@
+#include <math.h>
+#include <string.h>
+
+#include "codel.h"
+
+void codel_init(codel_t *c, uint64_t target_ns, uint64_t interval_ns) {
+    memset(c, 0, sizeof(*c));
+    c->target_ns = target_ns;
+    c->interval_ns = interval_ns;
+}
+
+static uint64_t control_law(const codel_t *c, uint64_t t) {
+    return t + (uint64_t)(c->interval_ns / sqrt(c->count));
+}
+
+// Whether the delay has been above target for at least an interval
+static int above_target(codel_t *c, uint64_t sojourn_ns, uint64_t now) {
+    if (sojourn_ns < c->target_ns) {
+        c->first_above = 0;
+        return 0;
+    }
+    if (c->first_above == 0) {
+        c->first_above = now + c->interval_ns;
+        return 0;
+    }
+    return now >= c->first_above;
+}
+
+int codel_should_shed(codel_t *c, uint64_t sojourn_ns, uint64_t now) {
+    if (c->target_ns == 0) {
+        return 0;
+    }
+
+    int ok_to_shed = above_target(c, sojourn_ns, now);
+    if (c->dropping) {
+        if (!ok_to_shed) {
+            c->dropping = 0;
+            return 0;
+        }
+        if (now >= c->drop_next) {
+            c->count++;
+            c->drop_next = control_law(c, c->drop_next);
+            return 1;
+        }
+        return 0;
+    }
+    if (!ok_to_shed) {
+        return 0;
+    }
+
+    // Entering a dropping period soon after the last one resumes its rate
+    c->dropping = 1;
+    uint32_t delta = c->count - c->last_count;
+    if (delta > 1 && now - c->drop_next < 16 * c->interval_ns) {
+        c->count = delta;
+    } else {
+        c->count = 1;
+    }
+    c->last_count = c->count;
+    c->drop_next = control_law(c, now);
+    return 1;
+}
@@ -0,0 +1,31 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <stdint.h>
+
+// CoDel (controlled delay) queue management. Instead of a length limit,
+// the decision is based on how long the item being dequeued sat in the
+// queue. Once that sojourn time has stayed above `target` for a whole
+// `interval`, items are shed at a rate that rises with the square root of
+// the number shed so far, until the delay falls back under the target. A
+// queue that only fills in short bursts is never touched.
+
+#define CODEL_DEFAULT_TARGET_NS 5000000ULL     // 5 ms
+#define CODEL_DEFAULT_INTERVAL_NS 100000000ULL // 100 ms
+
+typedef struct {
+    uint64_t target_ns;   // 0 disables shedding
+    uint64_t interval_ns;
+    uint64_t first_above; // when the delay may first count as persistent
+    uint64_t drop_next;   // next shed while dropping
+    uint32_t count;       // shed in the current dropping period
+    uint32_t last_count;
+    int dropping;
+} codel_t;
+
+void codel_init(codel_t *c, uint64_t target_ns, uint64_t interval_ns);
+
+// Called for every dequeued item. Returns 1 when the item should be shed.
+int codel_should_shed(codel_t *c, uint64_t sojourn_ns, uint64_t now);
+
+#endif
@@ -0,0 +1,516 @@
+#define _GNU_SOURCE // syscall(), MAP_POPULATE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "event_loop.h"
+
+#define URING_ENTRIES 1024
+
+// io_uring user_data: request type, registration generation and fd. Stale
+// completions (the fd was re-registered since) carry an old generation.
+#define UD_IGNORE 0ULL
+#define UD_POLL 1ULL
+#define UD_ACCEPT 2ULL
+#define UD_SEND 3ULL
+#define UD_MAKE(type, gen, fd) (((type) << 62) | ((uint64_t)((gen) & 0x3fffffff) << 32) | (uint32_t)(fd))
+#define UD_TYPE(ud) ((ud) >> 62)
+#define UD_GEN(ud) ((uint32_t)((ud) >> 32) & 0x3fffffff)
+#define UD_FD(ud) ((int)(uint32_t)(ud))
+
+typedef enum {
+    REG_UNUSED,
+    REG_IDLE,  // registered, no poll or accept armed
+    REG_ARMED
+} reg_state_t;
+
+typedef struct {
+    void *ptr;
+    uint32_t events;
+    uint32_t gen;
+    reg_state_t state;
+    int listener;
+    int queued; // waiting in the rearm list
+} loop_reg_t;
+
+static loop_backend_t backend = LOOP_EPOLL;
+static loop_reg_t *regs = NULL;
+static size_t nregs = 0;
+static int epoll_fd = -1;
+
+// io_uring state
+static int ring_fd = -1;
+static unsigned enter_flags = 0;   // IORING_ENTER_REGISTERED_RING when available
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned sqe_tail;          // next SQE to fill, published on submit
+static int *rearm = NULL;          // fds whose poll or accept must be armed
+static size_t rearm_count = 0, rearm_cap = 0;
+static struct io_uring_cqe *backlog = NULL; // reaped while waiting for sends
+static size_t backlog_count = 0, backlog_cap = 0, backlog_pos = 0;
+
+static loop_reg_t *get_reg(int fd) {
+    if (fd < 0) {
+        return NULL;
+    }
+    if ((size_t)fd >= nregs) {
+        size_t n = nregs ? nregs : 64;
+        while (n <= (size_t)fd) {
+            n *= 2;
+        }
+        loop_reg_t *grown = realloc(regs, n * sizeof(loop_reg_t));
+        if (grown == NULL) {
+            return NULL;
+        }
+        memset(grown + nregs, 0, (n - nregs) * sizeof(loop_reg_t));
+        regs = grown;
+        nregs = n;
+    }
+    return &regs[fd];
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+                       void *arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                   flags | enter_flags, arg, argsz);
+}
+
+static unsigned sq_pending() {
+    return sqe_tail - atomic_load_explicit((_Atomic unsigned *)sq_head, memory_order_acquire);
+}
+
+static int uring_submit(unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    atomic_store_explicit((_Atomic unsigned *)sq_tail, sqe_tail, memory_order_release);
+    return uring_enter(sq_pending(), min_complete, flags, arg, argsz);
+}
+
+// Returns a zeroed SQE, pushing queued ones to the kernel when the ring is full
+static struct io_uring_sqe *get_sqe() {
+    while (sq_pending() > *sq_mask) {
+        if (uring_submit(0, 0, NULL, 0) == -1 && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+        }
+    }
+    unsigned index = sqe_tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    sqe_tail++;
+    return sqe;
+}
+
+static void queue_rearm(int fd, loop_reg_t *reg) {
+    if (reg->queued) {
+        return;
+    }
+    if (rearm_count == rearm_cap) {
+        size_t cap = rearm_cap ? rearm_cap * 2 : 256;
+        int *grown = realloc(rearm, cap * sizeof(int));
+        if (grown == NULL) {
+            perror("realloc");
+            return;
+        }
+        rearm = grown;
+        rearm_cap = cap;
+    }
+    rearm[rearm_count++] = fd;
+    reg->queued = 1;
+}
+
+static void cancel_armed(int fd, loop_reg_t *reg) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = reg->listener ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = UD_MAKE(reg->listener ? UD_ACCEPT : UD_POLL, reg->gen, fd);
+    sqe->user_data = UD_IGNORE;
+}
+
+static void arm(int fd, loop_reg_t *reg) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->fd = fd;
+    if (reg->listener) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = UD_MAKE(UD_ACCEPT, reg->gen, fd);
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = reg->events;
+        sqe->user_data = UD_MAKE(UD_POLL, reg->gen, fd);
+    }
+    reg->state = REG_ARMED;
+}
+
+static int uring_init() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER;
+    ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring_fd == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params)); // Older kernel, plain ring
+        ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (ring_fd == -1) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        close(ring_fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        close(ring_fd);
+        return -1;
+    }
+    sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(ring, ring_size);
+        close(ring_fd);
+        return -1;
+    }
+
+    sq_head = (unsigned *)(ring + params.sq_off.head);
+    sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    sq_mask = (unsigned *)(ring + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(ring + params.sq_off.array);
+    cq_head = (unsigned *)(ring + params.cq_off.head);
+    cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    cq_mask = (unsigned *)(ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    sqe_tail = *sq_tail;
+
+    // Registering the ring saves a file lookup on every io_uring_enter
+    struct io_uring_rsrc_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = -1U;
+    update.data = ring_fd;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+        ring_fd = update.offset;
+        enter_flags = IORING_ENTER_REGISTERED_RING;
+    }
+    return 0;
+}
+
+int loop_init(loop_backend_t requested) {
+    backend = requested;
+    if (backend == LOOP_IO_URING) {
+        return uring_init();
+    }
+    epoll_fd = epoll_create1(0);
+    return epoll_fd == -1 ? -1 : 0;
+}
+
+loop_backend_t loop_backend() {
+    return backend;
+}
+
+static int add_reg(int fd, uint32_t events, void *ptr, int listener) {
+    loop_reg_t *reg = get_reg(fd);
+    if (reg == NULL) {
+        errno = fd < 0 ? EBADF : ENOMEM;
+        return -1;
+    }
+    if (reg->state != REG_UNUSED) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (backend == LOOP_EPOLL) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            return -1;
+        }
+    }
+
+    reg->ptr = ptr;
+    reg->events = events;
+    reg->gen++;
+    reg->listener = listener;
+    reg->state = REG_IDLE;
+    if (backend == LOOP_EPOLL) {
+        reg->state = REG_ARMED;
+    } else {
+        queue_rearm(fd, reg);
+    }
+    return 0;
+}
+
+int loop_add(int fd, uint32_t events, void *ptr) {
+    return add_reg(fd, events, ptr, 0);
+}
+
+int loop_add_listener(int fd, void *ptr) {
+    return add_reg(fd, EPOLLIN, ptr, 1);
+}
+
+int loop_mod(int fd, uint32_t events, void *ptr) {
+    loop_reg_t *reg = fd >= 0 && (size_t)fd < nregs ? &regs[fd] : NULL;
+    if (reg == NULL || reg->state == REG_UNUSED) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (reg->events == events && reg->ptr == ptr) {
+        return 0;
+    }
+
+    if (backend == LOOP_EPOLL) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+            return -1;
+        }
+    } else if (reg->state == REG_ARMED) {
+        // Replace the armed poll; its cancellation completes under the old
+        // generation and is ignored
+        cancel_armed(fd, reg);
+        reg->gen++;
+        reg->state = REG_IDLE;
+        queue_rearm(fd, reg);
+    }
+
+    reg->events = events;
+    reg->ptr = ptr;
+    return 0;
+}
+
+int loop_del(int fd) {
+    loop_reg_t *reg = fd >= 0 && (size_t)fd < nregs ? &regs[fd] : NULL;
+    if (reg == NULL || reg->state == REG_UNUSED) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (backend == LOOP_EPOLL) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    } else if (reg->state == REG_ARMED) {
+        cancel_armed(fd, reg);
+    }
+    reg->gen++;
+    reg->state = REG_UNUSED;
+    reg->ptr = NULL;
+    return 0;
+}
+
+static int epoll_loop_wait(loop_event_t *events, int max, int timeout_ms) {
+    struct epoll_event ready[max];
+    int n = epoll_wait(epoll_fd, ready, max, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        events[i].ptr = regs[ready[i].data.fd].ptr;
+        events[i].events = ready[i].events;
+        events[i].fd = -1;
+    }
+    return n;
+}
+
+// Turns a completion into an event. Returns 1 when an event was produced.
+static int handle_cqe(const struct io_uring_cqe *cqe, loop_event_t *event) {
+    uint64_t type = UD_TYPE(cqe->user_data);
+    int fd = UD_FD(cqe->user_data);
+    loop_reg_t *reg = (size_t)fd < nregs ? &regs[fd] : NULL;
+    int current = reg != NULL && reg->state != REG_UNUSED && reg->gen == UD_GEN(cqe->user_data);
+
+    if (type == UD_ACCEPT) {
+        if (!current) {
+            if (cqe->res >= 0) {
+                close(cqe->res); // Listener went away while accepting
+            }
+            return 0;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            reg->state = REG_IDLE; // Multishot ended, arm it again
+            queue_rearm(fd, reg);
+        }
+        if (cqe->res < 0) {
+            if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+                fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+            }
+            return 0;
+        }
+        event->ptr = reg->ptr;
+        event->events = EPOLLIN;
+        event->fd = cqe->res;
+        return 1;
+    }
+
+    if (type != UD_POLL || !current) {
+        return 0;
+    }
+    reg->state = REG_IDLE;
+    queue_rearm(fd, reg);
+    if (cqe->res == -ECANCELED) {
+        return 0;
+    }
+
+    event->ptr = reg->ptr;
+    event->events = cqe->res < 0 ? EPOLLERR : (uint32_t)cqe->res;
+    event->fd = -1;
+    return 1;
+}
+
+static int uring_loop_wait(loop_event_t *events, int max, int timeout_ms) {
+    int n = 0;
+
+    // Completions reaped while a send batch was in progress come first
+    while (n < max && backlog_pos < backlog_count) {
+        n += handle_cqe(&backlog[backlog_pos++], &events[n]);
+    }
+    if (backlog_pos == backlog_count) {
+        backlog_pos = backlog_count = 0;
+    }
+
+    // Arm every registration whose previous poll fired or that changed
+    for (size_t i = 0; i < rearm_count; i++) {
+        loop_reg_t *reg = &regs[rearm[i]];
+        reg->queued = 0;
+        if (reg->state == REG_IDLE) {
+            arm(rearm[i], reg);
+        }
+    }
+    rearm_count = 0;
+
+    unsigned head = *cq_head;
+    int have_cqes = head != atomic_load_explicit((_Atomic unsigned *)cq_tail, memory_order_acquire);
+    int wait = n == 0 && !have_cqes && timeout_ms != 0;
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    if (wait && timeout_ms > 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    // Nothing to submit or wait for: completions are already in the ring
+    atomic_store_explicit((_Atomic unsigned *)sq_tail, sqe_tail, memory_order_release);
+    if ((wait || sq_pending() > 0) &&
+        uring_submit(wait ? 1 : 0, flags, flags & IORING_ENTER_EXT_ARG ? &arg : NULL,
+                     flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0) == -1) {
+        if (errno == EINTR && n == 0) {
+            return -1;
+        }
+        if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+            return n > 0 ? n : -1;
+        }
+    }
+
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)cq_tail, memory_order_acquire);
+    head = *cq_head;
+    while (n < max && head != tail) {
+        n += handle_cqe(&cqes[head & *cq_mask], &events[n]);
+        head++;
+    }
+    atomic_store_explicit((_Atomic unsigned *)cq_head, head, memory_order_release);
+    return n;
+}
+
+int loop_wait(loop_event_t *events, int max, int timeout_ms) {
+    if (backend == LOOP_EPOLL) {
+        return epoll_loop_wait(events, max, timeout_ms);
+    }
+    return uring_loop_wait(events, max, timeout_ms);
+}
+
+static void stash_cqe(const struct io_uring_cqe *cqe) {
+    if (backlog_count == backlog_cap) {
+        size_t cap = backlog_cap ? backlog_cap * 2 : 256;
+        struct io_uring_cqe *grown = realloc(backlog, cap * sizeof(*cqe));
+        if (grown == NULL) {
+            perror("realloc");
+            return;
+        }
+        backlog = grown;
+        backlog_cap = cap;
+    }
+    backlog[backlog_count++] = *cqe;
+}
+
+// MSG_DONTWAIT makes io_uring complete each send inline during submission
+// instead of arming a poll, so the buffers are no longer referenced once
+// io_uring_enter returns and a full socket simply reports -EAGAIN
+static void uring_send_batch(loop_send_t *sends, int count) {
+    for (int i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = sends[i].fd;
+        sqe->addr = (uint64_t)(uintptr_t)sends[i].data;
+        sqe->len = sends[i].len;
+        sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+        sqe->user_data = UD_MAKE(UD_SEND, 0, i);
+        sends[i].result = -EINPROGRESS;
+    }
+
+    int remaining = count;
+    while (remaining > 0) {
+        if (uring_submit(remaining, IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+            errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        unsigned tail = atomic_load_explicit((_Atomic unsigned *)cq_tail, memory_order_acquire);
+        unsigned head = *cq_head;
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            if (UD_TYPE(cqe->user_data) == UD_SEND) {
+                sends[UD_FD(cqe->user_data)].result = cqe->res;
+                remaining--;
+            } else {
+                stash_cqe(cqe);
+            }
+        }
+        atomic_store_explicit((_Atomic unsigned *)cq_head, head, memory_order_release);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (sends[i].result == -EINPROGRESS) {
+            sends[i].result = -EIO;
+        }
+    }
+}
+
+void loop_send_batch(loop_send_t *sends, int count) {
+    if (count == 0) {
+        return;
+    }
+    if (backend == LOOP_IO_URING) {
+        uring_send_batch(sends, count);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        ssize_t n;
+        do {
+            n = send(sends[i].fd, sends[i].data, sends[i].len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (n == -1 && errno == EINTR);
+        sends[i].result = n == -1 ? -errno : n;
+        if (sends[i].result == -EWOULDBLOCK) {
+            sends[i].result = -EAGAIN;
+        }
+    }
+}
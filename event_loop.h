@@ -0,0 +1,63 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+
+// Readiness-based event loop shared by the load balancer and the reverse
+// proxies, with two interchangeable backends:
+//
+// - epoll: one epoll_ctl per registration change and one epoll_wait per
+//   iteration, as before; interest updates that change nothing are skipped.
+// - io_uring: interest is expressed as one-shot poll requests that are
+//   (re)armed in bulk right before waiting, listening sockets use multishot
+//   accept, and every registration change, accept, wait and the batch of
+//   sends an iteration produces go to the kernel through io_uring_enter on a
+//   registered ring descriptor.
+//
+// Both backends report level-triggered EPOLL* bits, so callers handle
+// events the same way whichever one is active. File descriptors are the
+// registration keys; each may be registered once.
+
+typedef struct {
+    void *ptr;
+    uint32_t events;
+    int fd; // connection accepted by a listener, or -1
+} loop_event_t;
+
+typedef enum {
+    LOOP_EPOLL,
+    LOOP_IO_URING
+} loop_backend_t;
+
+// Returns 0 on success and -1 when the backend is unavailable
+int loop_init(loop_backend_t backend);
+loop_backend_t loop_backend();
+
+int loop_add(int fd, uint32_t events, void *ptr);
+int loop_mod(int fd, uint32_t events, void *ptr);
+int loop_del(int fd);
+
+// Registers a listening socket. With epoll its readiness is reported and
+// the caller accepts; with io_uring the kernel accepts and every event
+// carries one accepted descriptor.
+int loop_add_listener(int fd, void *ptr);
+
+// Waits up to timeout_ms (-1 forever, 0 not at all) for events. Returns the
+// number of events, or -1 with errno set (EINTR when a signal arrived).
+int loop_wait(loop_event_t *events, int max, int timeout_ms);
+
+// Writes several buffers in one go without blocking. Each result is the
+// number of bytes written or -errno, -EAGAIN meaning the socket was full.
+typedef struct {
+    int fd;
+    const void *data;
+    size_t len;
+    ssize_t result;
+} loop_send_t;
+
+void loop_send_batch(loop_send_t *sends, int count);
+
+#endif
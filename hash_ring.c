@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash_ring.h"
+
+uint64_t ring_hash(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static int compare_points(const void *a, const void *b) {
+    const ring_point_t *pa = a;
+    const ring_point_t *pb = b;
+    if (pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    return pa->member - pb->member;
+}
+
+int ring_init(hash_ring_t *ring, int vnodes) {
+    memset(ring, 0, sizeof(*ring));
+    ring->vnodes = vnodes > 0 ? vnodes : 1;
+    return 0;
+}
+
+void ring_destroy(hash_ring_t *ring) {
+    free(ring->points);
+    memset(ring, 0, sizeof(*ring));
+}
+
+int ring_contains(const hash_ring_t *ring, int member) {
+    for (size_t i = 0; i < ring->count; i++) {
+        if (ring->points[i].member == member) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int ring_add(hash_ring_t *ring, int member) {
+    if (ring_contains(ring, member)) {
+        return -1;
+    }
+
+    ring_point_t *points = realloc(ring->points, (ring->count + ring->vnodes) * sizeof(ring_point_t));
+    if (points == NULL) {
+        return -1;
+    }
+    ring->points = points;
+
+    for (int i = 0; i < ring->vnodes; i++) {
+        ring_point_t *point = &ring->points[ring->count++];
+        point->hash = ring_hash(((uint64_t)(uint32_t)member << 32) | (uint32_t)i);
+        point->member = member;
+    }
+    qsort(ring->points, ring->count, sizeof(ring_point_t), compare_points);
+    return 0;
+}
+
+int ring_remove(hash_ring_t *ring, int member) {
+    size_t kept = 0;
+    for (size_t i = 0; i < ring->count; i++) {
+        if (ring->points[i].member != member) {
+            ring->points[kept++] = ring->points[i];
+        }
+    }
+    if (kept == ring->count) {
+        return -1;
+    }
+    ring->count = kept;
+    return 0;
+}
+
+// Index of the first point at or after the key's hash
+static size_t first_point(const hash_ring_t *ring, uint64_t key) {
+    uint64_t hash = ring_hash(key);
+    size_t lo = 0;
+    size_t hi = ring->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo == ring->count ? 0 : lo;
+}
+
+int ring_lookup(const hash_ring_t *ring, uint64_t key) {
+    if (ring->count == 0) {
+        return -1;
+    }
+    return ring->points[first_point(ring, key)].member;
+}
+
+int ring_lookup_usable(const hash_ring_t *ring, uint64_t key, ring_usable_fn usable, void *arg) {
+    if (ring->count == 0) {
+        return -1;
+    }
+
+    size_t start = first_point(ring, key);
+    for (size_t i = 0; i < ring->count; i++) {
+        int member = ring->points[(start + i) % ring->count].member;
+        if (usable(member, arg)) {
+            return member;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,44 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Consistent-hash ring. Every member owns `vnodes` points on a 64-bit ring
+// and a key belongs to the member owning the first point at or after the
+// key's hash. Adding or removing a member only moves the keys that fall on
+// its own points, so the other members keep their keys.
+
+typedef struct {
+    uint64_t hash;
+    int member;
+} ring_point_t;
+
+typedef struct {
+    ring_point_t *points; // sorted by hash
+    size_t count;
+    int vnodes;
+} hash_ring_t;
+
+int ring_init(hash_ring_t *ring, int vnodes);
+void ring_destroy(hash_ring_t *ring);
+
+// Return 0 on success, -1 when the member is already present (add), not
+// present (remove) or memory ran out
+int ring_add(hash_ring_t *ring, int member);
+int ring_remove(hash_ring_t *ring, int member);
+int ring_contains(const hash_ring_t *ring, int member);
+
+// Returns the member owning key, or -1 when the ring is empty
+int ring_lookup(const hash_ring_t *ring, uint64_t key);
+
+// Like ring_lookup, but passes over the members `usable` rejects, so the
+// keys of those go to the members that follow them on the ring. `usable` is
+// asked once for every point passed. Returns -1 when no member is usable.
+typedef int (*ring_usable_fn)(int member, void *arg);
+int ring_lookup_usable(const hash_ring_t *ring, uint64_t key, ring_usable_fn usable, void *arg);
+
+// 64-bit mixer (splitmix64 finalizer) used to spread keys around the ring
+uint64_t ring_hash(uint64_t x);
+
+#endif
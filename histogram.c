@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+
+#define HIST_HALF (HIST_SUB_BUCKETS / 2)
+
+// Values below HIST_SUB_BUCKETS are counted exactly. Above that, a value
+// whose top bit is bit (HIST_SUB_BITS - 1 + shift) keeps its HIST_SUB_BITS
+// top bits and lands in the upper half of sub-buckets for that shift.
+static size_t bucket_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return HIST_SUB_BUCKETS + (size_t)(shift - 1) * HIST_HALF + ((value >> shift) - HIST_HALF);
+}
+
+static uint64_t highest_equivalent(size_t index) {
+    if (index < HIST_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = (index - HIST_SUB_BUCKETS) / HIST_HALF + 1;
+    uint64_t sub = (index - HIST_SUB_BUCKETS) % HIST_HALF + HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+int hist_init(histogram_t *h) {
+    memset(h, 0, sizeof(*h));
+    h->len = bucket_index(HIST_MAX_VALUE) + 1;
+    h->counts = calloc(h->len, sizeof(uint64_t));
+    if (h->counts == NULL) {
+        return -1;
+    }
+    h->min = UINT64_MAX;
+    return 0;
+}
+
+void hist_free(histogram_t *h) {
+    free(h->counts);
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_record(histogram_t *h, uint64_t value) {
+    if (value > HIST_MAX_VALUE) {
+        value = HIST_MAX_VALUE;
+    }
+    h->counts[bucket_index(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void hist_record_corrected(histogram_t *h, uint64_t value, uint64_t expected_interval) {
+    hist_record(h, value);
+    if (expected_interval == 0) {
+        return;
+    }
+    for (uint64_t missing = value; missing > expected_interval; ) {
+        missing -= expected_interval;
+        hist_record(h, missing);
+    }
+}
+
+void hist_merge(histogram_t *dst, const histogram_t *src) {
+    for (size_t i = 0; i < src->len; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t hist_percentile(const histogram_t *h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < h->len; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t value = highest_equivalent(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+double hist_mean(const histogram_t *h) {
+    return h->total > 0 ? h->sum / h->total : 0.0;
+}
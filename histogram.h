@@ -0,0 +1,46 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Latency histogram in the style of HdrHistogram. Values are bucketed by
+// powers of two, and every power of two is split into HIST_SUB_BUCKETS / 2
+// linear sub-buckets, so any recorded value is reported to within 1/1024 of
+// itself (three significant digits) whatever its magnitude. Values above
+// HIST_MAX_VALUE are clamped.
+
+#define HIST_SUB_BITS 11
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 44 // about 4.9 hours in nanoseconds
+#define HIST_MAX_VALUE ((1ULL << HIST_MAX_BITS) - 1)
+
+typedef struct {
+    uint64_t *counts;
+    size_t len;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} histogram_t;
+
+int hist_init(histogram_t *h);
+void hist_free(histogram_t *h);
+
+void hist_record(histogram_t *h, uint64_t value);
+
+// Coordinated-omission correction for closed-loop measurements: a sample
+// that took longer than the interval the requests were expected at stands
+// for the requests that would have been issued meanwhile, so the values
+// value - interval, value - 2 * interval, ... are recorded too
+void hist_record_corrected(histogram_t *h, uint64_t value, uint64_t expected_interval);
+
+// Adds every sample of src to dst
+void hist_merge(histogram_t *dst, const histogram_t *src);
+
+// Returns the value below which `percentile` percent of the samples fall,
+// reported as the highest value equivalent to its bucket
+uint64_t hist_percentile(const histogram_t *h, double percentile);
+double hist_mean(const histogram_t *h);
+
+#endif
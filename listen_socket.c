@@ -0,0 +1,182 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "listen_socket.h"
+
+static int assigned_fd = -1; // received by standby_wait
+
+int listen_socket_create(const char *path, int backlog) {
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, backlog) == -1) {
+        perror("listen");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+int listen_socket_pass(int fd) {
+    // dup2 leaves the copy without close-on-exec; the original keeps it
+    if (fd == LISTEN_FDS_START) {
+        int flags = fcntl(fd, F_GETFD);
+        if (flags == -1 || fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) == -1) {
+            return -1;
+        }
+    } else if (dup2(fd, LISTEN_FDS_START) == -1) {
+        return -1;
+    }
+
+    char pid[16];
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    if (setenv("LISTEN_PID", pid, 1) == -1 || setenv("LISTEN_FDS", "1", 1) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+int listen_socket_inherited() {
+    if (assigned_fd != -1) {
+        int fd = assigned_fd;
+        assigned_fd = -1;
+        return fd;
+    }
+
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    int passed = pid != NULL && fds != NULL && atoi(pid) == (int)getpid() && atoi(fds) == 1;
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    if (!passed) {
+        return -1;
+    }
+
+    // Make sure it really is a listening socket before trusting the environment
+    struct stat st;
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+    if (fstat(LISTEN_FDS_START, &st) == -1 || !S_ISSOCK(st.st_mode) ||
+        getsockopt(LISTEN_FDS_START, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 ||
+        !listening) {
+        return -1;
+    }
+    fcntl(LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+    return LISTEN_FDS_START;
+}
+
+int standby_wait() {
+    const char *value = getenv(STANDBY_FD_ENV);
+    if (value == NULL) {
+        return 0;
+    }
+    int channel = atoi(value);
+    unsetenv(STANDBY_FD_ENV);
+    notify_ready();
+
+    int id;
+    struct iovec iov = {&id, sizeof(id)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    // Not retried on EINTR: a signal here is the watchdog shutting down
+    ssize_t n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    close(channel);
+    if (n == -1) {
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&assigned_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (n != sizeof(id) || id < 1 || assigned_fd == -1) {
+        if (assigned_fd != -1) {
+            close(assigned_fd);
+            assigned_fd = -1;
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    return id;
+}
+
+int standby_assign(int channel, int id, int listen_fd) {
+    struct iovec iov = {&id, sizeof(id)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    // The socket buffer is empty, since each standby gets one message
+    ssize_t n;
+    do {
+        n = sendmsg(channel, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    return n == sizeof(id) ? 0 : -1;
+}
+
+void notify_ready() {
+    const char *value = getenv(NOTIFY_FD_ENV);
+    if (value == NULL) {
+        return;
+    }
+    int fd = atoi(value);
+    unsetenv(NOTIFY_FD_ENV);
+
+    // A PID is far below PIPE_BUF, so reports from several children never interleave
+    pid_t pid = getpid();
+    if (write(fd, &pid, sizeof(pid)) != sizeof(pid)) {
+        perror("notify_ready");
+    }
+    close(fd);
+}
@@ -0,0 +1,49 @@
+#ifndef LISTEN_SOCKET_H
+#define LISTEN_SOCKET_H
+
+// Socket activation, after systemd's protocol. The watchdog binds every
+// component's listening socket once and keeps it open across restarts, so
+// clients that connect while a component is being respawned wait in the
+// kernel backlog instead of being refused. A spawned component finds its
+// socket at LISTEN_FDS_START, announced by LISTEN_PID and LISTEN_FDS in its
+// environment; started by hand, it binds its own.
+//
+// Once it is serving, a component tells the watchdog so by writing its PID
+// to the pipe named by NOTIFY_FD_ENV, in the spirit of sd_notify's READY=1.
+//
+// A warm standby is started with STANDBY_FD_ENV naming its end of a
+// socketpair instead of a role. It does the setup that does not depend on
+// its id, reports ready and waits; when a component of its kind dies, the
+// watchdog sends it the dead one's id and listening socket and it carries
+// on from there, so failover costs a message instead of an exec.
+
+#define LISTEN_FDS_START 3
+#define NOTIFY_FD_ENV "NOTIFY_FD"
+#define STANDBY_FD_ENV "STANDBY_FD"
+
+// Binds a stream socket at `path`, replacing a stale socket file, and
+// listens on it. The descriptor is close-on-exec, so a child only inherits
+// the one it is passed. Returns -1 on failure.
+int listen_socket_create(const char *path, int backlog);
+
+// Called in a forked child before exec: moves `fd` to LISTEN_FDS_START and
+// announces it. Whatever the child had at that number is replaced.
+int listen_socket_pass(int fd);
+
+// Returns the listening socket this process was passed at startup or by
+// standby_wait, or -1 when it was started without one
+int listen_socket_inherited();
+
+// In a standby, reports ready and blocks until the watchdog assigns a
+// role. Returns the id to take over, 0 when this process is not a standby,
+// or -1 when the wait was interrupted or the watchdog went away.
+int standby_wait();
+
+// Watchdog side: hands `id` and its listening socket to the standby on the
+// other end of `channel`
+int standby_assign(int channel, int id, int listen_fd);
+
+// Reports readiness to the watchdog, if it started this process
+void notify_ready();
+
+#endif
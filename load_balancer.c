@@ -8,30 +8,203 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <sys/wait.h>
-#include <sys/select.h>
 #include <sys/time.h>
 
+#include "codel.h"
+#include "breaker.h"
+#include "protocol.h"
+#include "log.h"
+#include "metrics.h"
+#include "hash_ring.h"
+#include "event_loop.h"
+#include "listen_socket.h"
+
 #define LOAD_BALANCER_SOCKET "/tmp/load_balancer"
+#define CONTROL_SOCKET "/tmp/load_balancer.ctl"
+#define STATS_SOCKET "/tmp/load_balancer" STATS_SUFFIX
 #define PROXY_SOCKET_BASE "/tmp/reverse_proxy_"
 #define BUFFER_SIZE 256
+#define MAX_EVENTS 256
+#define RETRY_INTERVAL_MS 10
+#define DEFAULT_NUM_PROXIES 2
+#define MAX_PROXIES 64
+#define DEFAULT_VNODES 100
+#define DEFAULT_POOL_SIZE 8
+#define MAX_CONTROL_LINE 128
+#define PENDING_BUCKETS 4096
+#define DEFAULT_MAX_INFLIGHT 4096
+#define DEFAULT_REQUEST_TIMEOUT_MS 10000
+#define DEADLINE_SWEEP_MS 10 // how often requests in flight are checked for expiry
 
 static int lb_socket = -1;
+static int lb_socket_bound = 0; // ours to unlink, rather than the watchdog's
+static int control_socket = -1;
+static int stats_socket = -1;
+static loop_backend_t io_backend = LOOP_EPOLL;
+static int direct_return = 0; // hand client connections down to the proxies
+static int handoff_sock = -1;
+static double trace_sample = 0.0; // fraction of untraced requests to trace
+static int pool_size = DEFAULT_POOL_SIZE;
+static int num_proxies = DEFAULT_NUM_PROXIES;
+static int vnodes = DEFAULT_VNODES;
+static int max_inflight = DEFAULT_MAX_INFLIGHT; // requests forwarded or waiting, not answered yet
+static uint64_t codel_target_ns = CODEL_DEFAULT_TARGET_NS;
+static uint64_t request_timeout_ns = DEFAULT_REQUEST_TIMEOUT_MS * 1000000ULL; // 0: client deadlines only
+static uint32_t next_request_id = 1;
 static volatile sig_atomic_t should_exit = 0;
 
-typedef struct {
-    int client_id;
-    double value;
-} request_t;
+typedef enum {
+    EP_CLIENT,
+    EP_PROXY,
+    EP_CONTROL,         // operator connection on the control socket
+    EP_CONTROL_LISTENER,
+    EP_STATS_LISTENER
+} endpoint_kind_t;
+
+enum {
+    LB_REQUESTS,
+    LB_VALUES,
+    LB_RESPONSES,
+    LB_FAILURES,
+    LB_CONNECTIONS,
+    LB_HANDOFFS,
+    LB_TRACED,
+    LB_SHED,
+    LB_OVERLOADED,
+    LB_EXPIRED,
+    LB_EJECTIONS,
+    LB_COUNTERS
+};
+
+static const metric_desc_t lb_counters[LB_COUNTERS] = {
+    {"lb_requests_total", "Requests received from clients"},
+    {"lb_values_total", "Values carried by those requests"},
+    {"lb_responses_total", "Responses relayed from the proxies"},
+    {"lb_failures_total", "Requests the load balancer answered with -1 itself"},
+    {"lb_connections_total", "Client connections accepted"},
+    {"lb_handoffs_total", "Client connections handed to a proxy for direct server return"},
+    {"lb_traced_total", "Requests sampled for tracing"},
+    {"lb_shed_total", "Requests answered with an overload response by the load balancer"},
+    {"lb_proxy_overloads_total", "Overload responses relayed from the proxies"},
+    {"lb_expired_total", "Requests the load balancer answered as expired once their deadline passed"},
+    {"lb_proxy_ejections_total", "Times a failing or slow proxy was taken out of rotation"},
+};
+
+enum {
+    LB_LATENCY,
+    LB_HISTOGRAMS
+};
+
+static const metric_desc_t lb_histograms[LB_HISTOGRAMS] = {
+    {"lb_request_duration_seconds", "Time from reading a request to queuing its response"},
+};
+
+// Every socket registered with the event loop starts with an endpoint so it
+// can tell client, control and pooled proxy connections apart. Writes are
+// not issued as soon as a frame is queued: endpoints with new output join
+// the flush list and the whole list is sent as one batch per iteration.
+typedef struct endpoint endpoint_t;
+
+struct endpoint {
+    endpoint_kind_t kind;
+    int fd;
+    int flush_queued;
+    endpoint_t *next_flush;
+};
+
+typedef struct connection connection_t;
+
+// A client connection. Clients may pipeline requests; responses are written
+// back in whatever order the proxies answer them. Control connections reuse
+// the same structure with line-based commands instead of frames.
+struct connection {
+    endpoint_t client; // must stay first
+    int read_closed;   // client finished sending requests
+    int closed;        // socket closed, freed once nothing is outstanding
+    buffer_t in;
+    buffer_t out;
+    int outstanding;   // requests forwarded and not answered yet
+    int proxied;       // kept here after its handoff to a proxy failed
+    connection_t *next; // link in the graveyard
+};
+
+// Long-lived, multiplexed connections to a proxy. Many requests can be in
+// flight on each of them; an idle connection stays registered for reads so
+// a proxy that exits (and is respawned by the watchdog) is noticed before
+// the socket is reused.
+typedef enum {
+    PROXY_CONN_DISCONNECTED,
+    PROXY_CONN_CONNECTING,
+    PROXY_CONN_CONNECTED
+} proxy_conn_state_t;
+
+typedef struct proxy_pool proxy_pool_t;
 
 typedef struct {
-    double result;
-} response_t;
+    endpoint_t ep; // must stay first
+    proxy_conn_state_t state;
+    proxy_pool_t *pool;
+    buffer_t in;
+    buffer_t out;
+    int outstanding;
+    int reused; // has delivered a response since it was connected
+} proxy_conn_t;
+
+// A request forwarded to a proxy, keyed by the ID the load balancer assigned
+// to it. The client's own request ID is restored on the response.
+typedef struct pending pending_t;
+
+struct pending {
+    uint32_t id;
+    uint32_t client_request_id;
+    connection_t *conn;
+    proxy_conn_t *pc;
+    int proxy_id;
+    int retried; // already replayed once on a fresh proxy connection
+    int traced_here; // sampled here; the trace is logged, not returned
+    uint64_t received; // CLOCK_MONOTONIC ns
+    uint64_t deadline; // likewise; 0 when the request has none
+    uint64_t sent;     // when it was handed to a proxy connection
+    uint32_t flags;
+    uint32_t count;  // values carried, so failures can answer each of them
+    uint32_t length;
+    char *payload;   // copy of the request, kept for replays
+    pending_t *next;      // hash chain
+    pending_t *wait_next; // link in a pool wait queue
+};
+
+struct proxy_pool {
+    int proxy_id;
+    int active; // on the hash ring; inactive pools only drain what they carry
+    proxy_conn_t *conns;
+    pending_t *wait_head; // requests waiting for a connection to open
+    pending_t *wait_tail;
+    codel_t codel;    // sheds waiters once the queue delay stays too high
+    int backlog_full; // last connect hit a full backlog, retry next tick
+    breaker_t breaker; // ejected proxies only get probes
+};
+
+// Pools are indexed by proxy ID - 1; clients are mapped to the active ones
+// by a consistent-hash ring over their client IDs, and the clients of an
+// ejected proxy to the proxies that follow it on the ring
+static proxy_pool_t pools[MAX_PROXIES];
+static hash_ring_t ring;
+static endpoint_t control_listener = {EP_CONTROL_LISTENER, -1, 0, NULL};
+static endpoint_t stats_listener = {EP_STATS_LISTENER, -1, 0, NULL};
+static pending_t *pending_table[PENDING_BUCKETS];
+static int num_pending = 0;
+static int num_clients = 0;
+// Connections closed during an event batch, freed once the batch is done
+static connection_t *graveyard = NULL;
+static endpoint_t *flush_list = NULL;
 
 // prompt : Implement signal handler for SIGTERM. 
 void signal_handler(int sig) {
     if (sig == SIGTERM) {
-        printf("[Load Balancer]: Received SIGTERM from watchdog. Terminating.\n");
+        // Logged by the main loop; the logger is not async-signal-safe
         should_exit = 1;
         if (lb_socket != -1) {
             close(lb_socket);
@@ -49,12 +222,41 @@ void setup_signals() {
     sigaction(SIGTERM, &sa_term, NULL);
 }
 
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Uses the socket the watchdog keeps open across restarts, if it passed one
 int create_load_balancer_socket() {
-    // Remove existing socket file
-    unlink(LOAD_BALANCER_SOCKET);
-    
-    lb_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    lb_socket = listen_socket_inherited();
     if (lb_socket == -1) {
+        lb_socket = listen_socket_create(LOAD_BALANCER_SOCKET, SOMAXCONN);
+        if (lb_socket == -1) {
+            return -1;
+        }
+        lb_socket_bound = 1;
+    }
+    
+    if (set_nonblocking(lb_socket) == -1) {
+        perror("fcntl");
+        close(lb_socket);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Operators add and remove proxies at runtime through a second socket that
+// takes one command per line: "add <proxy_id>", "remove <proxy_id>", "list"
+int create_control_socket() {
+    unlink(CONTROL_SOCKET);
+    
+    control_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (control_socket == -1) {
         perror("socket");
         return -1;
     }
@@ -62,26 +264,322 @@ int create_load_balancer_socket() {
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, LOAD_BALANCER_SOCKET);
+    strcpy(addr.sun_path, CONTROL_SOCKET);
     
-    if (bind(lb_socket, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("bind");
-        close(lb_socket);
+    if (bind(control_socket, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(control_socket, 5) == -1 || set_nonblocking(control_socket) == -1) {
+        perror("control socket");
+        close(control_socket);
+        control_socket = -1;
         return -1;
     }
     
-    if (listen(lb_socket, 10) == -1) {
-        perror("listen");
-        close(lb_socket);
-        return -1;
+    control_listener.fd = control_socket;
+    return 0;
+}
+
+int watch_endpoint(endpoint_t *ep, uint32_t events) {
+    return loop_mod(ep->fd, events, ep);
+}
+
+void close_endpoint(endpoint_t *ep) {
+    if (ep->fd != -1) {
+        loop_del(ep->fd);
+        close(ep->fd);
+        ep->fd = -1;
+    }
+}
+
+void close_connection(connection_t *conn) {
+    if (conn->closed) {
+        return;
+    }
+    close_endpoint(&conn->client);
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    conn->closed = 1;
+    if (conn->client.kind == EP_CLIENT) {
+        num_clients--;
     }
     
-    return 0;
+    // Responses still owed to a closed client are dropped when they arrive
+    if (conn->outstanding == 0) {
+        conn->next = graveyard;
+        graveyard = conn;
+    }
+}
+
+void free_graveyard() {
+    while (graveyard != NULL) {
+        connection_t *conn = graveyard;
+        graveyard = conn->next;
+        free(conn);
+    }
+}
+
+void schedule_flush(endpoint_t *ep) {
+    if (!ep->flush_queued) {
+        ep->flush_queued = 1;
+        ep->next_flush = flush_list;
+        flush_list = ep;
+    }
+}
+
+// Re-arms the client socket and closes it once the client has stopped
+// sending and every response has been written. Output waiting for the
+// flush batch does not need write readiness.
+void update_connection(connection_t *conn) {
+    if (conn->closed) {
+        return;
+    }
+    if (conn->read_closed && conn->outstanding == 0 && buffer_pending(&conn->out) == 0) {
+        close_connection(conn);
+        return;
+    }
+    
+    uint32_t events = conn->read_closed ? 0 : EPOLLIN;
+    if (buffer_pending(&conn->out) > 0 && !conn->client.flush_queued) {
+        events |= EPOLLOUT;
+    }
+    if (watch_endpoint(&conn->client, events) == -1) {
+        perror("loop_mod");
+        close_connection(conn);
+    }
+}
+
+// Queues a response frame that was produced further down the chain, with
+// its trace when the client asked for one
+void send_response(connection_t *conn, uint32_t request_id, uint32_t flags,
+                   const char *payload, uint32_t length, trace_t *trace) {
+    if (conn->closed) {
+        return;
+    }
+
+    // Send response back to client
+    if (trace != NULL) {
+        trace->stamps[TRACE_LB_REPLIED] = trace_now();
+    }
+    if (frame_append_traced(&conn->out, FRAME_RESPONSE, flags, request_id, payload, length, trace) == -1) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Load Balancer]: Error sending response to client\n");
+        close_connection(conn);
+        return;
+    }
+    schedule_flush(&conn->client);
+}
+
+void send_failure(connection_t *conn, uint32_t request_id, uint32_t flags, uint32_t count) {
+    if (conn->closed) {
+        return;
+    }
+    
+    metrics_add(LB_FAILURES, 1);
+    if (frame_append_failure(&conn->out, flags, request_id, count, -1.0) == -1) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Load Balancer]: Error sending response to client\n");
+        close_connection(conn);
+        return;
+    }
+    schedule_flush(&conn->client);
+}
+
+void insert_pending(pending_t *p) {
+    pending_t **bucket = &pending_table[p->id % PENDING_BUCKETS];
+    p->next = *bucket;
+    *bucket = p;
+    num_pending++;
+}
+
+pending_t *find_pending(uint32_t id) {
+    pending_t *p = pending_table[id % PENDING_BUCKETS];
+    while (p != NULL && p->id != id) {
+        p = p->next;
+    }
+    return p;
+}
+
+pending_t *remove_pending(uint32_t id) {
+    pending_t **link = &pending_table[id % PENDING_BUCKETS];
+    while (*link != NULL) {
+        pending_t *p = *link;
+        if (p->id == id) {
+            *link = p->next;
+            num_pending--;
+            return p;
+        }
+        link = &p->next;
+    }
+    return NULL;
+}
+
+void proxy_ejected(proxy_pool_t *pool, const char *why) {
+    log_msg(LOG_WARN, "[Load Balancer]: Ejecting Proxy #%d (%s)\n", pool->proxy_id, why);
+    metrics_add(LB_EJECTIONS, 1);
+}
+
+void proxy_reinstated(proxy_pool_t *pool) {
+    log_msg(LOG_INFO, "[Load Balancer]: Proxy #%d is answering again\n", pool->proxy_id);
+}
+
+void record_proxy_failure(proxy_pool_t *pool) {
+    if (breaker_failure(&pool->breaker, trace_now())) {
+        proxy_ejected(pool, "failing");
+    }
+}
+
+int proxy_usable(int proxy_id, void *arg) {
+    return breaker_available(&pools[proxy_id - 1].breaker, *(const uint64_t *)arg);
+}
+
+// The proxy the client's requests go to, or -1 when there is none
+int route_client(int client_id, uint64_t now) {
+    return ring_lookup_usable(&ring, (uint32_t)client_id, proxy_usable, &now);
+}
+
+// Proxies off the ring are neither compared nor count as peers
+void eject_outliers(uint64_t now) {
+    breaker_t *group[MAX_PROXIES];
+    proxy_pool_t *members[MAX_PROXIES];
+    int n = 0;
+    for (int i = 0; i < MAX_PROXIES; i++) {
+        if (pools[i].active) {
+            members[n] = &pools[i];
+            group[n++] = &pools[i].breaker;
+        }
+    }
+    uint64_t ejected = breaker_eject_outliers(group, n, now);
+    for (int i = 0; i < n; i++) {
+        if (ejected & (1ULL << i)) {
+            proxy_ejected(members[i], "latency outlier");
+        }
+    }
+}
+
+// Closes a pooled connection that has nothing in flight
+void release_proxy_conn(proxy_conn_t *pc) {
+    close_endpoint(&pc->ep);
+    buffer_free(&pc->in);
+    buffer_free(&pc->out);
+    pc->state = PROXY_CONN_DISCONNECTED;
+    pc->reused = 0;
+}
+
+// Retires the request and answers the client. A NULL payload reports a
+// failure for every value the request carried, with the reason taken from
+// the FRAME_FAILURE_FLAGS in `flags`.
+void complete_pending(pending_t *p, uint32_t flags, const char *payload, uint32_t length) {
+    connection_t *conn = p->conn;
+    
+    remove_pending(p->id);
+    if (p->pc != NULL) {
+        proxy_pool_t *pool = p->pc->pool;
+        p->pc->outstanding--;
+        if (payload != NULL && breaker_success(&pool->breaker)) {
+            proxy_reinstated(pool);
+        }
+        if (payload != NULL && !(flags & FRAME_FAILURE_FLAGS)) {
+            breaker_latency(&pool->breaker, trace_now() - p->sent);
+        }
+    }
+    conn->outstanding--;
+    
+    if (payload != NULL) {
+        trace_t trace;
+        int traced = trace_extract(flags, payload, &length, &trace) == 0;
+        if (traced) {
+            trace.stamps[TRACE_LB_RESPONSE] = trace_now();
+        }
+        if (traced && p->traced_here) {
+            char breakdown[512];
+            trace_format(&trace, breakdown, sizeof(breakdown));
+            log_msg(LOG_INFO, "[Load Balancer]: Trace of a request from Client #%d: %s\n",
+                              request_client_id(p->payload), breakdown);
+            traced = 0;
+        }
+        if (flags & FRAME_FLAG_OVERLOAD) {
+            metrics_add(LB_OVERLOADED, 1);
+        }
+        metrics_add(LB_RESPONSES, 1);
+        send_response(conn, p->client_request_id, flags, payload, length, traced ? &trace : NULL);
+    } else {
+        send_failure(conn, p->client_request_id, p->flags | (flags & FRAME_FAILURE_FLAGS), p->count);
+    }
+    metrics_observe(LB_LATENCY, trace_now() - p->received);
+    free(p->payload);
+    free(p);
+    
+    if (conn->closed) {
+        if (conn->outstanding == 0) {
+            conn->next = graveyard;
+            graveyard = conn;
+        }
+    } else {
+        update_connection(conn);
+    }
+}
+
+void fail_pending(pending_t *p) {
+    complete_pending(p, 0, NULL, 0);
+}
+
+void shed_pending(pending_t *p) {
+    LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Load Balancer]: Overloaded, shedding requests\n");
+    metrics_add(LB_SHED, 1);
+    complete_pending(p, FRAME_FLAG_OVERLOAD, NULL, 0);
+}
+
+// A proxy that lets requests run past their deadline counts as failing
+void expire_pending(pending_t *p) {
+    LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Load Balancer]: Request deadline passed, giving up on it\n");
+    metrics_add(LB_EXPIRED, 1);
+    if (p->pc != NULL) {
+        record_proxy_failure(p->pc->pool);
+    }
+    complete_pending(p, FRAME_FLAG_EXPIRED, NULL, 0);
 }
 
-int connect_to_proxy(int proxy_id) {
+// Gives up on the requests forwarded to a proxy whose deadline has passed;
+// a late answer is dropped like any answer to a failed request. Requests
+// still waiting for a connection are checked when they are dispatched.
+void expire_requests(uint64_t now) {
+    for (int i = 0; i < PENDING_BUCKETS && num_pending > 0; i++) {
+        pending_t *p = pending_table[i];
+        while (p != NULL) {
+            pending_t *next = p->next;
+            if (p->pc != NULL && p->deadline != 0 && p->deadline <= now) {
+                expire_pending(p);
+            }
+            p = next;
+        }
+    }
+}
+
+void enqueue_waiter(proxy_pool_t *pool, pending_t *p) {
+    p->wait_next = NULL;
+    if (pool->wait_tail != NULL) {
+        pool->wait_tail->wait_next = p;
+    } else {
+        pool->wait_head = p;
+    }
+    pool->wait_tail = p;
+}
+
+void update_proxy_conn(proxy_conn_t *pc) {
+    uint32_t events = EPOLLIN | EPOLLRDHUP;
+    if (pc->state == PROXY_CONN_CONNECTING ||
+        (buffer_pending(&pc->out) > 0 && !pc->ep.flush_queued)) {
+        events |= EPOLLOUT;
+    }
+    if (watch_endpoint(&pc->ep, events) == -1) {
+        perror("loop_mod");
+    }
+}
+
+// Starts a non-blocking connect to the pool's proxy. Returns 0 when the
+// connect completed or is in progress, 1 when the proxy's backlog is full
+// and the connect should be retried later, 2 when nothing listens on the
+// proxy's socket, and -1 on any other failure.
+int connect_to_proxy(proxy_conn_t *pc) {
     char socket_path[256];
-    snprintf(socket_path, sizeof(socket_path), "%s%d", PROXY_SOCKET_BASE, proxy_id);
+    snprintf(socket_path, sizeof(socket_path), "%s%d", PROXY_SOCKET_BASE, pc->pool->proxy_id);
     
     int sock = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sock == -1) {
@@ -89,108 +587,953 @@ int connect_to_proxy(int proxy_id) {
         return -1;
     }
     
+    if (set_nonblocking(sock) == -1) {
+        perror("fcntl");
+        close(sock);
+        return -1;
+    }
+    
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
     strcpy(addr.sun_path, socket_path);
     
+    pc->state = PROXY_CONN_CONNECTED;
     if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("connect");
+        int err = errno;
+        if (err != EINPROGRESS) {
+            close(sock);
+            pc->state = PROXY_CONN_DISCONNECTED;
+            if (err == EAGAIN) {
+                return 1;
+            }
+            return err == ECONNREFUSED || err == ENOENT ? 2 : -1;
+        }
+        pc->state = PROXY_CONN_CONNECTING;
+    }
+    
+    pc->ep.fd = sock;
+    if (loop_add(sock, EPOLLIN | EPOLLRDHUP | EPOLLOUT, &pc->ep) == -1) {
+        perror("loop_add");
         close(sock);
+        pc->ep.fd = -1;
+        pc->state = PROXY_CONN_DISCONNECTED;
         return -1;
     }
     
-    return sock;
+    return 0;
 }
 
-void process_request(int client_sock) {
-    request_t req;
-    response_t resp;
+// Picks the least loaded connection of the pool, opening another one while
+// every established connection already has requests in flight. Returns NULL
+// with *status set to what connect_to_proxy() returned, or to 1 when the
+// request has to wait for a connect retry.
+proxy_conn_t *select_proxy_conn(proxy_pool_t *pool, int *status) {
+    proxy_conn_t *best = NULL;
+    proxy_conn_t *free_slot = NULL;
+    
+    *status = -1;
+    for (int i = 0; i < pool_size; i++) {
+        proxy_conn_t *pc = &pool->conns[i];
+        if (pc->state == PROXY_CONN_DISCONNECTED) {
+            if (free_slot == NULL) {
+                free_slot = pc;
+            }
+        } else if (best == NULL || pc->outstanding < best->outstanding) {
+            best = pc;
+        }
+    }
     
-    ssize_t bytes_read = recv(client_sock, &req, sizeof(req), 0);
-    if (bytes_read != sizeof(req)) {
-        printf("[Load Balancer]: Error reading request\n");
+    if ((best == NULL || best->outstanding > 0) && free_slot != NULL && !pool->backlog_full) {
+        int ret = connect_to_proxy(free_slot);
+        if (ret == 0) {
+            return free_slot;
+        }
+        if (ret == 1) {
+            pool->backlog_full = 1;
+        }
+        *status = ret;
+    }
+    
+    if (best == NULL && pool->backlog_full) {
+        *status = 1;
+    }
+    return best;
+}
+
+void dispatch_request(pending_t *p) {
+    proxy_pool_t *pool = &pools[p->proxy_id - 1];
+    uint64_t now = trace_now();
+    int status;
+    
+    if (!pool->active || !breaker_available(&pool->breaker, now)) {
+        // The proxy was removed or ejected after the request was routed to it
+        p->proxy_id = route_client(request_client_id(p->payload), now);
+        if (p->proxy_id == -1) {
+            LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Load Balancer]: No proxies available\n");
+            fail_pending(p);
+            return;
+        }
+        pool = &pools[p->proxy_id - 1];
+    }
+    
+    proxy_conn_t *pc = select_proxy_conn(pool, &status);
+    if (pc == NULL) {
+        if (status == 1) {
+            enqueue_waiter(pool, p);
+            return;
+        }
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                 "[Load Balancer]: Failed to connect to Proxy #%d\n", p->proxy_id);
+        if (status == 2) {
+            // Nothing listens on the proxy's socket, so there is no point in
+            // waiting for more failures; the request moves on to the next proxy
+            if (breaker_eject(&pool->breaker, now)) {
+                proxy_ejected(pool, "refused a connection");
+            }
+            dispatch_request(p);
+            return;
+        }
+        // Other failures, such as running out of descriptors, are more likely
+        // this process's own, so they only count toward ejecting the proxy
+        // and do not send the request around the ring
+        record_proxy_failure(pool);
+        fail_pending(p);
+        return;
+    }
+    
+    // Forward request to proxy under the load balancer's own request ID
+    breaker_sent(&pool->breaker, now);
+    p->pc = pc;
+    p->sent = now;
+    pc->outstanding++;
+    trace_stamp(p->flags, p->payload, p->length, TRACE_LB_FORWARDED);
+    if (frame_append(&pc->out, FRAME_REQUEST, p->flags, p->id, p->payload, p->length) == -1) {
+        fail_pending(p);
         return;
     }
+    if (pc->state == PROXY_CONN_CONNECTED) {
+        schedule_flush(&pc->ep);
+    }
+}
+
+// Requests that waited too long for a connection are shed instead of
+// adding to the proxy's backlog once it opens up
+void dispatch_waiters(proxy_pool_t *pool) {
+    pending_t *list = pool->wait_head;
+    pool->wait_head = pool->wait_tail = NULL;
+    
+    uint64_t now = trace_now();
+    while (list != NULL) {
+        pending_t *p = list;
+        list = p->wait_next;
+        if (p->deadline != 0 && p->deadline <= now) {
+            expire_pending(p);
+        } else if (codel_should_shed(&pool->codel, now - p->received, now)) {
+            shed_pending(p);
+        } else {
+            dispatch_request(p);
+        }
+    }
+}
+
+// Puts a proxy on the hash ring. Only the clients that hash onto its
+// virtual nodes move to it. Returns 0 on success and -1 otherwise.
+int add_proxy(int proxy_id) {
+    if (proxy_id < 1 || proxy_id > MAX_PROXIES) {
+        return -1;
+    }
     
-    // Hash function: odd client IDs go to proxy 1, even to proxy 2
-    int proxy_id = (req.client_id % 2 == 1) ? 1 : 2;
+    proxy_pool_t *pool = &pools[proxy_id - 1];
+    if (pool->active) {
+        return -1;
+    }
+    if (pool->conns == NULL) {
+        pool->conns = calloc(pool_size, sizeof(proxy_conn_t));
+        if (pool->conns == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        for (int j = 0; j < pool_size; j++) {
+            pool->conns[j].ep.kind = EP_PROXY;
+            pool->conns[j].ep.fd = -1;
+            pool->conns[j].pool = pool;
+        }
+        codel_init(&pool->codel, codel_target_ns, CODEL_DEFAULT_INTERVAL_NS);
+    }
+    if (ring_add(&ring, proxy_id) == -1) {
+        return -1;
+    }
     
-    printf("[Load balancer]: Request from Client #%d. Forwarding to Proxy #%d\n", 
-           req.client_id, proxy_id);
+    pool->active = 1;
+    breaker_init(&pool->breaker);
+    log_msg(LOG_INFO, "[Load Balancer]: Added Proxy #%d\n", proxy_id);
+    return 0;
+}
+
+// Takes a proxy off the hash ring. Requests already sent to it still get
+// their answers; its idle connections are closed right away and busy ones
+// once they drain, and requests waiting for a connection are rerouted.
+int remove_proxy(int proxy_id) {
+    if (proxy_id < 1 || proxy_id > MAX_PROXIES || !pools[proxy_id - 1].active) {
+        return -1;
+    }
+    
+    proxy_pool_t *pool = &pools[proxy_id - 1];
+    ring_remove(&ring, proxy_id);
+    pool->active = 0;
+    log_msg(LOG_INFO, "[Load Balancer]: Removed Proxy #%d\n", proxy_id);
+    
+    for (int j = 0; j < pool_size; j++) {
+        if (pool->conns[j].state != PROXY_CONN_DISCONNECTED && pool->conns[j].outstanding == 0) {
+            release_proxy_conn(&pool->conns[j]);
+        }
+    }
+    dispatch_waiters(pool);
+    return 0;
+}
+
+int init_pools() {
+    for (int i = 0; i < MAX_PROXIES; i++) {
+        pools[i].proxy_id = i + 1;
+    }
     
-    // Connect to selected proxy
-    int proxy_sock = connect_to_proxy(proxy_id);
-    if (proxy_sock == -1) {
-        printf("[Load Balancer]: Failed to connect to Proxy #%d\n", proxy_id);
-        resp.result = -1.0;
-        send(client_sock, &resp, sizeof(resp), 0);
+    ring_init(&ring, vnodes);
+    for (int i = 1; i <= num_proxies; i++) {
+        if (add_proxy(i) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// A pooled connection broke. Requests that were in flight on a connection
+// which had already served responses are replayed once on a fresh
+// connection, since the proxy was most likely respawned in the meantime.
+void proxy_conn_failed(proxy_conn_t *pc, const char *what) {
+    int was_reused = pc->reused;
+    pending_t *replay = NULL;
+    
+    close_endpoint(&pc->ep);
+    buffer_free(&pc->in);
+    buffer_free(&pc->out);
+    pc->state = PROXY_CONN_DISCONNECTED;
+    pc->reused = 0;
+    
+    if (pc->outstanding > 0) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Load Balancer]: %s\n", what);
+        record_proxy_failure(pc->pool);
+    }
+    
+    for (int i = 0; i < PENDING_BUCKETS && pc->outstanding > 0; i++) {
+        pending_t *p = pending_table[i];
+        while (p != NULL) {
+            pending_t *next = p->next;
+            if (p->pc == pc) {
+                if (was_reused && !p->retried) {
+                    remove_pending(p->id);
+                    pc->outstanding--;
+                    p->pc = NULL;
+                    p->retried = 1;
+                    p->wait_next = replay;
+                    replay = p;
+                } else {
+                    fail_pending(p);
+                }
+            }
+            p = next;
+        }
+    }
+    
+    while (replay != NULL) {
+        pending_t *p = replay;
+        replay = p->wait_next;
+        insert_pending(p);
+        dispatch_request(p);
+    }
+}
+
+void handle_proxy_event(proxy_conn_t *pc, uint32_t events) {
+    if (pc->state == PROXY_CONN_DISCONNECTED) {
+        return; // Stale event for a connection closed earlier in this batch
+    }
+    
+    if (pc->state == PROXY_CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(pc->ep.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            proxy_conn_failed(pc, "Error connecting to proxy");
+            return;
+        }
+        pc->state = PROXY_CONN_CONNECTED;
+    }
+    
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // Receive responses from proxy. An idle connection only becomes
+        // readable when the proxy has gone away, which doubles as the
+        // pool's health check.
+        ssize_t n = buffer_read_fd(&pc->in, pc->ep.fd);
+        if (n == 0 || (n == -1 && errno != EAGAIN)) {
+            proxy_conn_failed(pc, "Error receiving from proxy");
+            return;
+        }
+    
+        frame_header_t hdr;
+        const char *payload;
+        int ret;
+        while ((ret = frame_next(&pc->in, &hdr, &payload)) == 1) {
+            pending_t *p = find_pending(hdr.request_id);
+            if (p == NULL || p->pc != pc || hdr.type != FRAME_RESPONSE) {
+                continue; // Answer to a request that already failed
+            }
+    
+            pc->reused = 1;
+            complete_pending(p, hdr.flags, payload, hdr.length);
+        }
+        if (ret == -1) {
+            proxy_conn_failed(pc, "Error receiving from proxy");
+            return;
+        }
+    }
+    
+    if (!pc->pool->active && pc->outstanding == 0) {
+        release_proxy_conn(pc); // Drained after its proxy was removed
         return;
     }
     
-    // Forward request to proxy
-    if (send(proxy_sock, &req, sizeof(req), 0) == -1) {
-        printf("[Load Balancer]: Error sending to proxy\n");
-        close(proxy_sock);
+    // Forward queued requests to proxy
+    if (buffer_pending(&pc->out) > 0) {
+        schedule_flush(&pc->ep);
+    }
+    update_proxy_conn(pc);
+}
+
+void handle_request(connection_t *conn, const frame_header_t *hdr, const char *payload, int count) {
+    // Consistent hash of the client ID, so each client sticks to one proxy
+    int client_id = request_client_id(payload);
+    int proxy_id = route_client(client_id, trace_now());
+    metrics_add(LB_REQUESTS, 1);
+    metrics_add(LB_VALUES, count);
+    if (proxy_id == -1) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                 "[Load Balancer]: No proxies available for Client #%d\n", client_id);
+        send_failure(conn, hdr->request_id, hdr->flags, count);
+        return;
+    }
+    if (num_pending >= max_inflight) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Load Balancer]: Overloaded, shedding requests\n");
+        metrics_add(LB_SHED, 1);
+        send_failure(conn, hdr->request_id, hdr->flags | FRAME_FLAG_OVERLOAD, count);
         return;
     }
     
-    // Receive response from proxy
-    if (recv(proxy_sock, &resp, sizeof(resp), 0) != sizeof(resp)) {
-        printf("[Load Balancer]: Error receiving from proxy\n");
-        close(proxy_sock);
+    // Work on a request its client already gave up on is wasted
+    uint64_t now = trace_now();
+    uint64_t deadline = request_deadline(hdr->flags, payload, hdr->length);
+    if (deadline != 0 && deadline <= now) {
+        metrics_add(LB_EXPIRED, 1);
+        send_failure(conn, hdr->request_id, hdr->flags | FRAME_FLAG_EXPIRED, count);
         return;
     }
     
-    close(proxy_sock);
+    // Sampled requests get a zeroed trace trailer the tiers below fill in
+    int sampled = trace_sample > 0 && !(hdr->flags & FRAME_FLAG_TRACE) &&
+                  rand() < trace_sample * ((double)RAND_MAX + 1);
     
-    // Send response back to client
-    if (send(client_sock, &resp, sizeof(resp), 0) == -1) {
-        printf("[Load Balancer]: Error sending response to client\n");
+    // The copy sent on carries the client's deadline, or the load balancer's
+    // own timeout when that is sooner, for every tier below to enforce
+    pending_t *p = calloc(1, sizeof(*p));
+    if (p != NULL) {
+        p->length = hdr->length;
+        p->flags = hdr->flags;
+        p->payload = request_copy(payload, &p->length, &p->flags,
+                                  request_timeout_ns != 0 ? now + request_timeout_ns : 0, sampled);
     }
+    if (p == NULL || p->payload == NULL) {
+        perror("malloc");
+        free(p);
+        return;
+    }
+    
+    p->traced_here = sampled;
+    p->received = now;
+    p->deadline = request_deadline(p->flags, p->payload, p->length);
+    if (sampled) {
+        metrics_add(LB_TRACED, 1);
+    }
+    trace_stamp(p->flags, p->payload, p->length, TRACE_LB_RECEIVED);
+    p->count = count;
+    p->id = next_request_id++;
+    if (next_request_id == 0) {
+        next_request_id = 1;
+    }
+    p->client_request_id = hdr->request_id;
+    p->conn = conn;
+    
+    p->proxy_id = proxy_id;
+    
+    if (hdr->flags & FRAME_FLAG_BATCH) {
+        LOG_EVERY(LOG_INFO, log_sample,
+                  "[Load balancer]: Batch of %d values from Client #%d. Forwarding to Proxy #%d\n",
+                  count, client_id, p->proxy_id);
+    } else {
+        LOG_EVERY(LOG_INFO, log_sample, "[Load balancer]: Request from Client #%d. Forwarding to Proxy #%d\n",
+                                        client_id, p->proxy_id);
+    }
+    
+    conn->outstanding++;
+    insert_pending(p);
+    dispatch_request(p);
 }
 
-int main() {
+// Direct server return: passes the client's socket, and the bytes read from
+// it so far, to the proxy its first request hashes to. Returns 1 once the
+// connection belongs to the proxy, 0 while the first request is incomplete
+// and -1 when the connection has to be served here after all.
+int hand_off_client(connection_t *conn) {
+    size_t start = conn->in.off;
+    frame_header_t hdr;
+    const char *payload;
+    int ret = frame_next(&conn->in, &hdr, &payload);
+    conn->in.off = start;
+    if (ret == 0 && !conn->read_closed) {
+        return 0;
+    }
+    if (ret != 1 || request_value_count(&hdr, payload) == -1) {
+        return -1;
+    }
+    
+    int client_id = request_client_id(payload);
+    int proxy_id = route_client(client_id, trace_now());
+    if (proxy_id == -1) {
+        return -1;
+    }
+    
+    char path[256];
+    snprintf(path, sizeof(path), "%s%d%s", PROXY_SOCKET_BASE, proxy_id, HANDOFF_SUFFIX);
+    if (handoff_send(handoff_sock, path, conn->client.fd, conn->in.data + conn->in.off,
+                     buffer_pending(&conn->in)) == -1) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                 "[Load Balancer]: Cannot hand Client #%d to Proxy #%d (%s), forwarding its requests\n",
+                 client_id, proxy_id, strerror(errno));
+        return -1;
+    }
+    
+    LOG_EVERY(LOG_INFO, log_sample,
+              "[Load balancer]: Handed Client #%d off to Proxy #%d\n", client_id, proxy_id);
+    metrics_add(LB_HANDOFFS, 1);
+    close_connection(conn);
+    return 1;
+}
+
+void handle_client_event(connection_t *conn, uint32_t events) {
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        close_connection(conn); // Client is gone, drop whatever it still awaits
+        return;
+    }
+    
+    if (events & EPOLLIN) {
+        ssize_t n = buffer_read_fd(&conn->in, conn->client.fd);
+        if (n == 0) {
+            conn->read_closed = 1;
+        } else if (n == -1 && errno != EAGAIN) {
+            close_connection(conn);
+            return;
+        }
+    
+        if (direct_return && !conn->proxied) {
+            int handed_off = hand_off_client(conn);
+            if (handed_off == 1) {
+                return;
+            }
+            if (handed_off == 0) {
+                update_connection(conn);
+                return;
+            }
+            conn->proxied = 1;
+        }
+    
+        frame_header_t hdr;
+        const char *payload;
+        int ret;
+        while (!conn->closed && (ret = frame_next(&conn->in, &hdr, &payload)) == 1) {
+            int count = request_value_count(&hdr, payload);
+            if (count == -1) {
+                ret = -1;
+                break;
+            }
+            handle_request(conn, &hdr, payload, count);
+        }
+        if (conn->closed) {
+            return;
+        }
+        if (ret == -1) {
+            LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Load Balancer]: Error reading request\n");
+            close_connection(conn);
+            return;
+        }
+    }
+    
+    if (buffer_pending(&conn->out) > 0) {
+        schedule_flush(&conn->client);
+    }
+    update_connection(conn);
+}
+
+void handle_control_command(connection_t *conn, char *line) {
+    char reply[MAX_PROXIES * 4 + 16];
+    char command[16];
+    int proxy_id;
+    
+    if (sscanf(line, "%15s %d", command, &proxy_id) == 2 && strcmp(command, "add") == 0) {
+        snprintf(reply, sizeof(reply), add_proxy(proxy_id) == 0 ? "OK\n" : "ERR cannot add proxy\n");
+    } else if (sscanf(line, "%15s %d", command, &proxy_id) == 2 && strcmp(command, "remove") == 0) {
+        snprintf(reply, sizeof(reply), remove_proxy(proxy_id) == 0 ? "OK\n" : "ERR cannot remove proxy\n");
+    } else if (sscanf(line, "%15s", command) == 1 && strcmp(command, "list") == 0) {
+        int len = 0;
+        for (int i = 0; i < MAX_PROXIES; i++) {
+            if (pools[i].active) {
+                len += snprintf(reply + len, sizeof(reply) - len, len ? " %d" : "%d", pools[i].proxy_id);
+            }
+        }
+        snprintf(reply + len, sizeof(reply) - len, "\n");
+    } else {
+        snprintf(reply, sizeof(reply), "ERR unknown command\n");
+    }
+    
+    if (buffer_append(&conn->out, reply, strlen(reply)) == -1) {
+        close_connection(conn);
+    }
+}
+
+void handle_control_event(connection_t *conn, uint32_t events) {
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        close_connection(conn);
+        return;
+    }
+    
+    if (events & EPOLLIN) {
+        ssize_t n = buffer_read_fd(&conn->in, conn->client.fd);
+        if (n == 0) {
+            conn->read_closed = 1;
+        } else if (n == -1 && errno != EAGAIN) {
+            close_connection(conn);
+            return;
+        }
+    
+        char *start;
+        char *end;
+        while (!conn->closed && (start = conn->in.data + conn->in.off,
+               end = memchr(start, '\n', buffer_pending(&conn->in))) != NULL) {
+            *end = '\0';
+            conn->in.off += end - start + 1;
+            handle_control_command(conn, start);
+        }
+        if (conn->closed) {
+            return;
+        }
+        if (buffer_pending(&conn->in) > MAX_CONTROL_LINE) {
+            close_connection(conn);
+            return;
+        }
+    }
+    
+    if (buffer_pending(&conn->out) > 0) {
+        schedule_flush(&conn->client);
+    }
+    update_connection(conn);
+}
+
+// Writes the output of every endpoint on the flush list in one batch, then
+// re-arms each of them. Failures found here may queue more output (answers
+// for requests that broke with a proxy connection), which goes out in a
+// further batch.
+void flush_endpoints() {
+    loop_send_t sends[MAX_EVENTS];
+    endpoint_t *batch[MAX_EVENTS];
+    
+    while (flush_list != NULL) {
+        int count = 0;
+        while (flush_list != NULL && count < MAX_EVENTS) {
+            endpoint_t *ep = flush_list;
+            flush_list = ep->next_flush;
+            ep->flush_queued = 0;
+    
+            buffer_t *out;
+            if (ep->kind == EP_PROXY) {
+                proxy_conn_t *pc = (proxy_conn_t *)ep;
+                if (pc->state != PROXY_CONN_CONNECTED) {
+                    continue;
+                }
+                out = &pc->out;
+            } else {
+                connection_t *conn = (connection_t *)ep;
+                if (conn->closed) {
+                    continue;
+                }
+                out = &conn->out;
+            }
+            if (buffer_pending(out) == 0) {
+                continue;
+            }
+            sends[count].fd = ep->fd;
+            sends[count].data = out->data + out->off;
+            sends[count].len = buffer_pending(out);
+            batch[count++] = ep;
+        }
+    
+        loop_send_batch(sends, count);
+    
+        for (int i = 0; i < count; i++) {
+            ssize_t result = sends[i].result;
+            if (batch[i]->kind == EP_PROXY) {
+                proxy_conn_t *pc = (proxy_conn_t *)batch[i];
+                if (pc->state != PROXY_CONN_CONNECTED) {
+                    continue; // Failed while an earlier result was applied
+                }
+                if (result < 0 && result != -EAGAIN) {
+                    proxy_conn_failed(pc, "Error sending to proxy");
+                    continue;
+                }
+                if (result > 0) {
+                    buffer_consume(&pc->out, result);
+                }
+                update_proxy_conn(pc);
+            } else {
+                connection_t *conn = (connection_t *)batch[i];
+                if (conn->closed) {
+                    continue;
+                }
+                if (result < 0 && result != -EAGAIN) {
+                    if (batch[i]->kind == EP_CLIENT) {
+                        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                                 "[Load Balancer]: Error sending response to client\n");
+                    }
+                    close_connection(conn);
+                    continue;
+                }
+                if (result > 0) {
+                    buffer_consume(&conn->out, result);
+                }
+                update_connection(conn);
+            }
+        }
+    }
+}
+
+void add_connection(int client_sock, endpoint_kind_t kind) {
+    connection_t *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL || set_nonblocking(client_sock) == -1) {
+        perror("accept setup");
+        free(conn);
+        close(client_sock);
+        return;
+    }
+    
+    conn->client.kind = kind;
+    conn->client.fd = client_sock;
+    
+    if (loop_add(client_sock, EPOLLIN, &conn->client) == -1) {
+        perror("loop_add");
+        close(client_sock);
+        free(conn);
+        return;
+    }
+    if (kind == EP_CLIENT) {
+        metrics_add(LB_CONNECTIONS, 1);
+        num_clients++;
+    }
+}
+
+// Accepts pending connections on a listening socket as client or control
+// connections. With io_uring the kernel already accepted one.
+void accept_connections(int listen_fd, int accepted, endpoint_kind_t kind) {
+    if (accepted != -1) {
+        add_connection(accepted, kind);
+        return;
+    }
+    
+    while (1) {
+        int client_sock = accept(listen_fd, NULL, NULL);
+        if (client_sock == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !should_exit) {
+                perror("accept");
+            }
+            return;
+        }
+        add_connection(client_sock, kind);
+    }
+}
+
+// Scrape-time state of the event loop, which only this thread touches
+void add_gauges(buffer_t *out) {
+    metrics_family(out, "lb_client_connections", "gauge", "Open client connections");
+    metrics_sample(out, "lb_client_connections", NULL, num_clients);
+    metrics_family(out, "lb_requests_in_flight", "gauge", "Requests forwarded and not answered yet");
+    metrics_sample(out, "lb_requests_in_flight", NULL, num_pending);
+    metrics_family(out, "lb_max_inflight", "gauge", "Requests allowed in flight before shedding");
+    metrics_sample(out, "lb_max_inflight", NULL, max_inflight);
+    
+    char labels[32];
+    metrics_family(out, "lb_proxy_outstanding", "gauge", "Requests in flight per proxy");
+    for (int i = 0; i < MAX_PROXIES; i++) {
+        if (pools[i].conns == NULL) {
+            continue;
+        }
+        int outstanding = 0;
+        for (int j = 0; j < pool_size; j++) {
+            outstanding += pools[i].conns[j].outstanding;
+        }
+        snprintf(labels, sizeof(labels), "proxy=\"%d\"", pools[i].proxy_id);
+        metrics_sample(out, "lb_proxy_outstanding", labels, outstanding);
+    }
+    metrics_family(out, "lb_proxy_ejected", "gauge", "1 while a proxy is out of rotation");
+    for (int i = 0; i < MAX_PROXIES; i++) {
+        if (pools[i].active) {
+            snprintf(labels, sizeof(labels), "proxy=\"%d\"", pools[i].proxy_id);
+            metrics_sample(out, "lb_proxy_ejected", labels, pools[i].breaker.state != BREAKER_CLOSED);
+        }
+    }
+    metrics_family(out, "lb_proxy_waiting", "gauge", "Requests queued for a connection to each proxy");
+    for (int i = 0; i < MAX_PROXIES; i++) {
+        if (pools[i].conns == NULL) {
+            continue;
+        }
+        int waiting = 0;
+        for (pending_t *p = pools[i].wait_head; p != NULL; p = p->wait_next) {
+            waiting++;
+        }
+        snprintf(labels, sizeof(labels), "proxy=\"%d\"", pools[i].proxy_id);
+        metrics_sample(out, "lb_proxy_waiting", labels, waiting);
+    }
+}
+
+void parse_args(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:v:e:r:T:q:D:o:L:S:")) != -1) {
+        switch (opt) {
+        case 'p':
+            pool_size = atoi(optarg);
+            break;
+        case 'n':
+            num_proxies = atoi(optarg);
+            break;
+        case 'v':
+            vnodes = atoi(optarg);
+            break;
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0) {
+                io_backend = LOOP_EPOLL;
+            } else if (strcmp(optarg, "io_uring") == 0) {
+                io_backend = LOOP_IO_URING;
+            } else {
+                fprintf(stderr, "Unknown I/O backend: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            if (strcmp(optarg, "direct") != 0 && strcmp(optarg, "proxied") != 0) {
+                fprintf(stderr, "Unknown return path: %s\n", optarg);
+                exit(1);
+            }
+            direct_return = strcmp(optarg, "direct") == 0;
+            break;
+        case 'T':
+            trace_sample = atof(optarg);
+            break;
+        case 'q':
+            max_inflight = atoi(optarg);
+            break;
+        case 'D':
+            codel_target_ns = strtoull(optarg, NULL, 10) * 1000000;
+            break;
+        case 'o':
+            request_timeout_ns = strtoull(optarg, NULL, 10) * 1000000;
+            break;
+        case 'L':
+            if (log_parse_level(optarg, &log_level) == -1) {
+                fprintf(stderr, "Unknown log level: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'S':
+            log_sample = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p connections_per_proxy] [-n proxies] [-v virtual_nodes] "
+                    "[-e epoll|io_uring] [-r proxied|direct] [-T trace_sample_fraction] "
+                    "[-q max_inflight] [-D codel_target_ms] [-o request_timeout_ms] "
+                    "[-L debug|info|warn|error|off] [-S log_one_request_in]\n", argv[0]);
+            exit(1);
+        }
+    }
+    
+    if (pool_size < 1) {
+        fprintf(stderr, "Pool size must be at least 1\n");
+        exit(1);
+    }
+    if (num_proxies < 0 || num_proxies > MAX_PROXIES) {
+        fprintf(stderr, "Number of proxies must be between 0 and %d\n", MAX_PROXIES);
+        exit(1);
+    }
+    if (vnodes < 1) {
+        fprintf(stderr, "Virtual nodes per proxy must be at least 1\n");
+        exit(1);
+    }
+    if (max_inflight < 1) {
+        fprintf(stderr, "In-flight limit must be at least 1\n");
+        exit(1);
+    }
+    if (trace_sample < 0 || trace_sample > 1) {
+        fprintf(stderr, "Trace sample fraction must be between 0 and 1\n");
+        exit(1);
+    }
+    if (log_sample < 1) {
+        fprintf(stderr, "Log sampling must be at least 1\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+    if (log_init(STDOUT_FILENO) == -1) {
+        perror("log_init"); // Messages are written directly instead
+    }
     setup_signals();
     
-    printf("[Load Balancer]: Started\n");
+    log_msg(LOG_INFO, "[Load Balancer]: Started\n");
     
     if (create_load_balancer_socket() == -1) {
         exit(1);
     }
     
+    if (loop_init(io_backend) == -1) {
+        if (io_backend != LOOP_IO_URING) {
+            perror("loop_init");
+            exit(1);
+        }
+        log_msg(LOG_WARN, "[Load Balancer]: io_uring unavailable (%s), using epoll\n", strerror(errno));
+        if (loop_init(LOOP_EPOLL) == -1) {
+            perror("loop_init");
+            exit(1);
+        }
+    }
+    
+    if (init_pools() == -1) {
+        exit(1);
+    }
+    
+    if (direct_return && (handoff_sock = handoff_socket(NULL)) == -1) {
+        perror("handoff socket");
+        direct_return = 0;
+    }
+    
+    // The listening socket is registered with a NULL endpoint
+    if (loop_add_listener(lb_socket, NULL) == -1) {
+        perror("loop_add_listener");
+        exit(1);
+    }
+    
+    // Runtime reconfiguration is optional; balancing works without it
+    if (create_control_socket() == 0 && loop_add_listener(control_socket, &control_listener) == -1) {
+        perror("loop_add_listener");
+    }
+    
+    // So are statistics
+    metrics_init(lb_counters, LB_COUNTERS, lb_histograms, LB_HISTOGRAMS);
+    stats_socket = metrics_socket(STATS_SOCKET);
+    if (stats_socket != -1 && loop_add_listener(stats_socket, &stats_listener) == -1) {
+        perror("loop_add_listener");
+    }
+    
+    loop_event_t events[MAX_EVENTS];
+    uint64_t next_sweep = 0;
+    uint64_t next_outlier_sweep = 0;
+    notify_ready();
+    
     while (!should_exit) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(lb_socket, &readfds);
-        
-        struct timeval timeout = {1, 0}; // 1 second timeout
-        
-        int ready = select(lb_socket + 1, &readfds, NULL, NULL, &timeout);
+        int timeout = 1000;
+        for (int i = 0; i < MAX_PROXIES; i++) {
+            if (pools[i].wait_head != NULL) {
+                timeout = RETRY_INTERVAL_MS;
+            }
+        }
+        if (num_pending > 0 && timeout > DEADLINE_SWEEP_MS) {
+            timeout = DEADLINE_SWEEP_MS;
+        }
+    
+        int ready = loop_wait(events, MAX_EVENTS, timeout);
         if (ready == -1) {
             if (errno == EINTR) continue; // Interrupted by signal
-            perror("select");
+            perror("loop_wait");
             break;
         }
-        
-        if (ready > 0 && FD_ISSET(lb_socket, &readfds)) {
-            int client_sock = accept(lb_socket, NULL, NULL);
-            if (client_sock == -1) {
-                if (errno == EINTR) continue;
-                perror("accept");
-                continue;
+    
+        for (int i = 0; i < ready; i++) {
+            endpoint_t *ep = events[i].ptr;
+            if (ep == NULL) {
+                accept_connections(lb_socket, events[i].fd, EP_CLIENT);
+            } else if (ep->kind == EP_CONTROL_LISTENER) {
+                accept_connections(control_socket, events[i].fd, EP_CONTROL);
+            } else if (ep->kind == EP_STATS_LISTENER) {
+                metrics_serve(stats_socket, events[i].fd, add_gauges);
+            } else if (ep->kind == EP_PROXY) {
+                handle_proxy_event((proxy_conn_t *)ep, events[i].events);
+            } else {
+                connection_t *conn = (connection_t *)ep;
+                if (conn->closed) {
+                    continue;
+                }
+                if (ep->kind == EP_CONTROL) {
+                    handle_control_event(conn, events[i].events);
+                } else {
+                    handle_client_event(conn, events[i].events);
+                }
+            }
+        }
+    
+        // Retry connects that previously hit a full proxy backlog
+        for (int i = 0; i < MAX_PROXIES; i++) {
+            pools[i].backlog_full = 0;
+            if (pools[i].wait_head != NULL) {
+                dispatch_waiters(&pools[i]);
             }
-            
-            process_request(client_sock);
-            close(client_sock);
         }
+    
+        uint64_t now = trace_now();
+        if (num_pending > 0 && now >= next_sweep) {
+            expire_requests(now);
+            next_sweep = now + DEADLINE_SWEEP_MS * 1000000ULL;
+        }
+        if (now >= next_outlier_sweep) {
+            eject_outliers(now);
+            next_outlier_sweep = now + BREAKER_INTERVAL_NS;
+        }
+    
+        flush_endpoints();
+        free_graveyard();
+    }
+    if (should_exit) {
+        log_msg(LOG_INFO, "[Load Balancer]: Received SIGTERM from watchdog. Terminating.\n");
     }
     
     // Clean up
     if (lb_socket != -1) {
         close(lb_socket);
-        unlink(LOAD_BALANCER_SOCKET);
+        if (lb_socket_bound) {
+            unlink(LOAD_BALANCER_SOCKET);
+        }
+    }
+    if (control_socket != -1) {
+        close(control_socket);
+        unlink(CONTROL_SOCKET);
+    }
+    if (stats_socket != -1) {
+        close(stats_socket);
+        unlink(STATS_SOCKET);
     }
+    ring_destroy(&ring);
     
     return 0;
-} 
\ No newline at end of file
+}
\ No newline at end of file
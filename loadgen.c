@@ -0,0 +1,720 @@
+#define _GNU_SOURCE // ppoll()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "histogram.h"
+
+#define LOAD_BALANCER_SOCKET "/tmp/load_balancer"
+#define MAX_THREADS 64
+#define MAX_CONNECTIONS 4096
+#define MAX_INFLIGHT 1024            // requests outstanding per connection
+#define MAX_ZIPF_KEYS 10000000
+#define DRAIN_TIMEOUT_NS 2000000000ULL // wait for stragglers after the run
+#define RECONNECT_DELAY_NS 10000000ULL
+
+// Load generator for the whole pipeline. Closed loop keeps `depth` requests
+// outstanding on every connection and sends the next one as soon as one is
+// answered. Open loop sends at a fixed aggregate rate whatever the
+// responses do, so a slow system builds up a queue instead of slowing the
+// generator down.
+//
+// Latencies are recorded in HdrHistogram-style histograms. Open-loop
+// latencies are measured from the time each request was scheduled, not the
+// time it was actually written, so stalls in the generator or the socket
+// are not hidden (coordinated omission). Closed-loop runs can be corrected
+// the same way given the interval the requests were expected at (-x).
+//
+// A sampled fraction of requests (-T) carries a trace that every hop stamps
+// on the way through, and the time spent between consecutive stamps is
+// reported per hop.
+//
+// With a timeout (-o) every request carries a deadline, and requests the
+// pipeline gave up on are counted as expired rather than as latencies.
+
+typedef enum {
+    MODE_CLOSED,
+    MODE_OPEN
+} load_mode_t;
+
+typedef enum {
+    DIST_CONST,
+    DIST_UNIFORM,
+    DIST_EXP,
+    DIST_ZIPF
+} dist_kind_t;
+
+typedef struct {
+    dist_kind_t kind;
+    double a;
+    double b;
+    double *cdf; // zipf only, over the keys 1..a
+} distribution_t;
+
+typedef struct {
+    int fd;
+    buffer_t in;
+    buffer_t out;
+    uint32_t next_id;
+    int inflight;
+    uint64_t retry_at; // reconnect no earlier than this after a failure
+    uint32_t ids[MAX_INFLIGHT]; // 0 marks a free slot
+    uint64_t intended[MAX_INFLIGHT];
+    uint64_t sent[MAX_INFLIGHT];
+    double values[MAX_INFLIGHT]; // first value of each request
+} lg_conn_t;
+
+typedef struct {
+    int index;
+    pthread_t thread;
+    lg_conn_t *conns;
+    int num_conns;
+    uint64_t rng;
+    uint64_t next_due;  // open loop schedule
+    uint64_t interval;
+    int next_conn;
+    histogram_t corrected;
+    histogram_t uncorrected;
+    histogram_t *hops; // TRACE_POINTS, indexed by the stamp ending the hop
+    uint64_t answered;
+    uint64_t failed;    // answered with -1 for a legal value
+    uint64_t shed;      // answered with an overload response
+    uint64_t expired;   // answered after its deadline passed
+    uint64_t errors;    // lost with a broken connection
+    uint64_t unanswered;
+} worker_t;
+
+static load_mode_t mode = MODE_CLOSED;
+static int num_connections = 16;
+static int num_threads = 1;
+static double duration = 10.0;
+static double rate = 0.0;
+static int depth = 1;
+static int batch_size = 1;
+static uint64_t expected_interval = 0; // ns, closed-loop correction
+static double trace_sample = 0.0;
+static uint64_t request_timeout = 0; // ns, 0 sends no deadline
+static distribution_t value_dist = {DIST_UNIFORM, 0.0, 1000.0, NULL};
+static distribution_t client_dist = {DIST_UNIFORM, 1.0, 100.0, NULL};
+static uint64_t start_ns;
+static uint64_t end_ns;
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*, one state per worker
+double next_uniform(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return ((x * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double sample(const distribution_t *dist, uint64_t *rng) {
+    double u = next_uniform(rng);
+    switch (dist->kind) {
+    case DIST_CONST:
+        return dist->a;
+    case DIST_UNIFORM:
+        return dist->a + u * (dist->b - dist->a);
+    case DIST_EXP:
+        return -dist->a * log(1.0 - u);
+    case DIST_ZIPF: {
+        size_t lo = 0;
+        size_t hi = (size_t)dist->a - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (dist->cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo + 1;
+    }
+    }
+    return dist->a;
+}
+
+// Parses const:X, uniform:MIN:MAX, exp:MEAN or zipf:N:S. Returns -1 for a
+// malformed specification.
+int parse_distribution(const char *spec, distribution_t *dist) {
+    char kind[16];
+    double a, b;
+    int fields = sscanf(spec, "%15[^:]:%lf:%lf", kind, &a, &b);
+
+    if (fields == 2 && strcmp(kind, "const") == 0) {
+        dist->kind = DIST_CONST;
+    } else if (fields == 3 && strcmp(kind, "uniform") == 0 && a <= b) {
+        dist->kind = DIST_UNIFORM;
+    } else if (fields == 2 && strcmp(kind, "exp") == 0 && a > 0) {
+        dist->kind = DIST_EXP;
+    } else if (fields == 3 && strcmp(kind, "zipf") == 0 && a >= 1 && a <= MAX_ZIPF_KEYS && b > 0) {
+        dist->kind = DIST_ZIPF;
+        size_t n = (size_t)a;
+        dist->cdf = malloc(n * sizeof(double));
+        if (dist->cdf == NULL) {
+            return -1;
+        }
+        double total = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            total += 1.0 / pow(i + 1, b);
+            dist->cdf[i] = total;
+        }
+        for (size_t i = 0; i < n; i++) {
+            dist->cdf[i] /= total;
+        }
+    } else {
+        return -1;
+    }
+
+    dist->a = a;
+    dist->b = fields == 3 ? b : 0.0;
+    return 0;
+}
+
+int connect_to_load_balancer() {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, LOAD_BALANCER_SOCKET);
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Drops the connection; whatever it still had outstanding is lost
+void conn_failed(worker_t *w, lg_conn_t *conn, uint64_t now) {
+    close(conn->fd);
+    conn->fd = -1;
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    w->errors += conn->inflight;
+    conn->inflight = 0;
+    memset(conn->ids, 0, sizeof(conn->ids));
+    conn->retry_at = now + RECONNECT_DELAY_NS;
+}
+
+// Queues one request scheduled for `intended`. Returns -1 when the
+// connection cannot take it.
+int queue_request(worker_t *w, lg_conn_t *conn, uint64_t intended, uint64_t now) {
+    if (conn->fd == -1) {
+        if (now < conn->retry_at) {
+            return -1;
+        }
+        conn->fd = connect_to_load_balancer();
+        if (conn->fd == -1) {
+            conn->retry_at = now + RECONNECT_DELAY_NS;
+            return -1;
+        }
+    }
+
+    if (conn->next_id == 0) {
+        conn->next_id = 1;
+    }
+    uint32_t id = conn->next_id;
+    int slot = id % MAX_INFLIGHT;
+    if (conn->inflight == MAX_INFLIGHT || conn->ids[slot] != 0) {
+        return -1;
+    }
+    conn->next_id++;
+
+    int client_id = (int)sample(&client_dist, &w->rng);
+    trace_t trace;
+    trace_t *traced = NULL;
+    if (trace_sample > 0 && next_uniform(&w->rng) < trace_sample) {
+        memset(&trace, 0, sizeof(trace));
+        trace.stamps[TRACE_CLIENT_SENT] = now;
+        traced = &trace;
+    }
+    // The deadline goes right after the request, before any trace trailer
+    uint32_t flags = request_timeout > 0 ? FRAME_FLAG_DEADLINE : 0;
+    uint64_t deadline = now + request_timeout;
+    size_t extra = request_timeout > 0 ? sizeof(deadline) : 0;
+    int ret;
+    double first;
+    if (batch_size == 1) {
+        request_t req;
+        req.client_id = client_id;
+        req.value = first = sample(&value_dist, &w->rng);
+        char payload[sizeof(req) + sizeof(deadline)];
+        memcpy(payload, &req, sizeof(req));
+        memcpy(payload + sizeof(req), &deadline, sizeof(deadline));
+        ret = frame_append_traced(&conn->out, FRAME_REQUEST, flags, id, payload, sizeof(req) + extra, traced);
+    } else {
+        size_t length = sizeof(batch_header_t) + batch_size * sizeof(double);
+        char payload[length + sizeof(deadline)];
+        batch_header_t batch;
+        batch.client_id = client_id;
+        batch.count = batch_size;
+        memcpy(payload, &batch, sizeof(batch));
+        for (int i = 0; i < batch_size; i++) {
+            double value = sample(&value_dist, &w->rng);
+            memcpy(payload + sizeof(batch) + i * sizeof(double), &value, sizeof(value));
+        }
+        memcpy(&first, payload + sizeof(batch), sizeof(first));
+        memcpy(payload + length, &deadline, sizeof(deadline));
+        ret = frame_append_traced(&conn->out, FRAME_REQUEST, FRAME_FLAG_BATCH | flags, id, payload,
+                                  length + extra, traced);
+    }
+    if (ret == -1) {
+        return -1;
+    }
+
+    conn->ids[slot] = id;
+    conn->intended[slot] = intended;
+    conn->sent[slot] = now;
+    conn->values[slot] = first;
+    conn->inflight++;
+    return 0;
+}
+
+void record_response(worker_t *w, lg_conn_t *conn, const frame_header_t *hdr,
+                     const char *payload, uint64_t now) {
+    int slot = hdr->request_id % MAX_INFLIGHT;
+    trace_t trace;
+    uint32_t length = hdr->length;
+    int traced = trace_extract(hdr->flags, payload, &length, &trace) == 0;
+    if (hdr->type != FRAME_RESPONSE || conn->ids[slot] != hdr->request_id ||
+        length < sizeof(double)) {
+        return;
+    }
+    conn->ids[slot] = 0;
+    conn->inflight--;
+
+    double result;
+    memcpy(&result, payload, sizeof(result));
+    w->answered++;
+    if (hdr->flags & FRAME_FLAG_OVERLOAD) {
+        // Turned away without being computed, so its latency says nothing
+        w->shed++;
+        return;
+    }
+    if (hdr->flags & FRAME_FLAG_EXPIRED) {
+        w->expired++;
+        return;
+    }
+    if (result == -1.0 && conn->values[slot] >= 0) {
+        w->failed++;
+    }
+
+    uint64_t service = now - conn->sent[slot];
+    hist_record(&w->uncorrected, service);
+    if (mode == MODE_OPEN) {
+        hist_record(&w->corrected, now - conn->intended[slot]);
+    } else {
+        hist_record_corrected(&w->corrected, service, expected_interval);
+    }
+
+    if (traced && w->hops != NULL) {
+        trace.stamps[TRACE_CLIENT_RECEIVED] = now;
+        int prev = -1;
+        for (int i = 0; i < TRACE_POINTS; i++) {
+            if (trace.stamps[i] == 0) {
+                continue;
+            }
+            if (prev != -1 && trace.stamps[i] >= trace.stamps[prev]) {
+                hist_record(&w->hops[i], trace.stamps[i] - trace.stamps[prev]);
+            }
+            prev = i;
+        }
+    }
+}
+
+// Queues every request due by `now`: the open-loop schedule, or enough to
+// keep each connection `depth` deep
+void issue_requests(worker_t *w, uint64_t now) {
+    if (mode == MODE_CLOSED) {
+        for (int i = 0; i < w->num_conns; i++) {
+            lg_conn_t *conn = &w->conns[i];
+            while (conn->inflight < depth && queue_request(w, conn, now, now) == 0) {
+            }
+        }
+        return;
+    }
+
+    // A request that no connection can take stays due; it is sent late and
+    // its latency still counts from its scheduled time
+    while (w->next_due <= now && w->next_due < end_ns) {
+        int queued = 0;
+        for (int tries = 0; tries < w->num_conns && !queued; tries++) {
+            lg_conn_t *conn = &w->conns[w->next_conn];
+            w->next_conn = (w->next_conn + 1) % w->num_conns;
+            queued = queue_request(w, conn, w->next_due, now) == 0;
+        }
+        if (!queued) {
+            break;
+        }
+        w->next_due += w->interval;
+    }
+}
+
+void *worker_main(void *arg) {
+    worker_t *w = arg;
+    struct pollfd fds[w->num_conns];
+    uint64_t drain_deadline = end_ns + DRAIN_TIMEOUT_NS;
+
+    while (1) {
+        uint64_t now = now_ns();
+        int inflight = 0;
+
+        if (now < end_ns) {
+            issue_requests(w, now);
+        }
+
+        for (int i = 0; i < w->num_conns; i++) {
+            lg_conn_t *conn = &w->conns[i];
+            if (conn->fd != -1 && buffer_flush_fd(&conn->out, conn->fd) == -1) {
+                conn_failed(w, conn, now);
+            }
+            fds[i].fd = conn->fd;
+            fds[i].events = buffer_pending(&conn->out) > 0 ? POLLIN | POLLOUT : POLLIN;
+            fds[i].revents = 0;
+            inflight += conn->inflight;
+        }
+
+        if (now >= end_ns && (inflight == 0 || now >= drain_deadline)) {
+            w->unanswered += inflight;
+            break;
+        }
+
+        // Sleep until the next scheduled request, the end of the run or
+        // the drain deadline, whichever comes first
+        uint64_t wake = now < end_ns ? end_ns : drain_deadline;
+        if (mode == MODE_OPEN && w->next_due < wake) {
+            wake = w->next_due;
+        }
+        if (mode == MODE_CLOSED && now < end_ns) {
+            for (int i = 0; i < w->num_conns; i++) {
+                if (w->conns[i].fd == -1 && w->conns[i].retry_at < wake) {
+                    wake = w->conns[i].retry_at;
+                }
+            }
+        }
+        uint64_t wait = wake > now ? wake - now : 0;
+        struct timespec ts = {wait / 1000000000ULL, wait % 1000000000ULL};
+
+        if (ppoll(fds, w->num_conns, &ts, NULL) == -1) {
+            if (errno == EINTR) continue;
+            perror("ppoll");
+            break;
+        }
+
+        now = now_ns();
+        for (int i = 0; i < w->num_conns; i++) {
+            lg_conn_t *conn = &w->conns[i];
+            if (conn->fd == -1 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            ssize_t n = buffer_read_fd(&conn->in, conn->fd);
+            if (n == 0 || (n == -1 && errno != EAGAIN)) {
+                conn_failed(w, conn, now);
+                continue;
+            }
+
+            frame_header_t hdr;
+            const char *payload;
+            int ret;
+            while ((ret = frame_next(&conn->in, &hdr, &payload)) == 1) {
+                record_response(w, conn, &hdr, payload, now);
+            }
+            if (ret == -1) {
+                conn_failed(w, conn, now);
+            }
+        }
+    }
+
+    for (int i = 0; i < w->num_conns; i++) {
+        if (w->conns[i].fd != -1) {
+            close(w->conns[i].fd);
+        }
+        buffer_free(&w->conns[i].in);
+        buffer_free(&w->conns[i].out);
+    }
+    return NULL;
+}
+
+void print_latency(const char *label, const histogram_t *h) {
+    printf("  %-16s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", label,
+           hist_mean(h) / 1000.0,
+           hist_percentile(h, 50.0) / 1000.0,
+           hist_percentile(h, 90.0) / 1000.0,
+           hist_percentile(h, 99.0) / 1000.0,
+           hist_percentile(h, 99.9) / 1000.0,
+           hist_percentile(h, 99.99) / 1000.0,
+           h->total > 0 ? h->max / 1000.0 : 0.0);
+}
+
+// Per-hop histograms are only kept when tracing is on
+int init_hops(histogram_t **hops) {
+    *hops = NULL;
+    if (trace_sample == 0) {
+        return 0;
+    }
+    *hops = calloc(TRACE_POINTS, sizeof(histogram_t));
+    if (*hops == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < TRACE_POINTS; i++) {
+        if (hist_init(&(*hops)[i]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void free_hops(histogram_t *hops) {
+    for (int i = 0; hops != NULL && i < TRACE_POINTS; i++) {
+        hist_free(&hops[i]);
+    }
+    free(hops);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-m closed|open] [-c connections] [-t threads] [-d seconds]\n"
+            "       [-r requests_per_second] [-q depth] [-b batch_size] [-v value_distribution]\n"
+            "       [-i client_id_distribution] [-x expected_interval_us] [-T trace_fraction]\n"
+            "       [-o timeout_ms]\n"
+            "Distributions: const:X, uniform:MIN:MAX, exp:MEAN, zipf:N:S (keys 1..N)\n"
+            "Open loop (-m open) requires -r; closed loop keeps -q requests in flight\n"
+            "per connection and corrects for coordinated omission when -x is given.\n", prog);
+    exit(1);
+}
+
+void parse_args(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "m:c:t:d:r:q:b:v:i:x:T:o:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "closed") == 0) {
+                mode = MODE_CLOSED;
+            } else if (strcmp(optarg, "open") == 0) {
+                mode = MODE_OPEN;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            num_connections = atoi(optarg);
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            break;
+        case 'v':
+            if (parse_distribution(optarg, &value_dist) == -1) {
+                fprintf(stderr, "Invalid value distribution: %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'i':
+            if (parse_distribution(optarg, &client_dist) == -1) {
+                fprintf(stderr, "Invalid client ID distribution: %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'x':
+            expected_interval = (uint64_t)(atof(optarg) * 1000.0);
+            break;
+        case 'T':
+            trace_sample = atof(optarg);
+            break;
+        case 'o':
+            request_timeout = (uint64_t)(atof(optarg) * 1000000.0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    if (num_connections < 1 || num_connections > MAX_CONNECTIONS) {
+        fprintf(stderr, "Connections must be between 1 and %d\n", MAX_CONNECTIONS);
+        exit(1);
+    }
+    if (num_threads < 1 || num_threads > MAX_THREADS || num_threads > num_connections) {
+        fprintf(stderr, "Threads must be between 1 and %d, and at most one per connection\n", MAX_THREADS);
+        exit(1);
+    }
+    if (duration <= 0) {
+        fprintf(stderr, "Duration must be positive\n");
+        exit(1);
+    }
+    if (mode == MODE_OPEN && rate <= 0) {
+        fprintf(stderr, "Open loop needs a positive rate (-r)\n");
+        exit(1);
+    }
+    if (depth < 1 || depth > MAX_INFLIGHT) {
+        fprintf(stderr, "Depth must be between 1 and %d\n", MAX_INFLIGHT);
+        exit(1);
+    }
+    if (trace_sample < 0 || trace_sample > 1) {
+        fprintf(stderr, "Trace fraction must be between 0 and 1\n");
+        exit(1);
+    }
+    if (batch_size < 1 || (size_t)batch_size > MAX_BATCH_SIZE) {
+        fprintf(stderr, "Batch size must be between 1 and %zu\n", (size_t)MAX_BATCH_SIZE);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+
+    worker_t *workers = calloc(num_threads, sizeof(worker_t));
+    lg_conn_t *conns = calloc(num_connections, sizeof(lg_conn_t));
+    if (workers == NULL || conns == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    // Connect everything up front so setup does not count against the run
+    for (int i = 0; i < num_connections; i++) {
+        conns[i].fd = connect_to_load_balancer();
+        if (conns[i].fd == -1) {
+            printf("[Load Generator]: Failed to connect to load balancer\n");
+            exit(1);
+        }
+    }
+
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t)(duration * 1e9);
+
+    // Connections are split evenly; each thread paces its share of the rate
+    int first = 0;
+    for (int i = 0; i < num_threads; i++) {
+        worker_t *w = &workers[i];
+        w->index = i;
+        w->conns = &conns[first];
+        w->num_conns = num_connections / num_threads + (i < num_connections % num_threads);
+        first += w->num_conns;
+        w->rng = 0x9e3779b97f4a7c15ULL * (i + 1) ^ (uint64_t)time(NULL);
+        if (mode == MODE_OPEN) {
+            w->interval = (uint64_t)(1e9 * num_threads / rate);
+            w->next_due = start_ns + w->interval * i / num_threads;
+        }
+        if (hist_init(&w->corrected) == -1 || hist_init(&w->uncorrected) == -1 ||
+            init_hops(&w->hops) == -1) {
+            perror("hist_init");
+            exit(1);
+        }
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    histogram_t corrected, uncorrected;
+    histogram_t *hops;
+    if (hist_init(&corrected) == -1 || hist_init(&uncorrected) == -1 || init_hops(&hops) == -1) {
+        perror("hist_init");
+        exit(1);
+    }
+    uint64_t answered = 0, failed = 0, shed = 0, expired = 0, errors = 0, unanswered = 0;
+    for (int i = 0; i < num_threads; i++) {
+        worker_t *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        hist_merge(&corrected, &w->corrected);
+        hist_merge(&uncorrected, &w->uncorrected);
+        for (int j = 0; hops != NULL && j < TRACE_POINTS; j++) {
+            hist_merge(&hops[j], &w->hops[j]);
+        }
+        answered += w->answered;
+        failed += w->failed;
+        shed += w->shed;
+        expired += w->expired;
+        errors += w->errors;
+        unanswered += w->unanswered;
+        hist_free(&w->corrected);
+        hist_free(&w->uncorrected);
+        free_hops(w->hops);
+    }
+
+    printf("[Load Generator]: %s loop, %d connections on %d thread(s), %.1f s",
+           mode == MODE_OPEN ? "Open" : "Closed", num_connections, num_threads, duration);
+    if (mode == MODE_OPEN) {
+        printf(", target %.1f requests/s\n", rate);
+    } else {
+        printf(", depth %d\n", depth);
+    }
+    printf("  Requests: %llu answered (%llu failed, %llu shed, %llu expired), %llu lost with their "
+           "connection, %llu unanswered\n", (unsigned long long)answered, (unsigned long long)failed,
+           (unsigned long long)shed, (unsigned long long)expired, (unsigned long long)errors,
+           (unsigned long long)unanswered);
+    // Shed and expired requests are left out of the throughput and the latencies
+    uint64_t served = answered - shed - expired;
+    printf("  Throughput: %.1f requests/s, %.1f values/s\n",
+           served / duration, served * (double)batch_size / duration);
+    printf("  Latency (us)          mean       p50       p90       p99     p99.9    p99.99       max\n");
+    if (mode == MODE_OPEN || expected_interval > 0) {
+        print_latency("corrected", &corrected);
+        print_latency("uncorrected", &uncorrected);
+    } else {
+        print_latency("service", &uncorrected);
+    }
+    if (hops != NULL) {
+        printf("  Traced hops (us)      mean       p50       p90       p99     p99.9    p99.99       max\n");
+        for (int i = 0; i < TRACE_POINTS; i++) {
+            if (hops[i].total > 0) {
+                print_latency(trace_point_names[i], &hops[i]);
+            }
+        }
+    }
+
+    hist_free(&corrected);
+    hist_free(&uncorrected);
+    free_hops(hops);
+    free(conns);
+    free(workers);
+    free(value_dist.cdf);
+    free(client_dist.cdf);
+    return 0;
+}
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE // CLOCK_MONOTONIC_COARSE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "queue.h"
+
+#define FLUSH_BUFFER_SIZE 65536
+#define SWEEP_INTERVAL_NS 1000000 // between sweeps unless the rings are filling up
+
+typedef struct {
+    uint16_t len;
+    char text[LOG_RECORD_SIZE - sizeof(uint16_t)];
+} log_record_t;
+
+typedef struct log_ring {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // flusher
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // owning thread
+    atomic_ulong dropped;
+    struct log_ring *next;
+    log_record_t records[LOG_RING_SLOTS];
+} log_ring_t;
+
+log_level_t log_level = LOG_INFO;
+unsigned log_sample = 1;
+
+static int log_fd = -1;
+static pthread_t flusher;
+static atomic_int stopping;
+static _Atomic(log_ring_t *) rings; // every thread that has logged
+static _Thread_local log_ring_t *own_ring;
+
+int log_parse_level(const char *name, log_level_t *level) {
+    static const char *const names[] = {"debug", "info", "warn", "error", "off"};
+    for (int i = 0; i <= LOG_OFF; i++) {
+        if (strcasecmp(name, names[i]) == 0) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Rings live as long as the process, so the flusher can walk the list
+// without coordinating with threads that exit
+static log_ring_t *thread_ring() {
+    if (own_ring != NULL) {
+        return own_ring;
+    }
+    log_ring_t *ring = aligned_alloc(CACHE_LINE_SIZE, sizeof(log_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+    }
+    own_ring = ring;
+    return ring;
+}
+
+// Falls back to a direct write before log_init and after log_shutdown
+static void write_all(const char *data, size_t len) {
+    int fd = log_fd == -1 ? STDOUT_FILENO : log_fd;
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+void log_msg(log_level_t level, const char *fmt, ...) {
+    if (!log_enabled(level)) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    log_ring_t *ring = atomic_load_explicit(&stopping, memory_order_relaxed) || log_fd == -1
+                       ? NULL : thread_ring();
+    if (ring == NULL) {
+        char text[LOG_RECORD_SIZE];
+        int len = vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+        if (len > 0) {
+            write_all(text, (size_t)len < sizeof(text) ? (size_t)len : sizeof(text) - 1);
+        }
+        return;
+    }
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+
+    log_record_t *rec = &ring->records[tail & (LOG_RING_SLOTS - 1)];
+    int len = vsnprintf(rec->text, sizeof(rec->text), fmt, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len >= sizeof(rec->text)) {
+        // Truncated, but keep the line ending
+        len = sizeof(rec->text) - 1;
+        rec->text[len - 1] = '\n';
+    }
+    rec->len = len;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+int log_rate_allow(log_rate_t *rate, unsigned per_second, unsigned *suppressed) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint_fast64_t second = ts.tv_sec + 1; // 0 marks an unused limiter
+
+    *suppressed = 0;
+    uint_fast64_t current = atomic_load_explicit(&rate->second, memory_order_relaxed);
+    if (current != second &&
+        atomic_compare_exchange_strong(&rate->second, &current, second)) {
+        atomic_store_explicit(&rate->count, 0, memory_order_relaxed);
+        *suppressed = atomic_exchange_explicit(&rate->suppressed, 0, memory_order_relaxed);
+    }
+    if (atomic_fetch_add_explicit(&rate->count, 1, memory_order_relaxed) < per_second) {
+        return 1;
+    }
+    atomic_fetch_add_explicit(&rate->suppressed, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Moves everything queued so far to the output. Returns the number of
+// messages written.
+static size_t drain_rings(char *buf) {
+    size_t used = 0;
+    size_t drained = 0;
+
+    for (log_ring_t *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            const log_record_t *rec = &ring->records[head & (LOG_RING_SLOTS - 1)];
+            if (used + rec->len > FLUSH_BUFFER_SIZE) {
+                write_all(buf, used);
+                used = 0;
+            }
+            memcpy(buf + used, rec->text, rec->len);
+            used += rec->len;
+            drained++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0) {
+            if (used + LOG_RECORD_SIZE > FLUSH_BUFFER_SIZE) {
+                write_all(buf, used);
+                used = 0;
+            }
+            used += snprintf(buf + used, LOG_RECORD_SIZE, "[Log]: %lu messages dropped, logging fell behind\n",
+                             dropped);
+        }
+    }
+
+    if (used > 0) {
+        write_all(buf, used);
+    }
+    return drained;
+}
+
+static void *flusher_main(void *arg) {
+    char *buf = arg;
+    struct timespec interval = {0, SWEEP_INTERVAL_NS};
+
+    // Sweeping on a timer batches many messages into each write
+    while (!atomic_load(&stopping)) {
+        if (drain_rings(buf) < LOG_RING_SLOTS / 2) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    drain_rings(buf);
+    free(buf);
+    return NULL;
+}
+
+int log_init(int fd) {
+    char *buf = malloc(FLUSH_BUFFER_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    // Signals are for the threads that asked for them
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    log_fd = fd;
+    int ret = pthread_create(&flusher, NULL, flusher_main, buf);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0) {
+        log_fd = -1;
+        free(buf);
+        errno = ret;
+        return -1;
+    }
+
+    atexit(log_shutdown);
+    return 0;
+}
+
+// Messages logged from here on are written directly
+void log_shutdown() {
+    if (log_fd == -1 || atomic_exchange(&stopping, 1)) {
+        return;
+    }
+    pthread_join(flusher, NULL);
+}
@@ -0,0 +1,76 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Asynchronous logging for the request paths. Every thread formats its
+// messages into a ring of its own (single producer, single consumer, no
+// locks), and a background thread drains all rings to the output with one
+// write per sweep. A full ring drops messages instead of blocking the
+// caller; the number dropped is reported once the flusher catches up.
+//
+// Messages are printf-style and carry their own newline, like the printf
+// calls they replace. Those below the configured level are discarded
+// before they are formatted.
+
+typedef enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_OFF
+} log_level_t;
+
+#define LOG_RING_SLOTS 1024 // per thread, a power of two
+#define LOG_RECORD_SIZE 256 // longer messages are truncated
+
+extern log_level_t log_level;
+extern unsigned log_sample; // per-request messages logged once per this many
+
+#define LOG_ERRORS_PER_SECOND 10 // rate limit for repeated errors on a request path
+
+#define log_enabled(level) ((level) >= log_level)
+
+// Starts the flusher thread writing to `fd`. Queued messages are flushed
+// at exit.
+int log_init(int fd);
+void log_shutdown();
+
+// Parses debug, info, warn, error or off
+int log_parse_level(const char *name, log_level_t *level);
+
+void log_msg(log_level_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+typedef struct {
+    atomic_uint_fast64_t second;
+    atomic_uint count;
+    atomic_uint suppressed;
+} log_rate_t;
+
+// Returns 1 when another message fits in this second's budget. When a new
+// second starts, *suppressed is how many the previous one turned away.
+int log_rate_allow(log_rate_t *rate, unsigned per_second, unsigned *suppressed);
+
+// Logs one in every `n` occurrences of this call site
+#define LOG_EVERY(level, n, ...) do { \
+    static atomic_uint log_count_; \
+    if (log_enabled(level) && \
+        atomic_fetch_add_explicit(&log_count_, 1, memory_order_relaxed) % (n) == 0) { \
+        log_msg(level, __VA_ARGS__); \
+    } \
+} while (0)
+
+// Logs at most `per_second` occurrences of this call site a second
+#define LOG_RATE(level, per_second, ...) do { \
+    static log_rate_t log_rate_; \
+    unsigned log_suppressed_ = 0; \
+    if (log_enabled(level) && log_rate_allow(&log_rate_, (per_second), &log_suppressed_)) { \
+        if (log_suppressed_ > 0) { \
+            log_msg(level, "[Log]: %u messages like the next one were suppressed\n", log_suppressed_); \
+        } \
+        log_msg(level, __VA_ARGS__); \
+    } \
+} while (0)
+
+#endif
@@ -0,0 +1,213 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "queue.h"
+
+// Upper bounds of the histogram buckets, 10 us to 1 s
+static const uint64_t bucket_bounds_ns[METRICS_BUCKETS - 1] = {
+    10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 1000000000
+};
+
+typedef struct metrics_shard {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t counters[METRICS_MAX_COUNTERS];
+    _Atomic uint64_t buckets[METRICS_MAX_HISTOGRAMS][METRICS_BUCKETS];
+    _Atomic uint64_t sums_ns[METRICS_MAX_HISTOGRAMS];
+    struct metrics_shard *next;
+} metrics_shard_t;
+
+static const metric_desc_t *counter_descs;
+static int num_counter_descs;
+static const metric_desc_t *histogram_descs;
+static int num_histogram_descs;
+static _Atomic(metrics_shard_t *) shards; // every thread that has updated a metric
+static _Thread_local metrics_shard_t *own_shard;
+
+int metrics_init(const metric_desc_t *counters, int num_counters,
+                 const metric_desc_t *histograms, int num_histograms) {
+    if (num_counters > METRICS_MAX_COUNTERS || num_histograms > METRICS_MAX_HISTOGRAMS) {
+        errno = EINVAL;
+        return -1;
+    }
+    counter_descs = counters;
+    num_counter_descs = num_counters;
+    histogram_descs = histograms;
+    num_histogram_descs = num_histograms;
+    return 0;
+}
+
+// Shards live as long as the process, like the threads that own them
+static metrics_shard_t *thread_shard() {
+    if (own_shard != NULL) {
+        return own_shard;
+    }
+    metrics_shard_t *shard = aligned_alloc(CACHE_LINE_SIZE, sizeof(metrics_shard_t));
+    if (shard == NULL) {
+        return NULL;
+    }
+    memset(shard, 0, sizeof(*shard));
+    shard->next = atomic_load(&shards);
+    while (!atomic_compare_exchange_weak(&shards, &shard->next, shard)) {
+    }
+    own_shard = shard;
+    return shard;
+}
+
+// Only the owning thread writes a shard, so a relaxed load and store is
+// enough and no locked instruction is needed
+static void bump(_Atomic uint64_t *value, uint64_t n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+void metrics_add(int counter, uint64_t n) {
+    metrics_shard_t *shard = thread_shard();
+    if (shard != NULL) {
+        bump(&shard->counters[counter], n);
+    }
+}
+
+void metrics_observe(int histogram, uint64_t ns) {
+    metrics_shard_t *shard = thread_shard();
+    if (shard == NULL) {
+        return;
+    }
+    int i = 0;
+    while (i < METRICS_BUCKETS - 1 && ns > bucket_bounds_ns[i]) {
+        i++;
+    }
+    bump(&shard->buckets[histogram][i], 1);
+    bump(&shard->sums_ns[histogram], ns);
+}
+
+uint64_t metrics_counter(int counter) {
+    uint64_t total = 0;
+    for (metrics_shard_t *s = atomic_load(&shards); s != NULL; s = s->next) {
+        total += atomic_load_explicit(&s->counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+static int append_text(buffer_t *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int append_text(buffer_t *out, const char *fmt, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len < 0 || (size_t)len >= sizeof(line)) {
+        return -1;
+    }
+    return buffer_append(out, line, len);
+}
+
+int metrics_family(buffer_t *out, const char *name, const char *type, const char *help) {
+    return append_text(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+int metrics_sample(buffer_t *out, const char *name, const char *labels, double value) {
+    if (labels != NULL) {
+        return append_text(out, "%s{%s} %.17g\n", name, labels, value);
+    }
+    return append_text(out, "%s %.17g\n", name, value);
+}
+
+static void format_histogram(buffer_t *out, int h) {
+    uint64_t buckets[METRICS_BUCKETS] = {0};
+    uint64_t sum_ns = 0;
+    for (metrics_shard_t *s = atomic_load(&shards); s != NULL; s = s->next) {
+        for (int i = 0; i < METRICS_BUCKETS; i++) {
+            buckets[i] += atomic_load_explicit(&s->buckets[h][i], memory_order_relaxed);
+        }
+        sum_ns += atomic_load_explicit(&s->sums_ns[h], memory_order_relaxed);
+    }
+
+    const char *name = histogram_descs[h].name;
+    metrics_family(out, name, "histogram", histogram_descs[h].help);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += buckets[i];
+        if (i < METRICS_BUCKETS - 1) {
+            append_text(out, "%s_bucket{le=\"%g\"} %llu\n", name, bucket_bounds_ns[i] / 1e9,
+                        (unsigned long long)cumulative);
+        } else {
+            append_text(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+        }
+    }
+    append_text(out, "%s_sum %.9f\n", name, sum_ns / 1e9);
+    append_text(out, "%s_count %llu\n", name, (unsigned long long)cumulative);
+}
+
+int metrics_socket(const char *path) {
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 5) == -1 ||
+        flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("stats socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// The text is small enough for the socket buffer, so a scraper that does
+// not keep up just gets a truncated answer instead of stalling the caller
+static void send_text(int fd, const buffer_t *text) {
+    if (send(fd, text->data + text->off, buffer_pending(text), MSG_DONTWAIT | MSG_NOSIGNAL) == -1 &&
+        errno != EPIPE) {
+        perror("send");
+    }
+    close(fd);
+}
+
+void metrics_serve(int listen_fd, int accepted_fd, metrics_gauges_fn add_gauges) {
+    buffer_t text = {0};
+
+    for (int i = 0; i < num_counter_descs; i++) {
+        metrics_family(&text, counter_descs[i].name, "counter", counter_descs[i].help);
+        metrics_sample(&text, counter_descs[i].name, NULL, metrics_counter(i));
+    }
+    for (int h = 0; h < num_histogram_descs; h++) {
+        format_histogram(&text, h);
+    }
+    if (add_gauges != NULL) {
+        add_gauges(&text);
+    }
+
+    if (accepted_fd != -1) {
+        send_text(accepted_fd, &text);
+    } else {
+        int fd;
+        while ((fd = accept(listen_fd, NULL, NULL)) != -1) {
+            send_text(fd, &text);
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("accept");
+        }
+    }
+    buffer_free(&text);
+}
@@ -0,0 +1,52 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+// Counters and latency histograms served in the Prometheus text format on
+// an AF_UNIX socket, e.g. `socat - UNIX-CONNECT:/tmp/reverse_proxy_1.stats`.
+//
+// Every thread updates a shard of its own, padded to whole cache lines, so
+// updates are plain stores that never contend; a scrape sums the shards.
+// Each component describes its counters and histograms once with
+// metrics_init and refers to them by index afterwards. Gauges are read
+// from the component's own state when a scrape comes in.
+
+#define STATS_SUFFIX ".stats"
+
+#define METRICS_MAX_COUNTERS 24
+#define METRICS_MAX_HISTOGRAMS 2
+#define METRICS_BUCKETS 16 // the last one is +Inf
+
+typedef struct {
+    const char *name;
+    const char *help;
+} metric_desc_t;
+
+int metrics_init(const metric_desc_t *counters, int num_counters,
+                 const metric_desc_t *histograms, int num_histograms);
+
+void metrics_add(int counter, uint64_t n);
+void metrics_observe(int histogram, uint64_t ns);
+
+// Sum over every thread's shard
+uint64_t metrics_counter(int counter);
+
+// Scrape output: HELP and TYPE for a family, then its samples. `labels`
+// is the inside of the braces, or NULL.
+int metrics_family(buffer_t *out, const char *name, const char *type, const char *help);
+int metrics_sample(buffer_t *out, const char *name, const char *labels, double value);
+
+// Creates the non-blocking listening socket at `path`
+int metrics_socket(const char *path);
+
+// Answers scrapes on the listening socket: every pending connection when
+// accepted_fd is -1, or the one the event loop already accepted. The
+// counters and histograms are followed by what add_gauges appends; the
+// connection is closed once the text is written.
+typedef void (*metrics_gauges_fn)(buffer_t *out);
+void metrics_serve(int listen_fd, int accepted_fd, metrics_gauges_fn add_gauges);
+
+#endif
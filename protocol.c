@@ -0,0 +1,492 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+
+#define READ_CHUNK 4096
+
+void buffer_free(buffer_t *buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+size_t buffer_pending(const buffer_t *buf) {
+    return buf->len - buf->off;
+}
+
+// Makes room for at least `extra` more bytes, reclaiming consumed space first
+static int buffer_reserve(buffer_t *buf, size_t extra) {
+    if (buf->off > 0 && buf->off == buf->len) {
+        buf->off = buf->len = 0;
+    }
+    if (buf->len + extra <= buf->cap) {
+        return 0;
+    }
+    if (buf->off > 0) {
+        memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+        buf->len -= buf->off;
+        buf->off = 0;
+        if (buf->len + extra <= buf->cap) {
+            return 0;
+        }
+    }
+
+    size_t cap = buf->cap ? buf->cap : READ_CHUNK;
+    while (cap < buf->len + extra) {
+        cap *= 2;
+    }
+    char *data = realloc(buf->data, cap);
+    if (data == NULL) {
+        return -1;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+int buffer_append(buffer_t *buf, const void *data, size_t len) {
+    if (buffer_reserve(buf, len) == -1) {
+        return -1;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+ssize_t buffer_read_fd(buffer_t *buf, int fd) {
+    if (buffer_reserve(buf, READ_CHUNK) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ssize_t n;
+    do {
+        n = recv(fd, buf->data + buf->len, buf->cap - buf->len, 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n > 0) {
+        buf->len += n;
+    } else if (n == -1 && errno == EWOULDBLOCK) {
+        errno = EAGAIN;
+    }
+    return n;
+}
+
+int buffer_flush_fd(buffer_t *buf, int fd) {
+    while (buf->off < buf->len) {
+        ssize_t n = send(fd, buf->data + buf->off, buf->len - buf->off, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        buf->off += n;
+    }
+    buf->off = buf->len = 0;
+    return 0;
+}
+
+void buffer_consume(buffer_t *buf, size_t n) {
+    buf->off += n;
+    if (buf->off >= buf->len) {
+        buf->off = buf->len = 0;
+    }
+}
+
+int frame_append(buffer_t *buf, uint8_t type, uint32_t flags, uint32_t request_id,
+                 const void *payload, uint32_t length) {
+    frame_header_t hdr;
+    hdr.magic = PROTOCOL_MAGIC;
+    hdr.version = PROTOCOL_VERSION;
+    hdr.type = type;
+    hdr.flags = flags;
+    hdr.request_id = request_id;
+    hdr.length = length;
+
+    if (buffer_reserve(buf, sizeof(hdr) + length) == -1) {
+        return -1;
+    }
+    memcpy(buf->data + buf->len, &hdr, sizeof(hdr));
+    memcpy(buf->data + buf->len + sizeof(hdr), payload, length);
+    buf->len += sizeof(hdr) + length;
+    return 0;
+}
+
+int frame_next(buffer_t *buf, frame_header_t *hdr, const char **payload) {
+    if (buffer_pending(buf) < sizeof(*hdr)) {
+        return 0;
+    }
+
+    memcpy(hdr, buf->data + buf->off, sizeof(*hdr));
+    if (hdr->magic != PROTOCOL_MAGIC || hdr->version != PROTOCOL_VERSION ||
+        hdr->length > MAX_PAYLOAD_SIZE) {
+        return -1;
+    }
+    if (buffer_pending(buf) < sizeof(*hdr) + hdr->length) {
+        return 0;
+    }
+
+    *payload = buf->data + buf->off + sizeof(*hdr);
+    buf->off += sizeof(*hdr) + hdr->length;
+    return 1;
+}
+
+const char *const trace_point_names[TRACE_POINTS] = {
+    "client sent", "lb received", "lb forwarded", "proxy received", "proxy forwarded",
+    "server received", "server computing", "server computed", "server replied",
+    "proxy response", "proxy replied", "lb response", "lb replied", "client received"
+};
+
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_stamp(uint32_t flags, char *payload, uint32_t length, trace_point_t point) {
+    if (!(flags & FRAME_FLAG_TRACE) || length < sizeof(trace_t)) {
+        return;
+    }
+    uint64_t now = trace_now();
+    memcpy(payload + length - sizeof(trace_t) + offsetof(trace_t, stamps) + point * sizeof(uint64_t),
+           &now, sizeof(now));
+}
+
+int trace_extract(uint32_t flags, const char *payload, uint32_t *length, trace_t *trace) {
+    if (!(flags & FRAME_FLAG_TRACE) || *length < sizeof(trace_t)) {
+        return -1;
+    }
+    *length -= sizeof(trace_t);
+    memcpy(trace, payload + *length, sizeof(*trace));
+    return 0;
+}
+
+void trace_format(const trace_t *trace, char *out, size_t size) {
+    size_t len = 0;
+    int prev = -1;
+    out[0] = '\0';
+    for (int i = 0; i < TRACE_POINTS && len < size; i++) {
+        if (trace->stamps[i] == 0) {
+            continue;
+        }
+        if (prev != -1) {
+            len += snprintf(out + len, size - len, "%s%s +%.1f us", len ? ", " : "",
+                            trace_point_names[i], (trace->stamps[i] - trace->stamps[prev]) / 1000.0);
+        }
+        prev = i;
+    }
+}
+
+int frame_append_traced(buffer_t *buf, uint8_t type, uint32_t flags, uint32_t request_id,
+                        const void *payload, uint32_t length, const trace_t *trace) {
+    if (trace == NULL) {
+        return frame_append(buf, type, flags & ~FRAME_FLAG_TRACE, request_id, payload, length);
+    }
+
+    frame_header_t hdr;
+    hdr.magic = PROTOCOL_MAGIC;
+    hdr.version = PROTOCOL_VERSION;
+    hdr.type = type;
+    hdr.flags = flags | FRAME_FLAG_TRACE;
+    hdr.request_id = request_id;
+    hdr.length = length + sizeof(*trace);
+
+    if (buffer_reserve(buf, sizeof(hdr) + hdr.length) == -1) {
+        return -1;
+    }
+    memcpy(buf->data + buf->len, &hdr, sizeof(hdr));
+    memcpy(buf->data + buf->len + sizeof(hdr), payload, length);
+    memcpy(buf->data + buf->len + sizeof(hdr) + length, trace, sizeof(*trace));
+    buf->len += sizeof(hdr) + hdr.length;
+    return 0;
+}
+
+int request_value_count(const frame_header_t *hdr, const char *payload) {
+    if (hdr->type != FRAME_REQUEST) {
+        return -1;
+    }
+    uint32_t length = hdr->length;
+    if (hdr->flags & FRAME_FLAG_TRACE) {
+        if (length < sizeof(trace_t)) {
+            return -1;
+        }
+        length -= sizeof(trace_t);
+    }
+    if (hdr->flags & FRAME_FLAG_DEADLINE) {
+        if (length < sizeof(uint64_t)) {
+            return -1;
+        }
+        length -= sizeof(uint64_t);
+    }
+    if (!(hdr->flags & FRAME_FLAG_BATCH)) {
+        return length == sizeof(request_t) ? 1 : -1;
+    }
+
+    batch_header_t batch;
+    if (length < sizeof(batch)) {
+        return -1;
+    }
+    memcpy(&batch, payload, sizeof(batch));
+    if (batch.count == 0 || batch.count > MAX_BATCH_SIZE ||
+        length != sizeof(batch) + batch.count * sizeof(double)) {
+        return -1;
+    }
+    return batch.count;
+}
+
+int request_client_id(const char *payload) {
+    int client_id;
+    memcpy(&client_id, payload, sizeof(client_id));
+    return client_id;
+}
+
+// Offset of the deadline in a payload that carries one, or -1 when the
+// payload is too short to hold it
+static int64_t deadline_offset(uint32_t flags, uint32_t length) {
+    uint32_t trailer = flags & FRAME_FLAG_TRACE ? sizeof(trace_t) : 0;
+    if (length < sizeof(uint64_t) + trailer) {
+        return -1;
+    }
+    return length - sizeof(uint64_t) - trailer;
+}
+
+uint64_t request_deadline(uint32_t flags, const char *payload, uint32_t length) {
+    uint64_t deadline = 0;
+    int64_t offset = deadline_offset(flags, length);
+    if ((flags & FRAME_FLAG_DEADLINE) && offset != -1) {
+        memcpy(&deadline, payload + offset, sizeof(deadline));
+    }
+    return deadline;
+}
+
+char *request_copy(const char *payload, uint32_t *length, uint32_t *flags, uint64_t deadline,
+                   int add_trace) {
+    uint32_t trailer = *flags & FRAME_FLAG_TRACE ? sizeof(trace_t) : 0;
+    uint32_t proper = *length - trailer - (*flags & FRAME_FLAG_DEADLINE ? sizeof(uint64_t) : 0);
+    uint64_t current = request_deadline(*flags, payload, *length);
+    if (deadline == 0 || (current != 0 && current < deadline)) {
+        deadline = current;
+    }
+    
+    uint32_t new_flags = *flags & ~(FRAME_FLAG_DEADLINE | FRAME_FLAG_TRACE);
+    uint32_t new_length = proper;
+    if (deadline != 0) {
+        new_flags |= FRAME_FLAG_DEADLINE;
+        new_length += sizeof(uint64_t);
+    }
+    if (trailer != 0 || add_trace) {
+        new_flags |= FRAME_FLAG_TRACE;
+        new_length += sizeof(trace_t);
+    }
+    
+    char *copy = calloc(1, new_length);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, payload, proper);
+    if (deadline != 0) {
+        memcpy(copy + proper, &deadline, sizeof(deadline));
+    }
+    if (trailer != 0) {
+        memcpy(copy + new_length - trailer, payload + *length - trailer, trailer);
+    }
+    *length = new_length;
+    *flags = new_flags;
+    return copy;
+}
+
+int frame_append_failure(buffer_t *buf, uint32_t flags, uint32_t request_id,
+                         uint32_t count, double result) {
+    uint32_t reason = flags & FRAME_FAILURE_FLAGS;
+    if (!(flags & FRAME_FLAG_BATCH)) {
+        response_t resp;
+        resp.result = result;
+        return frame_append(buf, FRAME_RESPONSE, reason, request_id, &resp, sizeof(resp));
+    }
+
+    double *results = malloc(count * sizeof(double));
+    if (results == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        results[i] = result;
+    }
+    int ret = frame_append(buf, FRAME_RESPONSE, FRAME_FLAG_BATCH | reason, request_id,
+                           results, count * sizeof(double));
+    free(results);
+    return ret;
+}
+
+static int send_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int frame_send(int fd, uint8_t type, uint32_t flags, uint32_t request_id,
+               const void *payload, uint32_t length) {
+    buffer_t buf = {0};
+    if (frame_append(&buf, type, flags, request_id, payload, length) == -1) {
+        return -1;
+    }
+    int ret = send_all(fd, buf.data, buf.len);
+    buffer_free(&buf);
+    return ret;
+}
+
+int frame_recv(int fd, frame_header_t *hdr, void *payload, size_t max_length) {
+    if (recv_all(fd, hdr, sizeof(*hdr)) == -1) {
+        return -1;
+    }
+    if (hdr->magic != PROTOCOL_MAGIC || hdr->version != PROTOCOL_VERSION ||
+        hdr->length > max_length) {
+        errno = EPROTO;
+        return -1;
+    }
+    return recv_all(fd, payload, hdr->length);
+}
+
+int handoff_socket(const char *path) {
+    int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sock == -1 || path == NULL) {
+        return sock;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int handoff_send(int sock, const char *path, int client_fd, const void *data, size_t len) {
+    if (len > MAX_PAYLOAD_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    frame_header_t hdr;
+    hdr.magic = PROTOCOL_MAGIC;
+    hdr.version = PROTOCOL_VERSION;
+    hdr.type = FRAME_HANDOFF;
+    hdr.flags = 0;
+    hdr.request_id = 0;
+    hdr.length = len;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {(void *)data, len}};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(int));
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    return n == -1 ? -1 : 0;
+}
+
+int handoff_recv(int sock, int *client_fd, buffer_t *buf) {
+    if (buffer_reserve(buf, MAX_PAYLOAD_SIZE) == -1) {
+        return -1;
+    }
+
+    frame_header_t hdr;
+    struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {buf->data + buf->len, MAX_PAYLOAD_SIZE}};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        return -1;
+    }
+
+    *client_fd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(client_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if ((size_t)n < sizeof(hdr) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+        hdr.magic != PROTOCOL_MAGIC || hdr.version != PROTOCOL_VERSION ||
+        hdr.type != FRAME_HANDOFF || hdr.length != (size_t)n - sizeof(hdr) || *client_fd == -1) {
+        if (*client_fd != -1) {
+            close(*client_fd);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    buf->len += hdr.length;
+    return 0;
+}
@@ -0,0 +1,204 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Wire protocol shared by the client, load balancer, reverse proxies and
+// servers. Every message is a fixed header followed by `length` payload
+// bytes. The request ID lets many requests be outstanding on the same
+// connection and their responses come back in any order; each hop maps the
+// IDs it hands downstream back to the IDs its caller used.
+
+#define PROTOCOL_MAGIC 0x5351 // "SQ"
+#define PROTOCOL_VERSION 1
+#define MAX_PAYLOAD_SIZE 65536
+
+#define FRAME_REQUEST 1
+#define FRAME_RESPONSE 2
+#define FRAME_HANDOFF 3 // carries a client connection, see handoff_send()
+
+// The payload is a batch_header_t followed by `count` doubles on requests,
+// and `count` doubles on responses. Proxies forward batches unchanged.
+#define FRAME_FLAG_BATCH 0x1
+
+// The payload ends with a trace_t that every tier stamps on the way down and
+// back up. Only the frames a client or the load balancer chose to sample
+// carry it; the others pay nothing.
+#define FRAME_FLAG_TRACE 0x2
+
+// Set on a response whose request was shed because a tier was overloaded.
+// Its values are -1 like any failure's, but nothing was computed and the
+// request can be retried once the caller has backed off.
+#define FRAME_FLAG_OVERLOAD 0x4
+
+// The request carries an absolute deadline: a uint64_t of CLOCK_MONOTONIC
+// nanoseconds right after the request proper, ahead of any trace trailer.
+// Every tier stops working on a request once its deadline has passed, as
+// the client has given up on it by then.
+#define FRAME_FLAG_DEADLINE 0x8
+
+// Set on a failure response for a request whose deadline passed before it
+// was answered
+#define FRAME_FLAG_EXPIRED 0x10
+
+// Flags a failure response keeps to say why the request failed
+#define FRAME_FAILURE_FLAGS (FRAME_FLAG_OVERLOAD | FRAME_FLAG_EXPIRED)
+
+typedef struct {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint32_t flags;
+    uint32_t request_id;
+    uint32_t length;
+} frame_header_t;
+
+typedef struct {
+    int client_id;
+    double value;
+} request_t;
+
+typedef struct {
+    double result;
+} response_t;
+
+typedef struct {
+    int client_id; // same offset as in request_t so routing can read either
+    uint32_t count;
+} batch_header_t;
+
+// Points at which a traced request is stamped, in the order it passes them.
+// Stamps are CLOCK_MONOTONIC nanoseconds, comparable across the processes
+// of one machine; 0 means the request did not pass that point (a tier that
+// was skipped, or a stamp its sender does not take).
+typedef enum {
+    TRACE_CLIENT_SENT,
+    TRACE_LB_RECEIVED,
+    TRACE_LB_FORWARDED,
+    TRACE_PROXY_RECEIVED,
+    TRACE_PROXY_FORWARDED,  // queued for the server, possibly behind a connect
+    TRACE_SERVER_RECEIVED,
+    TRACE_SERVER_COMPUTING, // picked up by a worker
+    TRACE_SERVER_COMPUTED,
+    TRACE_SERVER_REPLIED,
+    TRACE_PROXY_RESPONSE,
+    TRACE_PROXY_REPLIED,
+    TRACE_LB_RESPONSE,
+    TRACE_LB_REPLIED,
+    TRACE_CLIENT_RECEIVED,
+    TRACE_POINTS
+} trace_point_t;
+
+typedef struct {
+    uint64_t stamps[TRACE_POINTS];
+} trace_t;
+
+extern const char *const trace_point_names[TRACE_POINTS];
+
+#define MAX_BATCH_SIZE ((MAX_PAYLOAD_SIZE - sizeof(batch_header_t) - sizeof(uint64_t) - \
+                         sizeof(trace_t)) / sizeof(double))
+
+// Growable byte buffer used to accumulate partial reads and pending writes
+// on non-blocking sockets. Bytes in [off, len) are still unconsumed.
+typedef struct {
+    char *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+} buffer_t;
+
+void buffer_free(buffer_t *buf);
+size_t buffer_pending(const buffer_t *buf);
+int buffer_append(buffer_t *buf, const void *data, size_t len);
+
+// Reads whatever is available from fd. Returns the number of bytes read, 0 on
+// EOF, or -1 on error; -1 with errno EAGAIN means no data was ready.
+ssize_t buffer_read_fd(buffer_t *buf, int fd);
+
+// Writes as much pending data as the socket accepts. Returns 0 when the
+// buffer was drained or the socket is full, -1 on error.
+int buffer_flush_fd(buffer_t *buf, int fd);
+
+// Drops n bytes that were written by some other means
+void buffer_consume(buffer_t *buf, size_t n);
+
+// Appends a complete frame to buf
+int frame_append(buffer_t *buf, uint8_t type, uint32_t flags, uint32_t request_id,
+                 const void *payload, uint32_t length);
+
+// Extracts the next complete frame from buf. Returns 1 and fills hdr/payload
+// when a frame is available, 0 when more bytes are needed, and -1 when the
+// stream is malformed. The payload pointer is valid until the buffer is
+// modified.
+int frame_next(buffer_t *buf, frame_header_t *hdr, const char **payload);
+
+// Monotonic clock used for trace stamps
+uint64_t trace_now();
+
+// Stamps `point` in the trace trailer of a payload; untraced payloads are
+// left alone
+void trace_stamp(uint32_t flags, char *payload, uint32_t length, trace_point_t point);
+
+// Copies the trace trailer of a traced payload into *trace and shortens
+// *length to the payload proper. Returns -1 when the payload is untraced.
+int trace_extract(uint32_t flags, const char *payload, uint32_t *length, trace_t *trace);
+
+// Writes one line with the time spent between consecutive stamped points
+void trace_format(const trace_t *trace, char *out, size_t size);
+
+// Appends a frame, with trace as its trailer and FRAME_FLAG_TRACE set
+// unless trace is NULL
+int frame_append_traced(buffer_t *buf, uint8_t type, uint32_t flags, uint32_t request_id,
+                        const void *payload, uint32_t length, const trace_t *trace);
+
+// Returns the number of values a request frame carries, or -1 when the frame
+// is not a well-formed request
+int request_value_count(const frame_header_t *hdr, const char *payload);
+int request_client_id(const char *payload);
+
+// Returns the deadline a request carries, or 0 when it has none or its
+// payload is too short to hold one
+uint64_t request_deadline(uint32_t flags, const char *payload, uint32_t length);
+
+// Copies a request payload, giving the copy a deadline no later than
+// `deadline` (0 leaves it as it is) and a zeroed trace trailer when
+// add_trace is set and it has none yet. Returns the copy, with its length
+// and flags in *length and *flags, or NULL when out of memory.
+char *request_copy(const char *payload, uint32_t *length, uint32_t *flags, uint64_t deadline,
+                   int add_trace);
+
+// Appends a response reporting `result` for every value of a request, used
+// when a request fails before a server could answer it. Of `flags`, only
+// BATCH and the FRAME_FAILURE_FLAGS are kept.
+int frame_append_failure(buffer_t *buf, uint32_t flags, uint32_t request_id,
+                         uint32_t count, double result);
+
+// Direct server return. Once a routing tier has picked the next hop for a
+// client connection it passes the connected socket itself down, as a
+// FRAME_HANDOFF datagram on the next hop's handoff socket (its stream socket
+// path plus HANDOFF_SUFFIX) whose payload is whatever the tier already read
+// from the client. The server that ends up owning the socket answers the
+// client directly.
+#define HANDOFF_SUFFIX ".handoff"
+
+// Creates a datagram socket, bound to path unless it is NULL
+int handoff_socket(const char *path);
+
+// Sends client_fd and `len` buffered bytes to the handoff socket at path
+// without blocking. Returns 0 on success and -1 otherwise, errno EAGAIN
+// meaning the receiver is backed up.
+int handoff_send(int sock, const char *path, int client_fd, const void *data, size_t len);
+
+// Receives one handoff without blocking. Returns 0 with the client socket in
+// *client_fd and its buffered bytes appended to buf, or -1 with errno set:
+// EAGAIN when none is queued, EPROTO for a malformed message.
+int handoff_recv(int sock, int *client_fd, buffer_t *buf);
+
+// Blocking helpers for components that talk to one peer at a time
+int frame_send(int fd, uint8_t type, uint32_t flags, uint32_t request_id,
+               const void *payload, uint32_t length);
+int frame_recv(int fd, frame_header_t *hdr, void *payload, size_t max_length);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Bounded lock-free multi-producer/multi-consumer queue of pointers
+// (Vyukov's array queue). Each cell carries a sequence number that tells
+// producers and consumers whose turn it is, so neither side takes a lock.
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+    atomic_size_t seq;
+    void *data;
+} queue_cell_t;
+
+typedef struct {
+    queue_cell_t *cells;
+    size_t mask;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+} mpmc_queue_t;
+
+// Capacity is rounded up to a power of two
+int queue_init(mpmc_queue_t *q, size_t capacity);
+void queue_destroy(mpmc_queue_t *q);
+
+// Return 0 on success, -1 when the queue is full (push) or empty (pop)
+int queue_push(mpmc_queue_t *q, void *data);
+int queue_pop(mpmc_queue_t *q, void **data);
+
+#endif
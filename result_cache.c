@@ -0,0 +1,190 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "result_cache.h"
+
+static size_t segment_size(uint32_t num_shards) {
+    return sizeof(result_cache_t) + (size_t)num_shards * sizeof(result_cache_shard_t);
+}
+
+int result_cache_create(size_t entries) {
+    uint32_t num_shards = 1;
+    while ((size_t)num_shards * RESULT_CACHE_WAYS < entries && num_shards < (1u << 30)) {
+        num_shards <<= 1;
+    }
+    size_t size = segment_size(num_shards);
+
+    int fd = shm_open(RESULT_CACHE_NAME, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("shm_open");
+        return -1;
+    }
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(RESULT_CACHE_NAME);
+        return -1;
+    }
+
+    // ftruncate zero-fills, which leaves every slot empty
+    result_cache_t *cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(RESULT_CACHE_NAME);
+        return -1;
+    }
+    cache->num_shards = num_shards;
+    cache->magic = RESULT_CACHE_MAGIC;
+
+    munmap(cache, size);
+    return 0;
+}
+
+void result_cache_unlink() {
+    shm_unlink(RESULT_CACHE_NAME);
+}
+
+result_cache_t *result_cache_open() {
+    int fd = shm_open(RESULT_CACHE_NAME, O_RDWR, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(result_cache_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    result_cache_t *cache = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (cache->magic != RESULT_CACHE_MAGIC || cache->num_shards == 0 ||
+        (cache->num_shards & (cache->num_shards - 1)) != 0 ||
+        segment_size(cache->num_shards) != (size_t)st.st_size) {
+        munmap(cache, st.st_size);
+        return NULL;
+    }
+    return cache;
+}
+
+void result_cache_close(result_cache_t *cache) {
+    munmap(cache, segment_size(cache->num_shards));
+}
+
+size_t result_cache_capacity(const result_cache_t *cache) {
+    return (size_t)cache->num_shards * RESULT_CACHE_WAYS;
+}
+
+static uint64_t value_key(double value) {
+    uint64_t key;
+    memcpy(&key, &value, sizeof(key));
+    return key;
+}
+
+// splitmix64's finalizer; the low bits of a double's bit pattern are often
+// all zero, so they cannot pick the shard on their own
+static uint64_t hash_key(uint64_t key) {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+static result_cache_shard_t *shard_of(result_cache_t *cache, uint64_t key) {
+    return &cache->shards[hash_key(key) & (cache->num_shards - 1)];
+}
+
+// Reads a slot consistently. Returns 0 when it is empty or being written.
+static int read_slot(result_cache_slot_t *slot, uint64_t *key, uint64_t *result) {
+    unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq == 0 || (seq & 1)) {
+        return 0;
+    }
+    *key = atomic_load_explicit(&slot->key, memory_order_relaxed);
+    *result = atomic_load_explicit(&slot->result, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq;
+}
+
+int result_cache_lookup(result_cache_t *cache, double value, double *result) {
+    uint64_t key = value_key(value);
+    result_cache_shard_t *shard = shard_of(cache, key);
+
+    for (int i = 0; i < RESULT_CACHE_WAYS; i++) {
+        result_cache_slot_t *slot = &shard->slots[i];
+        uint64_t slot_key, slot_result;
+        if (read_slot(slot, &slot_key, &slot_result) && slot_key == key) {
+            // Skip the store when already set, to keep the line shared
+            if (!atomic_load_explicit(&slot->referenced, memory_order_relaxed)) {
+                atomic_store_explicit(&slot->referenced, 1, memory_order_relaxed);
+            }
+            memcpy(result, &slot_result, sizeof(*result));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// An empty slot if there is one, or the first unreferenced one from the
+// hand on, giving every referenced slot passed a second chance
+static int pick_victim(result_cache_shard_t *shard, uint64_t key) {
+    for (int i = 0; i < RESULT_CACHE_WAYS; i++) {
+        result_cache_slot_t *slot = &shard->slots[i];
+        uint64_t slot_key, slot_result;
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == 0) {
+            return i;
+        }
+        if (read_slot(slot, &slot_key, &slot_result) && slot_key == key) {
+            return -1; // Another server got there first
+        }
+    }
+
+    unsigned hand = atomic_load_explicit(&shard->hand, memory_order_relaxed);
+    for (int n = 0; n < 2 * RESULT_CACHE_WAYS; n++) {
+        int i = (hand + n) % RESULT_CACHE_WAYS;
+        result_cache_slot_t *slot = &shard->slots[i];
+        if (atomic_exchange_explicit(&slot->referenced, 0, memory_order_relaxed) == 0) {
+            atomic_store_explicit(&shard->hand, (i + 1) % RESULT_CACHE_WAYS, memory_order_relaxed);
+            return i;
+        }
+    }
+    return hand % RESULT_CACHE_WAYS; // Unreachable: the first pass cleared every mark
+}
+
+void result_cache_insert(result_cache_t *cache, double value, double result) {
+    uint64_t key = value_key(value);
+    result_cache_shard_t *shard = shard_of(cache, key);
+    int victim = pick_victim(shard, key);
+    if (victim == -1) {
+        return;
+    }
+
+    result_cache_slot_t *slot = &shard->slots[victim];
+    unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if ((seq & 1) || !atomic_compare_exchange_strong_explicit(&slot->seq, &seq, seq + 1,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed)) {
+        return; // Someone else is writing it
+    }
+    atomic_thread_fence(memory_order_release);
+
+    uint64_t result_bits;
+    memcpy(&result_bits, &result, sizeof(result_bits));
+    atomic_store_explicit(&slot->key, key, memory_order_relaxed);
+    atomic_store_explicit(&slot->result, result_bits, memory_order_relaxed);
+    atomic_store_explicit(&slot->referenced, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
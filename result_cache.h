@@ -0,0 +1,62 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "queue.h"
+
+// Results of single requests, shared by every proxy and server through one
+// shared-memory segment that the watchdog creates. Servers insert what they
+// compute and proxies answer repeated values without contacting a server.
+//
+// The cache is a fixed number of shards, each a set of RESULT_CACHE_WAYS
+// slots that a value hashes to, so memory is bounded by the size chosen at
+// creation. A full shard evicts with CLOCK: a lookup that hits marks its
+// slot referenced, and the shard's hand passes over referenced slots once,
+// clearing the mark, before it takes one.
+//
+// Lookups take no lock. Every slot is guarded by a sequence number that is
+// odd while it is written; readers retry nothing and treat a torn read as
+// a miss, and a writer that finds a slot busy gives up on inserting.
+// Results only depend on the value, so a stale slot is never wrong.
+
+#define RESULT_CACHE_NAME "/sqrt_result_cache"
+#define RESULT_CACHE_MAGIC 0x52434331 // "RCC1"
+#define RESULT_CACHE_WAYS 8
+
+typedef struct {
+    atomic_uint seq;        // 0 while empty, odd while being written
+    atomic_uint referenced; // set by hits, cleared by the CLOCK hand
+    _Atomic uint64_t key;   // bits of the value
+    _Atomic uint64_t result;
+} result_cache_slot_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint hand;
+    result_cache_slot_t slots[RESULT_CACHE_WAYS];
+} result_cache_shard_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_shards; // a power of two
+    result_cache_shard_t shards[];
+} result_cache_t;
+
+// Creates the segment with room for at least `entries` results. Called by
+// the watchdog.
+int result_cache_create(size_t entries);
+void result_cache_unlink();
+
+// Maps the segment, or returns NULL when there is none
+result_cache_t *result_cache_open();
+void result_cache_close(result_cache_t *cache);
+
+size_t result_cache_capacity(const result_cache_t *cache);
+
+// Returns 1 and stores the result when `value` is cached
+int result_cache_lookup(result_cache_t *cache, double value, double *result);
+void result_cache_insert(result_cache_t *cache, double value, double result);
+
+#endif
@@ -8,32 +8,246 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <sys/wait.h>
 #include <time.h>
-#include <sys/select.h>
 #include <sys/time.h>
+#include <math.h>
+
+#include "protocol.h"
+#include "log.h"
+#include "metrics.h"
+#include "shm_channel.h"
+#include "event_loop.h"
+#include "listen_socket.h"
+#include "result_cache.h"
+#include "breaker.h"
 
 #define PROXY_SOCKET_BASE "/tmp/reverse_proxy_"
 #define SERVER_SOCKET_BASE "/tmp/server_"
 #define BUFFER_SIZE 256
+#define MAX_EVENTS 256
+#define DEFAULT_SERVERS_PER_PROXY 3
+#define MAX_SERVERS_PER_PROXY 64
+#define PENDING_BUCKETS 4096
+#define EWMA_WEIGHT 0.3           // weight of the newest latency sample
+#define EWMA_DECAY_US 1000000.0   // idle servers' latency estimates fade over ~1s
+#define FAILURE_PENALTY_US 1000000.0 // latency charged to a server that failed
+#define DEFAULT_MAX_INFLIGHT 4096
+#define DEFAULT_RETRIES 1
+#define DEFAULT_HEDGE_PERCENTILE 95
+#define LATENCY_WINDOW 512   // recent server latencies the hedge delay is taken from
+#define HEDGE_MIN_SAMPLES 64 // no hedging until the window holds this many
+#define HEDGE_REFRESH 256    // samples between recomputations of the hedge delay
+#define HEDGE_BUDGET 0.05    // hedges allowed per request forwarded
+#define HEDGE_BURST 10.0     // hedges that may be saved up while latencies are fine
+#define DEFAULT_REQUEST_TIMEOUT_MS 10000
+#define DEADLINE_SWEEP_MS 10 // how often requests in flight are checked for expiry
 
 static int proxy_id;
 static int proxy_socket = -1;
+static int proxy_socket_bound = 0; // ours to unlink, rather than the watchdog's
+static loop_backend_t io_backend = LOOP_EPOLL;
+static int direct_return = 0; // pass client connections on to the servers
+static uint32_t next_request_id = 1;
+static int use_shm = 0;   // small frames go through shared memory
+static int busy_poll = 0; // spin on the response rings instead of sleeping
+static int max_inflight = DEFAULT_MAX_INFLIGHT; // requests forwarded and not answered yet
+static int max_retries = DEFAULT_RETRIES; // other servers tried when one cannot be reached
+static int hedge_percentile = DEFAULT_HEDGE_PERCENTILE; // 0 disables hedging
+static uint64_t request_timeout_ns = DEFAULT_REQUEST_TIMEOUT_MS * 1000000ULL; // 0: caller deadlines only
+static result_cache_t *cache = NULL; // results the servers computed, when the watchdog made one
 static volatile sig_atomic_t should_exit = 0;
 
-typedef struct {
-    int client_id;
-    double value;
-} request_t;
+typedef enum {
+    EP_CLIENT,
+    EP_SERVER,
+    EP_SHM,    // a server's response ring has items
+    EP_HANDOFF, // client connections handed down by the load balancer
+    EP_STATS    // listening stats socket
+} endpoint_kind_t;
+
+enum {
+    PROXY_REQUESTS,
+    PROXY_VALUES,
+    PROXY_RESPONSES,
+    PROXY_FAILURES,
+    PROXY_ILLEGAL,
+    PROXY_SERVER_FAILURES,
+    PROXY_CONNECTIONS,
+    PROXY_HANDOFFS,
+    PROXY_SHED,
+    PROXY_OVERLOADED,
+    PROXY_RETRIES,
+    PROXY_HEDGES,
+    PROXY_HEDGE_WINS,
+    PROXY_EXPIRED,
+    PROXY_CACHE_HITS,
+    PROXY_CACHE_MISSES,
+    PROXY_COALESCED,
+    PROXY_EJECTIONS,
+    PROXY_COUNTERS
+};
+
+static const metric_desc_t proxy_counters[PROXY_COUNTERS] = {
+    {"proxy_requests_total", "Requests received"},
+    {"proxy_values_total", "Values carried by those requests"},
+    {"proxy_responses_total", "Responses relayed from the servers"},
+    {"proxy_failures_total", "Requests the proxy answered with -1 itself, illegal and shed ones included"},
+    {"proxy_illegal_requests_total", "Requests rejected for a negative value"},
+    {"proxy_server_failures_total", "Failed connections, sends and handoffs to servers"},
+    {"proxy_connections_total", "Connections accepted or adopted after a failed handoff"},
+    {"proxy_handoffs_total", "Client connections handed to a server for direct server return"},
+    {"proxy_shed_total", "Requests answered with an overload response because too many were in flight"},
+    {"proxy_server_overloads_total", "Overload responses relayed from the servers"},
+    {"proxy_retries_total", "Requests sent to another server after theirs could not be reached"},
+    {"proxy_hedges_total", "Duplicate requests sent to a second server after the hedge delay"},
+    {"proxy_hedge_wins_total", "Hedged requests the second server answered first"},
+    {"proxy_expired_total", "Requests the proxy answered as expired once their deadline passed"},
+    {"proxy_cache_hits_total", "Requests answered from the shared result cache"},
+    {"proxy_cache_misses_total", "Requests looked up in the shared result cache and forwarded"},
+    {"proxy_coalesced_total", "Requests that waited for the answer to one already in flight for their value"},
+    {"proxy_server_ejections_total", "Times a failing or slow server was taken out of rotation"},
+};
+
+enum {
+    PROXY_LATENCY,
+    PROXY_SERVER_LATENCY,
+    PROXY_HISTOGRAMS
+};
+
+static const metric_desc_t proxy_histograms[PROXY_HISTOGRAMS] = {
+    {"proxy_request_duration_seconds", "Time from reading a request to queuing its response"},
+    {"proxy_server_duration_seconds", "Time from handing a request to a server to its response"},
+};
+
+// Every socket registered with the event loop starts with an endpoint so it
+// can tell load balancer connections and server connections apart. Output
+// is written in one batch per iteration from the flush list.
+typedef struct endpoint endpoint_t;
+
+struct endpoint {
+    endpoint_kind_t kind;
+    int fd;
+    int flush_queued;
+    endpoint_t *next_flush;
+};
+
+typedef struct connection connection_t;
+
+// A connection from the load balancer, which pipelines requests on it
+struct connection {
+    endpoint_t client; // must stay first
+    int read_closed;   // load balancer finished sending requests
+    int closed;        // socket closed, freed once nothing is outstanding
+    buffer_t in;
+    buffer_t out;
+    int outstanding;
+    connection_t *next; // link in the graveyard
+};
+
+// Warm, multiplexed connection to one of this proxy's servers
+typedef enum {
+    SERVER_CONN_DISCONNECTED,
+    SERVER_CONN_CONNECTING,
+    SERVER_CONN_CONNECTED
+} server_conn_state_t;
 
 typedef struct {
-    double result;
-} response_t;
+    endpoint_t ep; // must stay first
+    server_conn_state_t state;
+    int server_id;
+    buffer_t in;
+    buffer_t out;
+    int outstanding;
+    int reused; // has delivered a response since it was connected
+    double ewma_us;          // smoothed response latency
+    uint64_t last_sample_us; // when ewma_us was last updated
+    breaker_t breaker;       // ejected servers only get probes
+    shm_channel_t *shm;      // shared-memory channel, NULL when not in use
+    uint32_t epoch;          // tags this incarnation's requests on the channel
+    int shm_kick;            // requests pushed since the server was last woken
+    endpoint_t shm_ep;       // wakeup of the response ring
+} server_conn_t;
+
+// A request for a value that was already in flight when it arrived. It is
+// not sent anywhere and gets the answer to the request it waits on.
+typedef struct waiter waiter_t;
+
+struct waiter {
+    connection_t *conn;
+    uint32_t request_id;
+    uint64_t received_ns;
+    int traced;
+    trace_t trace;
+    waiter_t *next;
+};
+
+// A request forwarded to a server, keyed by the ID the proxy assigned to it.
+// A hedged request is in flight on two servers under the same ID; the first
+// answer completes it and the other one is dropped as stale. Single requests
+// are also kept in the in-flight table under their value, so that requests
+// for the same value wait on them instead of going to a server as well.
+typedef struct pending pending_t;
+
+struct pending {
+    uint32_t id;
+    uint32_t client_request_id;
+    connection_t *conn;
+    server_conn_t *sc;
+    server_conn_t *hedge_sc; // second server racing the first, if hedged
+    uint64_t tried;  // a bit per index of the servers it was sent to
+    int retries;     // times it moved on to another server after a failure
+    uint64_t received_ns; // CLOCK_MONOTONIC
+    uint64_t deadline_ns; // likewise; 0 when the request has none
+    uint64_t sent_us; // when the request was handed to its server
+    uint64_t hedge_sent_us;
+    uint32_t flags;
+    uint32_t count;  // values carried, so failures can answer each of them
+    uint32_t length;
+    char *payload;   // copy of the request, kept for replays
+    pending_t *next; // hash chain
+    int hedge_queued;
+    pending_t *hedge_prev; // link in the hedge queue
+    pending_t *hedge_next;
+    int coalescing;  // in the in-flight table
+    uint64_t key;    // bits of the value, when coalescing
+    pending_t *inflight_next;
+    waiter_t *waiters;
+};
+
+// Picks the index of the server that receives the next request
+typedef int (*select_server_fn)(void);
+
+static server_conn_t servers[MAX_SERVERS_PER_PROXY];
+static int num_servers = DEFAULT_SERVERS_PER_PROXY;
+static select_server_fn select_server;
+static pending_t *pending_table[PENDING_BUCKETS];
+static pending_t *inflight_table[PENDING_BUCKETS]; // single requests by value
+// Connections closed during an event batch, freed once the batch is done
+static connection_t *graveyard = NULL;
+static endpoint_t *flush_list = NULL;
+static endpoint_t handoff_ep = {EP_HANDOFF, -1, 0, NULL};
+static endpoint_t stats_ep = {EP_STATS, -1, 0, NULL};
+static int num_pending = 0;
+static int num_waiters = 0;
+static int num_clients = 0;
+// Requests that may still be hedged, oldest first, and the delay after
+// which they are, taken from a window of recent server latencies
+static pending_t *hedge_head = NULL;
+static pending_t *hedge_tail = NULL;
+static uint64_t hedge_delay_us = 0; // 0 until the window has enough samples
+static double hedge_tokens = 0.0;
+static uint64_t latency_window[LATENCY_WINDOW];
+static int latency_samples = 0;
+static int latency_next = 0;
+static int latency_unsorted = 0; // samples since the hedge delay was computed
 
 // prompt : Implement signal handler for SIGTERM. 
 void signal_handler(int sig) {
     if (sig == SIGTERM) {
-        printf("[Reverse Proxy #%d]: Received SIGTERM from watchdog. Terminating.\n", proxy_id);
+        // Logged by the main loop; the logger is not async-signal-safe
         should_exit = 1;
         if (proxy_socket != -1) {
             close(proxy_socket);
@@ -51,42 +265,592 @@ void setup_signals() {
     sigaction(SIGTERM, &sa_term, NULL);
 }
 
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Uses the socket the watchdog keeps open across restarts, if it passed one
 int create_proxy_socket() {
-    char socket_path[256];
-    snprintf(socket_path, sizeof(socket_path), "%s%d", PROXY_SOCKET_BASE, proxy_id);
-    
-    // Remove existing socket file
-    unlink(socket_path);
-    
-    proxy_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    proxy_socket = listen_socket_inherited();
     if (proxy_socket == -1) {
-        perror("socket");
-        return -1;
+        char socket_path[256];
+        snprintf(socket_path, sizeof(socket_path), "%s%d", PROXY_SOCKET_BASE, proxy_id);
+        proxy_socket = listen_socket_create(socket_path, SOMAXCONN);
+        if (proxy_socket == -1) {
+            return -1;
+        }
+        proxy_socket_bound = 1;
     }
     
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, socket_path);
-    
-    if (bind(proxy_socket, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("bind");
+    if (set_nonblocking(proxy_socket) == -1) {
+        perror("fcntl");
         close(proxy_socket);
         return -1;
     }
     
-    if (listen(proxy_socket, 5) == -1) {
-        perror("listen");
-        close(proxy_socket);
-        return -1;
+    return 0;
+}
+
+int watch_endpoint(endpoint_t *ep, uint32_t events) {
+    return loop_mod(ep->fd, events, ep);
+}
+
+void close_endpoint(endpoint_t *ep) {
+    if (ep->fd != -1) {
+        loop_del(ep->fd);
+        close(ep->fd);
+        ep->fd = -1;
+    }
+}
+
+void close_connection(connection_t *conn) {
+    if (conn->closed) {
+        return;
     }
+    close_endpoint(&conn->client);
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    conn->closed = 1;
+    num_clients--;
     
-    return 0;
+    if (conn->outstanding == 0) {
+        conn->next = graveyard;
+        graveyard = conn;
+    }
+}
+
+void free_graveyard() {
+    while (graveyard != NULL) {
+        connection_t *conn = graveyard;
+        graveyard = conn->next;
+        free(conn);
+    }
+}
+
+void schedule_flush(endpoint_t *ep) {
+    if (!ep->flush_queued) {
+        ep->flush_queued = 1;
+        ep->next_flush = flush_list;
+        flush_list = ep;
+    }
 }
 
-int connect_to_server(int server_id) {
+void update_connection(connection_t *conn) {
+    if (conn->closed) {
+        return;
+    }
+    if (conn->read_closed && conn->outstanding == 0 && buffer_pending(&conn->out) == 0) {
+        close_connection(conn);
+        return;
+    }
+    
+    uint32_t events = conn->read_closed ? 0 : EPOLLIN;
+    if (buffer_pending(&conn->out) > 0 && !conn->client.flush_queued) {
+        events |= EPOLLOUT;
+    }
+    if (watch_endpoint(&conn->client, events) == -1) {
+        perror("loop_mod");
+        close_connection(conn);
+    }
+}
+
+// Queues a response frame that was produced further down the chain
+void send_response(connection_t *conn, uint32_t request_id, uint32_t flags,
+                   const char *payload, uint32_t length, trace_t *trace) {
+    if (conn->closed) {
+        return;
+    }
+
+    // Send response back to load balancer
+    if (trace != NULL) {
+        trace->stamps[TRACE_PROXY_REPLIED] = trace_now();
+    }
+    if (frame_append_traced(&conn->out, FRAME_RESPONSE, flags, request_id, payload, length, trace) == -1) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Reverse Proxy #%d]: Error sending response\n", proxy_id);
+        close_connection(conn);
+        return;
+    }
+    schedule_flush(&conn->client);
+}
+
+void send_cached(connection_t *conn, const frame_header_t *hdr, const char *payload,
+                 const response_t *resp) {
+    LOG_EVERY(LOG_INFO, log_sample, "[Reverse Proxy #%d]: Request from Client #%d. Answered from the cache\n",
+              proxy_id, request_client_id(payload));
+    metrics_add(PROXY_CACHE_HITS, 1);
+    
+    trace_t trace;
+    uint32_t length = hdr->length;
+    int traced = trace_extract(hdr->flags, payload, &length, &trace) == 0;
+    if (traced) {
+        trace.stamps[TRACE_PROXY_RECEIVED] = trace.stamps[TRACE_PROXY_RESPONSE] = trace_now();
+    }
+    send_response(conn, hdr->request_id, 0, (const char *)resp, sizeof(*resp), traced ? &trace : NULL);
+}
+
+void send_failure(connection_t *conn, uint32_t request_id, uint32_t flags, uint32_t count) {
+    if (conn->closed) {
+        return;
+    }
+    
+    metrics_add(PROXY_FAILURES, 1);
+    if (frame_append_failure(&conn->out, flags, request_id, count, -1.0) == -1) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Reverse Proxy #%d]: Error sending response\n", proxy_id);
+        close_connection(conn);
+        return;
+    }
+    schedule_flush(&conn->client);
+}
+
+void insert_pending(pending_t *p) {
+    pending_t **bucket = &pending_table[p->id % PENDING_BUCKETS];
+    p->next = *bucket;
+    *bucket = p;
+    num_pending++;
+}
+
+pending_t *find_pending(uint32_t id) {
+    pending_t *p = pending_table[id % PENDING_BUCKETS];
+    while (p != NULL && p->id != id) {
+        p = p->next;
+    }
+    return p;
+}
+
+pending_t *remove_pending(uint32_t id) {
+    pending_t **link = &pending_table[id % PENDING_BUCKETS];
+    while (*link != NULL) {
+        pending_t *p = *link;
+        if (p->id == id) {
+            *link = p->next;
+            num_pending--;
+            return p;
+        }
+        link = &p->next;
+    }
+    return NULL;
+}
+
+uint64_t value_key(double value) {
+    uint64_t key;
+    memcpy(&key, &value, sizeof(key));
+    return key;
+}
+
+// Nearby values differ in the middle bits of a double, so the key is mixed
+// before it picks a bucket
+unsigned inflight_bucket(uint64_t key) {
+    return (unsigned)((key * 0x9E3779B97F4A7C15ULL) >> 32) % PENDING_BUCKETS;
+}
+
+void insert_inflight(pending_t *p, uint64_t key) {
+    pending_t **bucket = &inflight_table[inflight_bucket(key)];
+    p->coalescing = 1;
+    p->key = key;
+    p->inflight_next = *bucket;
+    *bucket = p;
+}
+
+pending_t *find_inflight(uint64_t key) {
+    pending_t *p = inflight_table[inflight_bucket(key)];
+    while (p != NULL && p->key != key) {
+        p = p->inflight_next;
+    }
+    return p;
+}
+
+void remove_inflight(pending_t *p) {
+    if (!p->coalescing) {
+        return;
+    }
+    pending_t **link = &inflight_table[inflight_bucket(p->key)];
+    while (*link != p) {
+        link = &(*link)->inflight_next;
+    }
+    *link = p->inflight_next;
+    p->coalescing = 0;
+}
+
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Folds a latency sample into the server's moving average
+void record_latency(server_conn_t *sc, double latency_us) {
+    if (sc->last_sample_us == 0) {
+        sc->ewma_us = latency_us;
+    } else {
+        sc->ewma_us = EWMA_WEIGHT * latency_us + (1.0 - EWMA_WEIGHT) * sc->ewma_us;
+    }
+    sc->last_sample_us = now_us();
+}
+
+void server_ejected(server_conn_t *sc, const char *why) {
+    log_msg(LOG_WARN, "[Reverse Proxy #%d]: Ejecting Server #%d (%s)\n", proxy_id, sc->server_id, why);
+    metrics_add(PROXY_EJECTIONS, 1);
+}
+
+// The server answered a probe. Its failure penalty is forgotten, so the
+// latency-aware policies send it requests again right away.
+void server_reinstated(server_conn_t *sc) {
+    log_msg(LOG_INFO, "[Reverse Proxy #%d]: Server #%d is answering again\n", proxy_id, sc->server_id);
+    sc->ewma_us = 0.0;
+    sc->last_sample_us = 0;
+}
+
+// Charges a failed server a large latency so the latency-aware policies steer
+// away from it until its estimate decays, and ejects it after a run of
+// failures
+void record_failure(server_conn_t *sc) {
+    metrics_add(PROXY_SERVER_FAILURES, 1);
+    if (sc->ewma_us < FAILURE_PENALTY_US) {
+        sc->ewma_us = FAILURE_PENALTY_US;
+    }
+    sc->last_sample_us = now_us();
+    if (breaker_failure(&sc->breaker, trace_now())) {
+        server_ejected(sc, "failing");
+    }
+}
+
+// Compares the servers' latencies over the interval that just ended
+void eject_outliers(uint64_t now) {
+    breaker_t *group[MAX_SERVERS_PER_PROXY];
+    for (int i = 0; i < num_servers; i++) {
+        group[i] = &servers[i].breaker;
+    }
+    uint64_t ejected = breaker_eject_outliers(group, num_servers, now);
+    for (int i = 0; i < num_servers; i++) {
+        if (ejected & (1ULL << i)) {
+            server_ejected(&servers[i], "latency outlier");
+        }
+    }
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Adds a response latency to the window and recomputes the hedge delay as
+// the configured percentile of the window, first as soon as it holds enough
+// samples and then every HEDGE_REFRESH samples
+void record_hedge_sample(uint64_t latency_us) {
+    latency_window[latency_next] = latency_us;
+    latency_next = (latency_next + 1) % LATENCY_WINDOW;
+    if (latency_samples < LATENCY_WINDOW) {
+        latency_samples++;
+    }
+    latency_unsorted++;
+    if (hedge_percentile == 0 || latency_samples < HEDGE_MIN_SAMPLES ||
+        (latency_samples > HEDGE_MIN_SAMPLES && latency_unsorted < HEDGE_REFRESH)) {
+        return;
+    }
+    latency_unsorted = 0;
+    
+    uint64_t sorted[LATENCY_WINDOW];
+    memcpy(sorted, latency_window, latency_samples * sizeof(uint64_t));
+    qsort(sorted, latency_samples, sizeof(uint64_t), compare_u64);
+    hedge_delay_us = sorted[(latency_samples - 1) * hedge_percentile / 100];
+}
+
+void hedge_enqueue(pending_t *p) {
+    if (hedge_percentile == 0 || num_servers < 2) {
+        return;
+    }
+    p->hedge_queued = 1;
+    p->hedge_prev = hedge_tail;
+    p->hedge_next = NULL;
+    if (hedge_tail != NULL) {
+        hedge_tail->hedge_next = p;
+    } else {
+        hedge_head = p;
+    }
+    hedge_tail = p;
+}
+
+void hedge_dequeue(pending_t *p) {
+    if (!p->hedge_queued) {
+        return;
+    }
+    p->hedge_queued = 0;
+    if (p->hedge_prev != NULL) {
+        p->hedge_prev->hedge_next = p->hedge_next;
+    } else {
+        hedge_head = p->hedge_next;
+    }
+    if (p->hedge_next != NULL) {
+        p->hedge_next->hedge_prev = p->hedge_prev;
+    } else {
+        hedge_tail = p->hedge_prev;
+    }
+}
+
+// Expected wait on a server: its latency estimate, faded by how long it has
+// gone without samples so idle servers get probed again, scaled by the
+// requests already queued on it
+double server_cost(const server_conn_t *sc, uint64_t now) {
+    double ewma = sc->ewma_us;
+    if (sc->last_sample_us != 0) {
+        ewma *= exp(-(double)(now - sc->last_sample_us) / EWMA_DECAY_US);
+    }
+    return (ewma + 1.0) * (sc->outstanding + 1);
+}
+
+int select_random() {
+    return rand() % num_servers;
+}
+
+int select_round_robin() {
+    static int next = 0;
+    int index = next;
+    next = (next + 1) % num_servers;
+    return index;
+}
+
+// Scans from a random starting point so ties don't always favor server 1
+int select_least_outstanding() {
+    int start = rand() % num_servers;
+    int best = start;
+    for (int i = 1; i < num_servers; i++) {
+        int index = (start + i) % num_servers;
+        if (servers[index].outstanding < servers[best].outstanding) {
+            best = index;
+        }
+    }
+    return best;
+}
+
+// Samples two distinct servers and keeps the less loaded one
+int select_power_of_two() {
+    if (num_servers == 1) {
+        return 0;
+    }
+    int a = rand() % num_servers;
+    int b = rand() % (num_servers - 1);
+    if (b >= a) {
+        b++;
+    }
+    return servers[b].outstanding < servers[a].outstanding ? b : a;
+}
+
+int select_ewma() {
+    uint64_t now = now_us();
+    int start = rand() % num_servers;
+    int best = start;
+    double best_cost = server_cost(&servers[start], now);
+    for (int i = 1; i < num_servers; i++) {
+        int index = (start + i) % num_servers;
+        double cost = server_cost(&servers[index], now);
+        if (cost < best_cost) {
+            best = index;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+// Servers that are ejected and not due for a probe, a bit per index
+uint64_t down_servers(uint64_t now) {
+    uint64_t down = 0;
+    for (int i = 0; i < num_servers; i++) {
+        if (!breaker_available(&servers[i].breaker, now)) {
+            down |= 1ULL << i;
+        }
+    }
+    return down;
+}
+
+// Cheapest server that is not down and whose bit is clear in `exclude`, or
+// -1 when there is none. Retries and hedges use it whatever the balancing
+// policy.
+int select_other_server(uint64_t exclude) {
+    uint64_t now = now_us();
+    int start = rand() % num_servers;
+    int best = -1;
+    double best_cost = 0.0;
+    exclude |= down_servers(trace_now());
+    for (int i = 0; i < num_servers; i++) {
+        int index = (start + i) % num_servers;
+        if (exclude & (1ULL << index)) {
+            continue;
+        }
+        double cost = server_cost(&servers[index], now);
+        if (best == -1 || cost < best_cost) {
+            best = index;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+// Selects one of this proxy's servers with the configured policy, unless
+// that one is ejected. When every server is, the policy's choice stands and
+// sending to it fails fast.
+int pick_server(uint64_t now) {
+    int index = select_server();
+    if (down_servers(now) & (1ULL << index)) {
+        int other = select_other_server(0);
+        if (other != -1) {
+            index = other;
+        }
+    }
+    return index;
+}
+
+typedef struct {
+    const char *name;
+    select_server_fn select;
+} balancing_policy_t;
+
+static const balancing_policy_t policies[] = {
+    {"random", select_random},
+    {"round-robin", select_round_robin},
+    {"least-outstanding", select_least_outstanding},
+    {"p2c", select_power_of_two},
+    {"ewma", select_ewma},
+};
+
+// Drops the hold an answered request had on its connection
+void release_connection(connection_t *conn) {
+    conn->outstanding--;
+    if (conn->closed) {
+        if (conn->outstanding == 0) {
+            conn->next = graveyard;
+            graveyard = conn;
+        }
+    } else {
+        update_connection(conn);
+    }
+}
+
+// Gives every request that waited on `p` the same answer, with the trace
+// trailer already taken off `payload`. Failures are passed on as they are:
+// forwarding the waiters of a request a server shed would only multiply
+// the load it shed.
+void answer_waiters(pending_t *p, uint32_t flags, const char *payload, uint32_t length) {
+    while (p->waiters != NULL) {
+        waiter_t *w = p->waiters;
+        p->waiters = w->next;
+        num_waiters--;
+    
+        if (payload != NULL) {
+            if (w->traced) {
+                w->trace.stamps[TRACE_PROXY_RESPONSE] = trace_now();
+            }
+            metrics_add(PROXY_RESPONSES, 1);
+            send_response(w->conn, w->request_id, flags, payload, length, w->traced ? &w->trace : NULL);
+        } else {
+            send_failure(w->conn, w->request_id, flags & FRAME_FAILURE_FLAGS, 1);
+        }
+        metrics_observe(PROXY_LATENCY, trace_now() - w->received_ns);
+        release_connection(w->conn);
+        free(w);
+    }
+}
+
+// Retires the request and answers the client and whoever waited on it. A
+// NULL payload reports a failure for every value the request carried, with
+// the reason taken from the FRAME_FAILURE_FLAGS in `flags`.
+void complete_pending(pending_t *p, uint32_t flags, const char *payload, uint32_t length) {
+    connection_t *conn = p->conn;
+    
+    remove_pending(p->id);
+    remove_inflight(p);
+    hedge_dequeue(p);
+    if (p->hedge_sc != NULL) {
+        p->hedge_sc->outstanding--; // lost the race; its answer is dropped
+    }
+    if (p->sc != NULL) {
+        p->sc->outstanding--;
+        if (payload != NULL && breaker_success(&p->sc->breaker)) {
+            server_reinstated(p->sc);
+        }
+        if (flags & FRAME_FAILURE_FLAGS) {
+            // A request the server shed or dropped says nothing about how
+            // fast it computes
+            if (flags & FRAME_FLAG_OVERLOAD) {
+                metrics_add(PROXY_OVERLOADED, 1);
+            }
+        } else if (payload != NULL) {
+            uint64_t latency_us = now_us() - p->sent_us;
+            record_latency(p->sc, (double)latency_us);
+            record_hedge_sample(latency_us);
+            breaker_latency(&p->sc->breaker, latency_us * 1000);
+            metrics_observe(PROXY_SERVER_LATENCY, latency_us * 1000);
+        }
+    }
+    
+    if (payload != NULL) {
+        trace_t trace;
+        int traced = trace_extract(flags, payload, &length, &trace) == 0;
+        if (traced) {
+            trace.stamps[TRACE_PROXY_RESPONSE] = trace_now();
+        }
+        metrics_add(PROXY_RESPONSES, 1);
+        send_response(conn, p->client_request_id, flags, payload, length, traced ? &trace : NULL);
+    } else {
+        send_failure(conn, p->client_request_id, p->flags | (flags & FRAME_FAILURE_FLAGS), p->count);
+    }
+    metrics_observe(PROXY_LATENCY, trace_now() - p->received_ns);
+    release_connection(conn);
+    answer_waiters(p, flags, payload, length);
+    free(p->payload);
+    free(p);
+}
+
+void fail_pending(pending_t *p) {
+    complete_pending(p, 0, NULL, 0);
+}
+
+// A server that lets requests run past their deadline counts as failing
+void expire_pending(pending_t *p) {
+    LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+             "[Reverse Proxy #%d]: Request deadline passed, giving up on it\n", proxy_id);
+    metrics_add(PROXY_EXPIRED, 1);
+    if (p->sc != NULL) {
+        record_failure(p->sc);
+    }
+    complete_pending(p, FRAME_FLAG_EXPIRED, NULL, 0);
+}
+
+// Gives up on the requests whose deadline has passed, so a hung server
+// cannot hold them forever; a late answer is dropped as stale
+void expire_requests(uint64_t now) {
+    for (int i = 0; i < PENDING_BUCKETS && num_pending > 0; i++) {
+        pending_t *p = pending_table[i];
+        while (p != NULL) {
+            pending_t *next = p->next;
+            if (p->deadline_ns != 0 && p->deadline_ns <= now) {
+                expire_pending(p);
+            }
+            p = next;
+        }
+    }
+}
+
+void update_server_conn(server_conn_t *sc) {
+    uint32_t events = EPOLLIN | EPOLLRDHUP;
+    if (sc->state == SERVER_CONN_CONNECTING ||
+        (buffer_pending(&sc->out) > 0 && !sc->ep.flush_queued)) {
+        events |= EPOLLOUT;
+    }
+    if (watch_endpoint(&sc->ep, events) == -1) {
+        perror("loop_mod");
+    }
+}
+
+// Starts a non-blocking connect to the server. Returns 0 when the connect
+// completed or is in progress and -1 on failure.
+int connect_to_server(server_conn_t *sc) {
     char socket_path[256];
-    snprintf(socket_path, sizeof(socket_path), "%s%d", SERVER_SOCKET_BASE, server_id);
+    snprintf(socket_path, sizeof(socket_path), "%s%d", SERVER_SOCKET_BASE, sc->server_id);
     
     int sock = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sock == -1) {
@@ -94,128 +858,1009 @@ int connect_to_server(int server_id) {
         return -1;
     }
     
+    if (set_nonblocking(sock) == -1) {
+        perror("fcntl");
+        close(sock);
+        return -1;
+    }
+    
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
     strcpy(addr.sun_path, socket_path);
     
+    sc->state = SERVER_CONN_CONNECTED;
     if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("connect");
+        if (errno != EINPROGRESS) {
+            perror("connect");
+            close(sock);
+            sc->state = SERVER_CONN_DISCONNECTED;
+            return -1;
+        }
+        sc->state = SERVER_CONN_CONNECTING;
+    }
+    
+    sc->ep.fd = sock;
+    if (loop_add(sock, EPOLLIN | EPOLLRDHUP | EPOLLOUT, &sc->ep) == -1) {
+        perror("loop_add");
         close(sock);
+        sc->ep.fd = -1;
+        sc->state = SERVER_CONN_DISCONNECTED;
         return -1;
     }
     
-    return sock;
+    return 0;
 }
 
-void process_request(int client_sock) {
-    request_t req;
-    response_t resp;
+// Queues the request for one server under the proxy's own request ID.
+// Returns -1 when the server cannot be reached.
+int send_to_server(pending_t *p, server_conn_t *sc) {
+    uint64_t now = trace_now();
+    p->tried |= 1ULL << (sc - servers);
+    if (!breaker_available(&sc->breaker, now)) {
+        return -1;
+    }
+    if (sc->state == SERVER_CONN_DISCONNECTED && connect_to_server(sc) == -1) {
+        // Nothing listens on the socket, so there is no point in waiting
+        // for more failures
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                 "[Reverse Proxy #%d]: Failed to connect to Server #%d\n", proxy_id, sc->server_id);
+        record_failure(sc);
+        if (breaker_eject(&sc->breaker, now)) {
+            server_ejected(sc, "refused a connection");
+        }
+        return -1;
+    }
+    breaker_sent(&sc->breaker, now);
+    trace_stamp(p->flags, p->payload, p->length, TRACE_PROXY_FORWARDED);
     
-    ssize_t bytes_read = recv(client_sock, &req, sizeof(req), 0);
-    if (bytes_read != sizeof(req)) {
-        printf("[Reverse Proxy #%d]: Error reading request\n", proxy_id);
-        return;
+    // Frames that fit a slot skip the socket once the connection is up; the
+    // server is woken once per event loop iteration
+    if (sc->shm != NULL && sc->state == SERVER_CONN_CONNECTED) {
+        frame_header_t hdr = {PROTOCOL_MAGIC, PROTOCOL_VERSION, FRAME_REQUEST,
+                              p->flags, p->id, p->length};
+        if (shm_ring_push(&sc->shm->requests, 0, sc->epoch, &hdr, p->payload) == 0) {
+            sc->shm_kick = 1;
+            sc->outstanding++;
+            return 0;
+        }
     }
     
-    // Validate request (non-negative value)
-    if (req.value < 0) {
-        printf("[Reverse Proxy #%d]: Illegal request from Client #%d. Returning -1.\n", 
-               proxy_id, req.client_id);
-        resp.result = -1.0;
-        send(client_sock, &resp, sizeof(resp), 0);
+    if (frame_append(&sc->out, FRAME_REQUEST, p->flags, p->id, p->payload, p->length) == -1) {
+        return -1;
+    }
+    if (sc->state == SERVER_CONN_CONNECTED) {
+        schedule_flush(&sc->ep);
+    }
+    sc->outstanding++;
+    return 0;
+}
+
+void retry_pending(pending_t *p);
+
+void dispatch_request(pending_t *p, server_conn_t *sc) {
+    if (send_to_server(p, sc) == -1) {
+        retry_pending(p);
         return;
     }
+    p->sc = sc;
+    p->sent_us = now_us();
+    hedge_enqueue(p);
+}
+
+// Moves a request whose server could not be reached on to another server of
+// the group, or fails it once its retries are used up
+void retry_pending(pending_t *p) {
+    if (p->deadline_ns != 0 && p->deadline_ns <= trace_now()) {
+        expire_pending(p);
+        return;
+    }
+    int index = p->retries < max_retries ? select_other_server(p->tried) : -1;
+    if (index == -1) {
+        fail_pending(p);
+        return;
+    }
+    p->retries++;
+    metrics_add(PROXY_RETRIES, 1);
+    dispatch_request(p, &servers[index]);
+}
+
+// Sends a second copy of every request that has waited longer than the
+// hedge delay to another server, as long as the hedge budget lasts; the
+// first answer wins. Returns the milliseconds until the next request is
+// due, or -1 when none is.
+int send_hedges() {
+    uint64_t now = now_us();
+    while (hedge_head != NULL && hedge_delay_us > 0) {
+        pending_t *p = hedge_head;
+        uint64_t due = p->sent_us + hedge_delay_us;
+        if (due > now) {
+            return (due - now + 999) / 1000;
+        }
+    
+        hedge_dequeue(p);
+        int index = hedge_tokens >= 1.0 ? select_other_server(p->tried) : -1;
+        if (index == -1 || send_to_server(p, &servers[index]) == -1) {
+            continue;
+        }
+        hedge_tokens -= 1.0;
+        p->hedge_sc = &servers[index];
+        p->hedge_sent_us = now;
+        metrics_add(PROXY_HEDGES, 1);
+    }
+    return -1;
+}
+
+// Whether the request is still waiting for an answer from `sc`. When the
+// hedge answers first it becomes the request's server, so the completion
+// charges the latency to the server that actually replied.
+int pending_on(pending_t *p, server_conn_t *sc) {
+    if (p->hedge_sc == sc) {
+        p->hedge_sc = p->sc;
+        p->sc = sc;
+        uint64_t sent_us = p->sent_us;
+        p->sent_us = p->hedge_sent_us;
+        p->hedge_sent_us = sent_us;
+        metrics_add(PROXY_HEDGE_WINS, 1);
+        return 1;
+    }
+    return p->sc == sc;
+}
+
+// The connection to a server broke. Hedged requests carry on with their
+// other copy; the rest move on to another server while their retries last.
+// A connection that had already served responses may be tried afresh, as
+// the server was most likely respawned in the meantime.
+void server_conn_failed(server_conn_t *sc, const char *what) {
+    int was_reused = sc->reused;
+    pending_t *replay = NULL;
+    
+    close_endpoint(&sc->ep);
+    buffer_free(&sc->in);
+    buffer_free(&sc->out);
+    sc->state = SERVER_CONN_DISCONNECTED;
+    sc->reused = 0;
+    
+    if (sc->outstanding > 0) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Reverse Proxy #%d]: %s\n", proxy_id, what);
+        record_failure(sc);
+    }
+    
+    for (int i = 0; i < PENDING_BUCKETS && sc->outstanding > 0; i++) {
+        pending_t *p = pending_table[i];
+        while (p != NULL) {
+            pending_t *next = p->next;
+            if (p->hedge_sc == sc) {
+                p->hedge_sc = NULL;
+                sc->outstanding--;
+            } else if (p->sc == sc && p->hedge_sc != NULL) {
+                p->sc = p->hedge_sc;
+                p->sent_us = p->hedge_sent_us;
+                p->hedge_sc = NULL;
+                sc->outstanding--;
+            } else if (p->sc == sc) {
+                remove_pending(p->id);
+                hedge_dequeue(p);
+                sc->outstanding--;
+                p->sc = NULL;
+                if (was_reused) {
+                    p->tried &= ~(1ULL << (sc - servers));
+                }
+                p->next = replay;
+                replay = p;
+            }
+            p = next;
+        }
+    }
+    
+    while (replay != NULL) {
+        pending_t *p = replay;
+        replay = p->next;
+        insert_pending(p);
+        retry_pending(p);
+    }
+}
+
+void handle_server_event(server_conn_t *sc, uint32_t events) {
+    if (sc->state == SERVER_CONN_DISCONNECTED) {
+        return; // Stale event for a connection closed earlier in this batch
+    }
+    
+    if (sc->state == SERVER_CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(sc->ep.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            server_conn_failed(sc, "Error connecting to server");
+            return;
+        }
+        sc->state = SERVER_CONN_CONNECTED;
+    }
+    
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // Receive responses from server
+        ssize_t n = buffer_read_fd(&sc->in, sc->ep.fd);
+        if (n == 0 || (n == -1 && errno != EAGAIN)) {
+            server_conn_failed(sc, "Error receiving from server");
+            return;
+        }
+    
+        frame_header_t hdr;
+        const char *payload;
+        int ret;
+        while ((ret = frame_next(&sc->in, &hdr, &payload)) == 1) {
+            pending_t *p = find_pending(hdr.request_id);
+            if (p == NULL || hdr.type != FRAME_RESPONSE || !pending_on(p, sc)) {
+                continue; // Answer to a request that already failed or was answered
+            }
+    
+            sc->reused = 1;
+            complete_pending(p, hdr.flags, payload, hdr.length);
+        }
+        if (ret == -1) {
+            server_conn_failed(sc, "Error receiving from server");
+            return;
+        }
+    }
+    
+    // Forward queued requests to server
+    if (buffer_pending(&sc->out) > 0) {
+        schedule_flush(&sc->ep);
+    }
+    update_server_conn(sc);
+}
+
+// Delivers the responses a server put on its shared-memory channel
+void drain_shm_responses(server_conn_t *sc) {
+    uint32_t epoch;
+    frame_header_t hdr;
+    char payload[SHM_MAX_PAYLOAD];
+    
+    while (shm_ring_pop(&sc->shm->responses, &epoch, &hdr, payload) == 0) {
+        if (epoch != sc->epoch) {
+            continue; // Answer to a previous incarnation of this proxy
+        }
+        pending_t *p = find_pending(hdr.request_id);
+        if (p == NULL || hdr.type != FRAME_RESPONSE || !pending_on(p, sc)) {
+            continue; // Answer to a request that already failed or was answered
+        }
+    
+        sc->reused = 1;
+        complete_pending(p, hdr.flags, payload, hdr.length);
+    }
+}
+
+// Maps the shared-memory channels the watchdog set up for this proxy's
+// servers. Servers without one are reached over their socket only.
+void open_shm_channels() {
+    for (int i = 0; i < num_servers; i++) {
+        server_conn_t *sc = &servers[i];
+        sc->shm = shm_channel_open(sc->server_id);
+        if (sc->shm == NULL) {
+            log_msg(LOG_WARN, "[Reverse Proxy #%d]: No shared-memory channel to Server #%d, using its socket\n",
+                              proxy_id, sc->server_id);
+            continue;
+        }
+        sc->epoch = atomic_fetch_add(&sc->shm->epoch, 1) + 1;
+    
+        if (!busy_poll) {
+            sc->shm_ep.kind = EP_SHM;
+            sc->shm_ep.fd = sc->shm->responses.wake_fd;
+            if (loop_add(sc->shm_ep.fd, EPOLLIN, &sc->shm_ep) == -1) {
+                perror("loop_add");
+                shm_channel_close(sc->shm);
+                sc->shm = NULL;
+            }
+        }
+    }
+}
+
+// Makes a single request wait for the one in flight for the same value, if
+// that one will be answered or given up on before the request's own
+// deadline. Returns 1 when it does.
+int join_inflight(connection_t *conn, const frame_header_t *hdr, const char *payload, uint64_t key) {
+    pending_t *p = find_inflight(key);
+    if (p == NULL) {
+        return 0;
+    }
+    
+    uint64_t now = trace_now();
+    uint64_t deadline = request_deadline(hdr->flags, payload, hdr->length);
+    if (request_timeout_ns != 0 && (deadline == 0 || now + request_timeout_ns < deadline)) {
+        deadline = now + request_timeout_ns;
+    }
+    if (deadline != 0 && (deadline <= now || p->deadline_ns == 0 || p->deadline_ns > deadline)) {
+        return 0;
+    }
     
-    // Randomly select a server (1-3 for this proxy)
-    int server_index = rand() % 3;
-    int server_id = (proxy_id - 1) * 3 + server_index + 1;
+    waiter_t *w = calloc(1, sizeof(*w));
+    if (w == NULL) {
+        return 0;
+    }
+    w->conn = conn;
+    w->request_id = hdr->request_id;
+    w->received_ns = now;
+    uint32_t length = hdr->length;
+    w->traced = trace_extract(hdr->flags, payload, &length, &w->trace) == 0;
+    if (w->traced) {
+        w->trace.stamps[TRACE_PROXY_RECEIVED] = now;
+    }
+    w->next = p->waiters;
+    p->waiters = w;
+    num_waiters++;
+    conn->outstanding++;
+    
+    LOG_EVERY(LOG_INFO, log_sample,
+              "[Reverse Proxy #%d]: Request from Client #%d. Waiting on the one in flight for the same value\n",
+              proxy_id, request_client_id(payload));
+    metrics_add(PROXY_COALESCED, 1);
+    return 1;
+}
+
+void forward_request(connection_t *conn, const frame_header_t *hdr, const char *payload, int count,
+                     int coalesce, uint64_t key);
+
+void handle_request(connection_t *conn, const frame_header_t *hdr, const char *payload, int count) {
+    int client_id = request_client_id(payload);
+    metrics_add(PROXY_REQUESTS, 1);
+    metrics_add(PROXY_VALUES, count);
+    
+    // Validate request (non-negative value). Batches are forwarded unchanged
+    // and validated by the server.
+    int coalesce = 0;
+    uint64_t key = 0;
+    if (!(hdr->flags & FRAME_FLAG_BATCH)) {
+        request_t req;
+        memcpy(&req, payload, sizeof(req));
+        if (req.value < 0) {
+            LOG_EVERY(LOG_INFO, log_sample,
+                      "[Reverse Proxy #%d]: Illegal request from Client #%d. Returning -1.\n",
+                      proxy_id, client_id);
+            metrics_add(PROXY_ILLEGAL, 1);
+            send_failure(conn, hdr->request_id, hdr->flags, count);
+            return;
+        }
     
-    printf("[Reverse Proxy #%d]: Request from Client #%d. Forwarding to Server #%d\n", 
-           proxy_id, req.client_id, server_id);
+        // A value some server already computed needs no server at all, so
+        // this comes before the overload and deadline checks
+        response_t resp;
+        if (cache != NULL) {
+            if (result_cache_lookup(cache, req.value, &resp.result)) {
+                send_cached(conn, hdr, payload, &resp);
+                return;
+            }
+            metrics_add(PROXY_CACHE_MISSES, 1);
+        }
+    
+        // Nor does one whose value is already on its way to a server, which
+        // adds nothing to the load of the servers either
+        coalesce = 1;
+        key = value_key(req.value);
+        if (join_inflight(conn, hdr, payload, key)) {
+            return;
+        }
+    }
+    
+    forward_request(conn, hdr, payload, count, coalesce, key);
+}
+
+// Sends a valid request on to a server. With `coalesce` it is the one that
+// requests for the same value wait on until it is answered.
+void forward_request(connection_t *conn, const frame_header_t *hdr, const char *payload, int count,
+                     int coalesce, uint64_t key) {
+    int client_id = request_client_id(payload);
     
-    // Connect to selected server
-    int server_sock = connect_to_server(server_id);
-    if (server_sock == -1) {
-        printf("[Reverse Proxy #%d]: Failed to connect to Server #%d\n", proxy_id, server_id);
-        resp.result = -1.0;
-        send(client_sock, &resp, sizeof(resp), 0);
+    // Turn requests away early rather than let them queue behind the servers
+    if (num_pending >= max_inflight) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                 "[Reverse Proxy #%d]: Overloaded, shedding requests\n", proxy_id);
+        metrics_add(PROXY_SHED, 1);
+        send_failure(conn, hdr->request_id, hdr->flags | FRAME_FLAG_OVERLOAD, count);
         return;
     }
     
-    // Forward request to server
-    if (send(server_sock, &req, sizeof(req), 0) == -1) {
-        printf("[Reverse Proxy #%d]: Error sending to server\n", proxy_id);
-        close(server_sock);
+    uint64_t now = trace_now();
+    uint64_t deadline = request_deadline(hdr->flags, payload, hdr->length);
+    if (deadline != 0 && deadline <= now) {
+        metrics_add(PROXY_EXPIRED, 1);
+        send_failure(conn, hdr->request_id, hdr->flags | FRAME_FLAG_EXPIRED, count);
         return;
     }
     
-    // Receive response from server
-    if (recv(server_sock, &resp, sizeof(resp), 0) != sizeof(resp)) {
-        printf("[Reverse Proxy #%d]: Error receiving from server\n", proxy_id);
-        close(server_sock);
+    // The copy sent on carries the caller's deadline, or the proxy's own
+    // timeout when that is sooner
+    pending_t *p = calloc(1, sizeof(*p));
+    if (p != NULL) {
+        p->length = hdr->length;
+        p->flags = hdr->flags;
+        p->payload = request_copy(payload, &p->length, &p->flags,
+                                  request_timeout_ns != 0 ? now + request_timeout_ns : 0, 0);
+    }
+    if (p == NULL || p->payload == NULL) {
+        perror("malloc");
+        free(p);
         return;
     }
     
-    close(server_sock);
+    p->received_ns = now;
+    p->deadline_ns = request_deadline(p->flags, p->payload, p->length);
+    trace_stamp(p->flags, p->payload, p->length, TRACE_PROXY_RECEIVED);
+    p->count = count;
+    p->id = next_request_id++;
+    if (next_request_id == 0) {
+        next_request_id = 1;
+    }
+    p->client_request_id = hdr->request_id;
+    p->conn = conn;
     
-    // Send response back to load balancer
-    if (send(client_sock, &resp, sizeof(resp), 0) == -1) {
-        printf("[Reverse Proxy #%d]: Error sending response\n", proxy_id);
+    server_conn_t *sc = &servers[pick_server(now)];
+    
+    if (hdr->flags & FRAME_FLAG_BATCH) {
+        LOG_EVERY(LOG_INFO, log_sample,
+                  "[Reverse Proxy #%d]: Batch of %d values from Client #%d. Forwarding to Server #%d\n",
+                  proxy_id, count, client_id, sc->server_id);
+    } else {
+        LOG_EVERY(LOG_INFO, log_sample,
+                  "[Reverse Proxy #%d]: Request from Client #%d. Forwarding to Server #%d\n",
+                  proxy_id, client_id, sc->server_id);
+    }
+    
+    hedge_tokens += HEDGE_BUDGET;
+    if (hedge_tokens > HEDGE_BURST) {
+        hedge_tokens = HEDGE_BURST;
     }
+    
+    conn->outstanding++;
+    insert_pending(p);
+    if (coalesce && find_inflight(key) == NULL) {
+        insert_inflight(p, key);
+    }
+    dispatch_request(p, sc);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <proxy_id>\n", argv[0]);
+void handle_client_event(connection_t *conn, uint32_t events) {
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        close_connection(conn);
+        return;
+    }
+    
+    if (events & EPOLLIN) {
+        ssize_t n = buffer_read_fd(&conn->in, conn->client.fd);
+        if (n == 0) {
+            conn->read_closed = 1;
+        } else if (n == -1 && errno != EAGAIN) {
+            close_connection(conn);
+            return;
+        }
+    
+        frame_header_t hdr;
+        const char *payload;
+        int ret;
+        while (!conn->closed && (ret = frame_next(&conn->in, &hdr, &payload)) == 1) {
+            int count = request_value_count(&hdr, payload);
+            if (count == -1) {
+                ret = -1;
+                break;
+            }
+            handle_request(conn, &hdr, payload, count);
+        }
+        if (conn->closed) {
+            return;
+        }
+        if (ret == -1) {
+            LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                     "[Reverse Proxy #%d]: Error reading request\n", proxy_id);
+            close_connection(conn);
+            return;
+        }
+    }
+    
+    if (buffer_pending(&conn->out) > 0) {
+        schedule_flush(&conn->client);
+    }
+    update_connection(conn);
+}
+
+// Writes the output of every endpoint on the flush list in one batch, then
+// re-arms each of them. Server connections that fail here may answer or
+// replay requests, which queues more output for a further batch.
+void flush_endpoints() {
+    loop_send_t sends[MAX_EVENTS];
+    endpoint_t *batch[MAX_EVENTS];
+    
+    while (flush_list != NULL) {
+        int count = 0;
+        while (flush_list != NULL && count < MAX_EVENTS) {
+            endpoint_t *ep = flush_list;
+            flush_list = ep->next_flush;
+            ep->flush_queued = 0;
+    
+            buffer_t *out;
+            if (ep->kind == EP_SERVER) {
+                server_conn_t *sc = (server_conn_t *)ep;
+                if (sc->state != SERVER_CONN_CONNECTED) {
+                    continue;
+                }
+                out = &sc->out;
+            } else {
+                connection_t *conn = (connection_t *)ep;
+                if (conn->closed) {
+                    continue;
+                }
+                out = &conn->out;
+            }
+            if (buffer_pending(out) == 0) {
+                continue;
+            }
+            sends[count].fd = ep->fd;
+            sends[count].data = out->data + out->off;
+            sends[count].len = buffer_pending(out);
+            batch[count++] = ep;
+        }
+    
+        loop_send_batch(sends, count);
+    
+        for (int i = 0; i < count; i++) {
+            ssize_t result = sends[i].result;
+            if (batch[i]->kind == EP_SERVER) {
+                server_conn_t *sc = (server_conn_t *)batch[i];
+                if (sc->state != SERVER_CONN_CONNECTED) {
+                    continue; // Failed while an earlier result was applied
+                }
+                if (result < 0 && result != -EAGAIN) {
+                    server_conn_failed(sc, "Error sending to server");
+                    continue;
+                }
+                if (result > 0) {
+                    buffer_consume(&sc->out, result);
+                }
+                update_server_conn(sc);
+            } else {
+                connection_t *conn = (connection_t *)batch[i];
+                if (conn->closed) {
+                    continue;
+                }
+                if (result < 0 && result != -EAGAIN) {
+                    LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                             "[Reverse Proxy #%d]: Error sending response\n", proxy_id);
+                    close_connection(conn);
+                    continue;
+                }
+                if (result > 0) {
+                    buffer_consume(&conn->out, result);
+                }
+                update_connection(conn);
+            }
+        }
+    }
+}
+
+connection_t *add_client(int client_sock) {
+    connection_t *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL || set_nonblocking(client_sock) == -1) {
+        perror("accept setup");
+        free(conn);
+        close(client_sock);
+        return NULL;
+    }
+    
+    conn->client.kind = EP_CLIENT;
+    conn->client.fd = client_sock;
+    
+    if (loop_add(client_sock, EPOLLIN, &conn->client) == -1) {
+        perror("loop_add");
+        close(client_sock);
+        free(conn);
+        return NULL;
+    }
+    metrics_add(PROXY_CONNECTIONS, 1);
+    num_clients++;
+    return conn;
+}
+
+// Direct server return: every client connection the load balancer hands
+// down goes on to a server picked by the balancing policy, which answers the
+// client itself. A connection no server takes is served here instead.
+void accept_handoffs() {
+    buffer_t in = {0};
+    int client_sock;
+    
+    while (1) {
+        in.off = in.len = 0;
+        if (handoff_recv(handoff_ep.fd, &client_sock, &in) == -1) {
+            if (errno == EPROTO) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("handoff_recv");
+            }
+            break;
+        }
+    
+        server_conn_t *sc = &servers[pick_server(trace_now())];
+        char path[256];
+        snprintf(path, sizeof(path), "%s%d%s", SERVER_SOCKET_BASE, sc->server_id, HANDOFF_SUFFIX);
+        if (handoff_send(handoff_ep.fd, path, client_sock, in.data, in.len) == 0) {
+            LOG_EVERY(LOG_INFO, log_sample,
+                      "[Reverse Proxy #%d]: Handed a client connection off to Server #%d\n",
+                      proxy_id, sc->server_id);
+            metrics_add(PROXY_HANDOFFS, 1);
+            close(client_sock);
+            continue;
+        }
+    
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                 "[Reverse Proxy #%d]: Cannot hand a client connection to Server #%d (%s), forwarding its requests\n",
+                 proxy_id, sc->server_id, strerror(errno));
+        if (errno != EAGAIN) {
+            record_failure(sc);
+        }
+        connection_t *conn = add_client(client_sock);
+        if (conn != NULL) {
+            if (buffer_append(&conn->in, in.data, in.len) == -1) {
+                close_connection(conn);
+                continue;
+            }
+            handle_client_event(conn, EPOLLIN);
+        }
+    }
+    
+    buffer_free(&in);
+}
+
+// With io_uring the kernel already accepted the connection
+void accept_clients(int accepted) {
+    if (accepted != -1) {
+        add_client(accepted);
+        return;
+    }
+    
+    while (1) {
+        int client_sock = accept(proxy_socket, NULL, NULL);
+        if (client_sock == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !should_exit) {
+                perror("accept");
+            }
+            return;
+        }
+        add_client(client_sock);
+    }
+}
+
+// Scrape-time state of the event loop, which only this thread touches
+void add_gauges(buffer_t *out) {
+    metrics_family(out, "proxy_client_connections", "gauge", "Open load balancer and client connections");
+    metrics_sample(out, "proxy_client_connections", NULL, num_clients);
+    metrics_family(out, "proxy_requests_in_flight", "gauge", "Requests forwarded and not answered yet");
+    metrics_sample(out, "proxy_requests_in_flight", NULL, num_pending);
+    metrics_family(out, "proxy_coalesced_waiting", "gauge", "Requests waiting on one in flight for the same value");
+    metrics_sample(out, "proxy_coalesced_waiting", NULL, num_waiters);
+    metrics_family(out, "proxy_max_inflight", "gauge", "Requests allowed in flight before shedding");
+    metrics_sample(out, "proxy_max_inflight", NULL, max_inflight);
+    metrics_family(out, "proxy_hedge_delay_seconds", "gauge",
+                   "Wait before a request is hedged, 0 until enough latencies are known");
+    metrics_sample(out, "proxy_hedge_delay_seconds", NULL, hedge_delay_us / 1e6);
+    metrics_family(out, "proxy_cache_capacity", "gauge", "Entries the shared result cache holds, 0 without one");
+    metrics_sample(out, "proxy_cache_capacity", NULL, cache != NULL ? result_cache_capacity(cache) : 0);
+    
+    char labels[32];
+    metrics_family(out, "proxy_server_outstanding", "gauge", "Requests in flight per server");
+    for (int i = 0; i < num_servers; i++) {
+        snprintf(labels, sizeof(labels), "server=\"%d\"", servers[i].server_id);
+        metrics_sample(out, "proxy_server_outstanding", labels, servers[i].outstanding);
+    }
+    metrics_family(out, "proxy_server_ejected", "gauge", "1 while a server is out of rotation");
+    for (int i = 0; i < num_servers; i++) {
+        snprintf(labels, sizeof(labels), "server=\"%d\"", servers[i].server_id);
+        metrics_sample(out, "proxy_server_ejected", labels, servers[i].breaker.state != BREAKER_CLOSED);
+    }
+    metrics_family(out, "proxy_server_latency_seconds", "gauge",
+                   "Smoothed response latency per server, as the balancing policies see it");
+    for (int i = 0; i < num_servers; i++) {
+        snprintf(labels, sizeof(labels), "server=\"%d\"", servers[i].server_id);
+        metrics_sample(out, "proxy_server_latency_seconds", labels, servers[i].ewma_us / 1e6);
+    }
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b random|round-robin|least-outstanding|p2c|ewma] "
+            "[-s servers_per_proxy] [-t socket|shm|shm-poll] [-e epoll|io_uring] "
+            "[-r proxied|direct] [-q max_inflight] [-R retries] [-H hedge_percentile] "
+            "[-o request_timeout_ms] [-L debug|info|warn|error|off] [-S log_one_request_in] "
+            "<proxy_id>\n", prog);
+    exit(1);
+}
+
+void parse_args(int argc, char *argv[]) {
+    const char *policy = "p2c";
+    const char *transport = "socket";
+    int opt;
+    while ((opt = getopt(argc, argv, "b:s:t:e:r:q:R:H:o:L:S:")) != -1) {
+        switch (opt) {
+        case 'b':
+            policy = optarg;
+            break;
+        case 's':
+            num_servers = atoi(optarg);
+            break;
+        case 't':
+            transport = optarg;
+            break;
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0) {
+                io_backend = LOOP_EPOLL;
+            } else if (strcmp(optarg, "io_uring") == 0) {
+                io_backend = LOOP_IO_URING;
+            } else {
+                fprintf(stderr, "Unknown I/O backend: %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            if (strcmp(optarg, "direct") != 0 && strcmp(optarg, "proxied") != 0) {
+                fprintf(stderr, "Unknown return path: %s\n", optarg);
+                usage(argv[0]);
+            }
+            direct_return = strcmp(optarg, "direct") == 0;
+            break;
+        case 'q':
+            max_inflight = atoi(optarg);
+            break;
+        case 'R':
+            max_retries = atoi(optarg);
+            break;
+        case 'H':
+            hedge_percentile = atoi(optarg);
+            break;
+        case 'o':
+            request_timeout_ns = strtoull(optarg, NULL, 10) * 1000000;
+            break;
+        case 'L':
+            if (log_parse_level(optarg, &log_level) == -1) {
+                fprintf(stderr, "Unknown log level: %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'S':
+            log_sample = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    proxy_id = atoi(argv[optind]);
+    if (log_sample < 1) {
+        fprintf(stderr, "Log sampling must be at least 1\n");
+        exit(1);
+    }
+    if (num_servers < 1 || num_servers > MAX_SERVERS_PER_PROXY) {
+        fprintf(stderr, "Servers per proxy must be between 1 and %d\n", MAX_SERVERS_PER_PROXY);
+        exit(1);
+    }
+    if (max_inflight < 1) {
+        fprintf(stderr, "In-flight limit must be at least 1\n");
+        exit(1);
+    }
+    if (max_retries < 0) {
+        fprintf(stderr, "Retries must not be negative\n");
+        exit(1);
+    }
+    if (hedge_percentile < 0 || hedge_percentile > 99) {
+        fprintf(stderr, "Hedge percentile must be between 0 (no hedging) and 99\n");
         exit(1);
     }
     
-    proxy_id = atoi(argv[1]);
-    srand(time(NULL) + proxy_id); // Seed random number generator
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(policies[i].name, policy) == 0) {
+            select_server = policies[i].select;
+        }
+    }
+    if (select_server == NULL) {
+        fprintf(stderr, "Unknown balancing policy: %s\n", policy);
+        usage(argv[0]);
+    }
+    
+    if (strcmp(transport, "shm") == 0 || strcmp(transport, "shm-poll") == 0) {
+        use_shm = 1;
+        busy_poll = strcmp(transport, "shm-poll") == 0;
+    } else if (strcmp(transport, "socket") != 0) {
+        fprintf(stderr, "Unknown transport: %s\n", transport);
+        usage(argv[0]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+    if (log_init(STDOUT_FILENO) == -1) {
+        perror("log_init"); // Messages are written directly instead
+    }
     
     setup_signals();
     
-    printf("[Reverse Proxy #%d]: Started\n", proxy_id);
+    if (loop_init(io_backend) == -1) {
+        if (io_backend != LOOP_IO_URING) {
+            perror("loop_init");
+            exit(1);
+        }
+        log_msg(LOG_WARN, "[Reverse Proxy #%d]: io_uring unavailable (%s), using epoll\n", proxy_id, strerror(errno));
+        if (loop_init(LOOP_EPOLL) == -1) {
+            perror("loop_init");
+            exit(1);
+        }
+    }
+    metrics_init(proxy_counters, PROXY_COUNTERS, proxy_histograms, PROXY_HISTOGRAMS);
+    
+    // A standby has done everything above ahead of time and waits here for
+    // the proxy whose place it takes
+    int takeover = standby_wait();
+    if (takeover == -1) {
+        exit(0);
+    }
+    if (takeover > 0) {
+        proxy_id = takeover;
+    }
+    srand(time(NULL) + proxy_id); // Seed random number generator
+    
+    for (int i = 0; i < num_servers; i++) {
+        servers[i].ep.kind = EP_SERVER;
+        servers[i].ep.fd = -1;
+        servers[i].server_id = (proxy_id - 1) * num_servers + i + 1;
+        breaker_init(&servers[i].breaker);
+    }
+    
+    log_msg(LOG_INFO, "[Reverse Proxy #%d]: Started\n", proxy_id);
     
     if (create_proxy_socket() == -1) {
         exit(1);
     }
     
+    // The listening socket is registered with a NULL endpoint
+    if (loop_add_listener(proxy_socket, NULL) == -1) {
+        perror("loop_add_listener");
+        exit(1);
+    }
+    
+    if (use_shm) {
+        open_shm_channels();
+    }
+    cache = result_cache_open();
+    
+    char handoff_path[256];
+    snprintf(handoff_path, sizeof(handoff_path), "%s%d%s", PROXY_SOCKET_BASE, proxy_id, HANDOFF_SUFFIX);
+    if (direct_return) {
+        handoff_ep.fd = handoff_socket(handoff_path);
+        if (handoff_ep.fd == -1 || loop_add(handoff_ep.fd, EPOLLIN, &handoff_ep) == -1) {
+            perror("handoff socket");
+            exit(1);
+        }
+    }
+    
+    // Statistics are optional; proxying works without them
+    char stats_path[256];
+    snprintf(stats_path, sizeof(stats_path), "%s%d%s", PROXY_SOCKET_BASE, proxy_id, STATS_SUFFIX);
+    stats_ep.fd = metrics_socket(stats_path);
+    if (stats_ep.fd != -1 && loop_add_listener(stats_ep.fd, &stats_ep) == -1) {
+        perror("loop_add_listener");
+    }
+    
+    loop_event_t events[MAX_EVENTS];
+    int next_hedge_ms = -1;
+    uint64_t next_sweep = 0;
+    uint64_t next_outlier_sweep = 0;
+    notify_ready();
+    
     while (!should_exit) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(proxy_socket, &readfds);
-        
-        struct timeval timeout = {1, 0}; // 1 second timeout
-        
-        int ready = select(proxy_socket + 1, &readfds, NULL, NULL, &timeout);
+        int timeout = 1000; // 1 second timeout
+        if (next_hedge_ms >= 0 && next_hedge_ms < timeout) {
+            timeout = next_hedge_ms;
+        }
+        if (num_pending > 0 && timeout > DEADLINE_SWEEP_MS) {
+            timeout = DEADLINE_SWEEP_MS;
+        }
+        for (int i = 0; i < num_servers; i++) {
+            shm_channel_t *shm = servers[i].shm;
+            if (shm != NULL && (busy_poll || !shm_ring_prepare_wait(&shm->responses))) {
+                timeout = 0;
+            }
+        }
+    
+        int ready = loop_wait(events, MAX_EVENTS, timeout);
+        for (int i = 0; i < num_servers; i++) {
+            if (servers[i].shm != NULL && !busy_poll) {
+                shm_ring_finish_wait(&servers[i].shm->responses, 0);
+            }
+        }
         if (ready == -1) {
             if (errno == EINTR) continue; // Interrupted by signal
-            perror("select");
+            perror("loop_wait");
             break;
         }
-        
-        if (ready > 0 && FD_ISSET(proxy_socket, &readfds)) {
-            int client_sock = accept(proxy_socket, NULL, NULL);
-            if (client_sock == -1) {
-                if (errno == EINTR) continue;
-                perror("accept");
+    
+        for (int i = 0; i < ready; i++) {
+            endpoint_t *ep = events[i].ptr;
+            if (ep == NULL) {
+                accept_clients(events[i].fd);
+            } else if (ep->kind == EP_SERVER) {
+                handle_server_event((server_conn_t *)ep, events[i].events);
+            } else if (ep->kind == EP_HANDOFF) {
+                accept_handoffs();
+            } else if (ep->kind == EP_STATS) {
+                metrics_serve(stats_ep.fd, events[i].fd, add_gauges);
+            } else if (ep->kind == EP_SHM) {
+                server_conn_t *sc = (server_conn_t *)((char *)ep - offsetof(server_conn_t, shm_ep));
+                shm_ring_finish_wait(&sc->shm->responses, 1);
+            } else {
+                connection_t *conn = (connection_t *)ep;
+                if (!conn->closed) {
+                    handle_client_event(conn, events[i].events);
+                }
+            }
+        }
+    
+        uint64_t now = trace_now();
+        if (num_pending > 0 && now >= next_sweep) {
+            expire_requests(now);
+            next_sweep = now + DEADLINE_SWEEP_MS * 1000000ULL;
+        }
+        if (now >= next_outlier_sweep) {
+            eject_outliers(now);
+            next_outlier_sweep = now + BREAKER_INTERVAL_NS;
+        }
+    
+        // Hedges go out before the servers are woken below
+        next_hedge_ms = send_hedges();
+    
+        // Rings are drained every iteration; their wakeups only end the wait
+        for (int i = 0; i < num_servers; i++) {
+            server_conn_t *sc = &servers[i];
+            if (sc->shm == NULL) {
                 continue;
             }
-            
-            process_request(client_sock);
-            close(client_sock);
+            drain_shm_responses(sc);
+            if (sc->shm_kick) {
+                sc->shm_kick = 0;
+                shm_ring_notify(&sc->shm->requests);
+            }
+        }
+    
+        flush_endpoints();
+        free_graveyard();
+    }
+    
+    for (int i = 0; i < num_servers; i++) {
+        close_endpoint(&servers[i].ep);
+        if (servers[i].shm != NULL) {
+            shm_channel_close(servers[i].shm);
         }
     }
+    if (cache != NULL) {
+        result_cache_close(cache);
+    }
+    
+    if (should_exit) {
+        log_msg(LOG_INFO, "[Reverse Proxy #%d]: Received SIGTERM from watchdog. Terminating.\n", proxy_id);
+    }
     
     // Clean up
     if (proxy_socket != -1) {
         close(proxy_socket);
+    }
+    if (proxy_socket_bound) {
         char socket_path[256];
         snprintf(socket_path, sizeof(socket_path), "%s%d", PROXY_SOCKET_BASE, proxy_id);
         unlink(socket_path);
     }
+    if (stats_ep.fd != -1) {
+        close(stats_ep.fd);
+        unlink(stats_path);
+    }
+    if (handoff_ep.fd != -1) {
+        close(handoff_ep.fd);
+        unlink(handoff_path);
+    }
     
     return 0;
-} 
\ No newline at end of file
+}
\ No newline at end of file
@@ -9,29 +9,131 @@
 #include <signal.h>
 #include <math.h>
 #include <errno.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "codel.h"
+#include "protocol.h"
+#include "log.h"
+#include "metrics.h"
+#include "queue.h"
+#include "shm_channel.h"
+#include "listen_socket.h"
+#include "result_cache.h"
+
 #define SOCKET_PATH_BASE "/tmp/server_"
 #define BUFFER_SIZE 256
+#define MAX_CLIENTS 128
+#define DEFAULT_WORKERS 2
+#define MAX_WORKERS 64
+#define JOB_QUEUE_SIZE 4096
+#define SHM_PUSH_RETRIES 1000
 
 static int server_id;
 static int server_socket = -1;
+static int server_socket_bound = 0; // ours to unlink, rather than the watchdog's
+static int num_workers = DEFAULT_WORKERS;
+static shm_channel_t *channel = NULL; // shared-memory transport, if enabled
+static result_cache_t *cache = NULL; // shared with the proxies, if the watchdog created it
+static int use_shm = 0;
+static int busy_poll = 0;
+static int direct_return = 0; // also serves clients handed down by the proxies
+static int handoff_sock = -1;
+static int stats_socket = -1;
+static int queue_limit = JOB_QUEUE_SIZE; // requests waiting for a worker
+static uint64_t codel_target_ns = CODEL_DEFAULT_TARGET_NS;
 static volatile sig_atomic_t should_exit = 0;
 
+enum {
+    SERVER_REQUESTS,
+    SERVER_VALUES,
+    SERVER_ILLEGAL,
+    SERVER_ERRORS,
+    SERVER_CONNECTIONS,
+    SERVER_HANDOFFS,
+    SERVER_JOBS_SUBMITTED,
+    SERVER_JOBS_STARTED,
+    SERVER_SHED,
+    SERVER_EXPIRED,
+    SERVER_COUNTERS
+};
+
+static const metric_desc_t server_counters[SERVER_COUNTERS] = {
+    {"server_requests_total", "Requests computed"},
+    {"server_values_total", "Values computed"},
+    {"server_illegal_values_total", "Negative values answered with -1"},
+    {"server_errors_total", "Malformed requests that closed their connection"},
+    {"server_connections_total", "Connections accepted"},
+    {"server_handoffs_total", "Client connections received for direct server return"},
+    {"server_jobs_submitted_total", "Requests queued for the worker pool"},
+    {"server_jobs_started_total", "Requests the workers took off the queue"},
+    {"server_shed_total", "Requests answered with an overload response instead of being computed"},
+    {"server_expired_total", "Requests dropped uncomputed because their deadline had passed"},
+};
+
+enum {
+    SERVER_LATENCY,
+    SERVER_COMPUTE,
+    SERVER_HISTOGRAMS
+};
+
+static const metric_desc_t server_histograms[SERVER_HISTOGRAMS] = {
+    {"server_request_duration_seconds", "Time from reading a request to its computed response"},
+    {"server_compute_duration_seconds", "Time spent computing a response"},
+};
+
+// A persistent proxy connection, or with direct server return a client
+// connection a proxy handed over. Requests may be pipelined, so partial
+// frames and unsent responses are buffered per connection. Only the I/O
+// thread touches connections; workers just see them as job owners.
 typedef struct {
-    int client_id;
-    double value;
-} request_t;
+    int fd;
+    int slot;    // index in the poll array
+    int closed;
+    int refs;    // jobs still being computed for this connection
+    buffer_t in;
+    buffer_t out;
+} client_conn_t;
 
+// A request handed to the worker pool. The I/O thread accepts and parses
+// requests and pushes them on job_queue; workers compute the response into
+// `out` and push the job on done_queue, then wake the I/O thread through
+// done_fd so it can write the response to the connection. Jobs that came
+// through the shared-memory channel have no connection; workers put their
+// responses straight on the channel.
 typedef struct {
-    double result;
-} response_t;
+    client_conn_t *conn;
+    uint32_t epoch; // shared-memory requests only
+    uint64_t received; // when the I/O thread read it
+    frame_header_t hdr;
+    char *payload;
+    buffer_t out;
+    int failed;
+} job_t;
+
+static mpmc_queue_t job_queue;
+static mpmc_queue_t done_queue;
+static sem_t jobs_ready;
+static int done_fd = -1;
+static int jobs_in_flight = 0; // owned by the I/O thread
+static atomic_int jobs_queued;  // submitted but not yet taken by a worker
+static atomic_int workers_stop;
+static pthread_t workers[MAX_WORKERS];
 
 // prompt : Implement signal handler for SIGTERM. s
 void signal_handler(int sig) {
     if (sig == SIGTERM) {
-        printf("[Server #%d]: Received SIGTERM from watchdog. Terminating.\n", server_id);
+        // Logged by the main loop; the logger is not async-signal-safe
         should_exit = 1;
         if (server_socket != -1) {
             close(server_socket);
@@ -47,110 +149,836 @@ void setup_signals() {
     sigaction(SIGTERM, &sa, NULL);
 }
 
+// Uses the socket the watchdog keeps open across restarts, if it passed one
 int create_server_socket() {
-    char socket_path[256];
-    snprintf(socket_path, sizeof(socket_path), "%s%d", SOCKET_PATH_BASE, server_id);
-    
-    // Remove existing socket file
-    unlink(socket_path);
-    
-    server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    server_socket = listen_socket_inherited();
     if (server_socket == -1) {
-        perror("socket");
+        char socket_path[256];
+        snprintf(socket_path, sizeof(socket_path), "%s%d", SOCKET_PATH_BASE, server_id);
+        server_socket = listen_socket_create(socket_path, SOMAXCONN);
+        if (server_socket == -1) {
+            return -1;
+        }
+        server_socket_bound = 1;
+    }
+    
+    return 0;
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
         return -1;
     }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Batch kernels: out[i] = sqrt(in[i]), or -1 for negative (illegal) values.
+// The widest variant the CPU supports is picked once at startup.
+typedef void (*sqrt_kernel_t)(const double *in, double *out, size_t n);
+
+static sqrt_kernel_t sqrt_kernel;
+
+static void sqrt_batch_scalar(const double *in, double *out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = in[i] < 0 ? -1.0 : sqrt(in[i]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void sqrt_batch_sse2(const double *in, double *out, size_t n) {
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d illegal = _mm_set1_pd(-1.0);
+    size_t i = 0;
     
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, socket_path);
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_loadu_pd(in + i);
+        __m128d neg = _mm_cmplt_pd(v, zero);
+        __m128d r = _mm_sqrt_pd(v);
+        r = _mm_or_pd(_mm_and_pd(neg, illegal), _mm_andnot_pd(neg, r));
+        _mm_storeu_pd(out + i, r);
+    }
+    sqrt_batch_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void sqrt_batch_avx2(const double *in, double *out, size_t n) {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d illegal = _mm256_set1_pd(-1.0);
+    size_t i = 0;
     
-    if (bind(server_socket, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("bind");
-        close(server_socket);
-        return -1;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(in + i);
+        __m256d neg = _mm256_cmp_pd(v, zero, _CMP_LT_OQ);
+        __m256d r = _mm256_sqrt_pd(v);
+        _mm256_storeu_pd(out + i, _mm256_blendv_pd(r, illegal, neg));
+    }
+    sqrt_batch_scalar(in + i, out + i, n - i);
+}
+#endif
+
+void select_sqrt_kernel() {
+    sqrt_kernel = sqrt_batch_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        sqrt_kernel = sqrt_batch_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        sqrt_kernel = sqrt_batch_sse2;
     }
+#endif
+}
+
+int process_batch(buffer_t *out, const frame_header_t *hdr, const char *payload, int count,
+                  trace_t *trace) {
+    batch_header_t batch;
+    memcpy(&batch, payload, sizeof(batch));
     
-    if (listen(server_socket, 5) == -1) {
-        perror("listen");
-        close(server_socket);
+    // Copy into aligned storage; the payload sits at an arbitrary offset
+    double *values = malloc(2 * count * sizeof(double));
+    if (values == NULL) {
+        perror("malloc");
         return -1;
     }
+    double *results = values + count;
+    memcpy(values, payload + sizeof(batch), count * sizeof(double));
     
-    return 0;
+    sqrt_kernel(values, results, count);
+    int illegal = 0;
+    for (int i = 0; i < count; i++) {
+        illegal += values[i] < 0;
+    }
+    if (illegal > 0) {
+        metrics_add(SERVER_ILLEGAL, illegal);
+    }
+    
+    LOG_EVERY(LOG_INFO, log_sample, "[Server #%d]: Received a batch of %d values from Client #%d.\n",
+                                    server_id, count, batch.client_id);
+    
+    if (trace != NULL) {
+        trace->stamps[TRACE_SERVER_COMPUTED] = trace->stamps[TRACE_SERVER_REPLIED] = trace_now();
+    }
+    int ret = frame_append_traced(out, FRAME_RESPONSE, FRAME_FLAG_BATCH, hdr->request_id,
+                                  results, count * sizeof(double), trace);
+    free(values);
+    return ret;
 }
 
-void process_request(int client_sock) {
+int process_single(buffer_t *out, const frame_header_t *hdr, const char *payload, trace_t *trace) {
     request_t req;
     response_t resp;
     
-    ssize_t bytes_read = recv(client_sock, &req, sizeof(req), 0);
-    if (bytes_read != sizeof(req)) {
-        printf("[Server #%d]: Error reading request\n", server_id);
+    memcpy(&req, payload, sizeof(req));
+    
+    // Proxies filter illegal values, but handed-off clients reach us directly
+    if (req.value < 0) {
+        LOG_EVERY(LOG_INFO, log_sample,
+                  "[Server #%d]: Illegal request from Client #%d. Returning -1.\n", server_id, req.client_id);
+        metrics_add(SERVER_ILLEGAL, 1);
+        resp.result = -1.0;
+    } else {
+        // Calculate square root
+        resp.result = sqrt(req.value);
+        if (cache != NULL) {
+            result_cache_insert(cache, req.value, resp.result);
+        }
+    
+        LOG_EVERY(LOG_INFO, log_sample,
+                  "[Server #%d]: Received the value %.1f from Client #%d. Returning %.1f.\n",
+                  server_id, req.value, req.client_id, resp.result);
+    }
+    
+    // Queue the response under the caller's request ID
+    if (trace != NULL) {
+        trace->stamps[TRACE_SERVER_COMPUTED] = trace->stamps[TRACE_SERVER_REPLIED] = trace_now();
+    }
+    return frame_append_traced(out, FRAME_RESPONSE, 0, hdr->request_id, &resp, sizeof(resp), trace);
+}
+
+// Returns the number of values in a request, or -1 after reporting a
+// malformed one
+int read_request(const frame_header_t *hdr, const char *payload) {
+    int count = request_value_count(hdr, payload);
+    if (count == -1) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Server #%d]: Error reading request\n", server_id);
+        metrics_add(SERVER_ERRORS, 1);
+    }
+    return count;
+}
+
+// Computes the response to one request and appends it to `out`, timing it
+// from `received`, when the I/O thread read it. Called by workers, or by
+// the I/O thread when the pool is disabled.
+int process_request(buffer_t *out, const frame_header_t *hdr, const char *payload, uint64_t received) {
+    int count = read_request(hdr, payload);
+    if (count == -1) {
+        return -1;
+    }
+    metrics_add(SERVER_REQUESTS, 1);
+    metrics_add(SERVER_VALUES, count);
+    
+    // Traced responses carry the request's stamps back up
+    uint64_t computing = trace_now();
+    trace_t trace;
+    trace_t *traced = NULL;
+    uint32_t length = hdr->length;
+    if (trace_extract(hdr->flags, payload, &length, &trace) == 0) {
+        trace.stamps[TRACE_SERVER_RECEIVED] = received;
+        trace.stamps[TRACE_SERVER_COMPUTING] = computing;
+        traced = &trace;
+    }
+    
+    int ret;
+    if (hdr->flags & FRAME_FLAG_BATCH) {
+        ret = process_batch(out, hdr, payload, count, traced);
+    } else {
+        ret = process_single(out, hdr, payload, traced);
+    }
+    
+    uint64_t computed = trace_now();
+    metrics_observe(SERVER_COMPUTE, computed - computing);
+    metrics_observe(SERVER_LATENCY, computed - received);
+    return ret;
+}
+
+// Answers a request with a failure instead of computing it: an overload
+// response when `reason` is FRAME_FLAG_OVERLOAD, an expired one when it is
+// FRAME_FLAG_EXPIRED
+int reject_request(buffer_t *out, const frame_header_t *hdr, const char *payload, uint32_t reason) {
+    int count = read_request(hdr, payload);
+    if (count == -1) {
+        return -1;
+    }
+    if (reason == FRAME_FLAG_OVERLOAD) {
+        metrics_add(SERVER_SHED, 1);
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Server #%d]: Overloaded, shedding requests\n", server_id);
+    } else {
+        metrics_add(SERVER_EXPIRED, 1);
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                 "[Server #%d]: Request deadline passed, dropping it\n", server_id);
+    }
+    return frame_append_failure(out, (hdr->flags & FRAME_FLAG_BATCH) | reason, hdr->request_id, count, -1.0);
+}
+
+int expired(const frame_header_t *hdr, const char *payload, uint64_t now) {
+    uint64_t deadline = request_deadline(hdr->flags, payload, hdr->length);
+    return deadline != 0 && deadline <= now;
+}
+
+// Restamps a computed response when the I/O thread or a worker finally
+// hands it to its connection or channel
+void stamp_replied(buffer_t *out) {
+    frame_header_t hdr;
+    if (buffer_pending(out) < sizeof(hdr)) {
+        return;
+    }
+    memcpy(&hdr, out->data + out->off, sizeof(hdr));
+    if (buffer_pending(out) >= sizeof(hdr) + hdr.length) {
+        trace_stamp(hdr.flags, out->data + out->off + sizeof(hdr), hdr.length, TRACE_SERVER_REPLIED);
+    }
+}
+
+// Moves the frames of a computed response onto the channel's response ring,
+// which the I/O thread and every worker push to
+void send_shm_response(uint32_t epoch, buffer_t *out) {
+    frame_header_t hdr;
+    const char *payload;
+    stamp_replied(out);
+    while (frame_next(out, &hdr, &payload) == 1) {
+        int tries = 0;
+        while (shm_ring_push(&channel->responses, 1, epoch, &hdr, payload) == -1) {
+            if (++tries == SHM_PUSH_RETRIES) {
+                LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                         "[Server #%d]: Response ring full, dropping response\n", server_id);
+                break;
+            }
+            sched_yield(); // Let the proxy drain the ring
+        }
+    }
+    shm_ring_notify(&channel->responses);
+}
+
+void *worker_main(void *arg) {
+    (void)arg;
+    
+    // Each worker judges the delay of the jobs it takes off the queue
+    codel_t codel;
+    codel_init(&codel, codel_target_ns, CODEL_DEFAULT_INTERVAL_NS);
+    
+    while (1) {
+        if (sem_wait(&jobs_ready) == -1) {
+            continue; // EINTR
+        }
+        if (atomic_load(&workers_stop)) {
+            break;
+        }
+    
+        job_t *job;
+        if (queue_pop(&job_queue, (void **)&job) == -1) {
+            continue;
+        }
+        atomic_fetch_sub_explicit(&jobs_queued, 1, memory_order_relaxed);
+        metrics_add(SERVER_JOBS_STARTED, 1);
+    
+        // Nothing is computed for a client that has given up
+        uint64_t now = trace_now();
+        if (expired(&job->hdr, job->payload, now)) {
+            job->failed = reject_request(&job->out, &job->hdr, job->payload, FRAME_FLAG_EXPIRED);
+        } else if (codel_should_shed(&codel, now - job->received, now)) {
+            job->failed = reject_request(&job->out, &job->hdr, job->payload, FRAME_FLAG_OVERLOAD);
+        } else {
+            job->failed = process_request(&job->out, &job->hdr, job->payload, job->received);
+        }
+    
+        if (job->conn == NULL) {
+            send_shm_response(job->epoch, &job->out);
+            buffer_free(&job->out);
+            free(job->payload);
+            free(job);
+            continue;
+        }
+    
+        // done_queue has room for every job in flight, so this cannot fail
+        queue_push(&done_queue, job);
+        uint64_t one = 1;
+        if (write(done_fd, &one, sizeof(one)) == -1) {
+            perror("write");
+        }
+    }
+    
+    return NULL;
+}
+
+int start_workers() {
+    if (num_workers == 0) {
+        return 0;
+    }
+    
+    if (queue_init(&job_queue, JOB_QUEUE_SIZE) == -1 ||
+        queue_init(&done_queue, JOB_QUEUE_SIZE) == -1 ||
+        sem_init(&jobs_ready, 0, 0) == -1) {
+        perror("worker pool");
+        return -1;
+    }
+    
+    done_fd = eventfd(0, EFD_NONBLOCK);
+    if (done_fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    
+    atomic_init(&workers_stop, 0);
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+void stop_workers() {
+    if (num_workers == 0) {
         return;
     }
     
-    // Calculate square root
-    resp.result = sqrt(req.value);
+    atomic_store(&workers_stop, 1);
+    for (int i = 0; i < num_workers; i++) {
+        sem_post(&jobs_ready);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+// Hands a request to the worker pool. Returns -1 when it has to be served
+// inline because the pool is disabled, and 1 when it should be shed because
+// queue_limit requests are already waiting or every queue slot is taken.
+// Only connection jobs come back through done_queue, so only they count
+// against its capacity.
+int submit_job(client_conn_t *conn, uint32_t epoch, const frame_header_t *hdr, const char *payload,
+               uint64_t received) {
+    if (num_workers == 0) {
+        return -1;
+    }
+    if (atomic_load_explicit(&jobs_queued, memory_order_relaxed) >= queue_limit ||
+        (conn != NULL && jobs_in_flight >= JOB_QUEUE_SIZE)) {
+        return 1;
+    }
+    
+    job_t *job = calloc(1, sizeof(*job));
+    if (job == NULL || (job->payload = malloc(hdr->length)) == NULL) {
+        free(job);
+        return 1;
+    }
+    job->conn = conn;
+    job->epoch = epoch;
+    job->received = received;
+    job->hdr = *hdr;
+    memcpy(job->payload, payload, hdr->length);
     
-    printf("[Server #%d]: Received the value %.1f from Client #%d. Returning %.1f.\n", 
-           server_id, req.value, req.client_id, resp.result);
+    if (queue_push(&job_queue, job) == -1) {
+        free(job->payload);
+        free(job);
+        return 1;
+    }
+    atomic_fetch_add_explicit(&jobs_queued, 1, memory_order_relaxed);
     
-    // Send response back
-    if (send(client_sock, &resp, sizeof(resp), 0) == -1) {
-        printf("[Server #%d]: Error sending response\n", server_id);
+    if (conn != NULL) {
+        conn->refs++;
+        jobs_in_flight++;
     }
+    metrics_add(SERVER_JOBS_SUBMITTED, 1);
+    sem_post(&jobs_ready);
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server_id>\n", argv[0]);
+// Serves every complete request buffered on the connection. Returns -1 when
+// the connection should be closed.
+int handle_client(client_conn_t *conn) {
+    int client_sock = conn->fd;
+    ssize_t n = buffer_read_fd(&conn->in, client_sock);
+    if (n == 0) {
+        return -1; // Proxy or client closed the connection
+    }
+    if (n == -1 && errno != EAGAIN) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Server #%d]: Error reading request\n", server_id);
+        return -1;
+    }
+    
+    frame_header_t hdr;
+    const char *payload;
+    int ret;
+    while ((ret = frame_next(&conn->in, &hdr, &payload)) == 1) {
+        // A malformed frame closes the connection before any of it is trusted
+        if (read_request(&hdr, payload) == -1) {
+            return -1;
+        }
+        uint64_t received = trace_now();
+        if (expired(&hdr, payload, received)) {
+            if (reject_request(&conn->out, &hdr, payload, FRAME_FLAG_EXPIRED) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        int submitted = submit_job(conn, 0, &hdr, payload, received);
+        if (submitted == 0) {
+            continue;
+        }
+        if (submitted == 1 ? reject_request(&conn->out, &hdr, payload, FRAME_FLAG_OVERLOAD) == -1
+                           : process_request(&conn->out, &hdr, payload, received) == -1) {
+            return -1;
+        }
+    }
+    if (ret == -1) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Server #%d]: Error reading request\n", server_id);
+        return -1;
+    }
+    
+    // Send responses back
+    if (buffer_flush_fd(&conn->out, client_sock) == -1) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Server #%d]: Error sending response\n", server_id);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Serves every request waiting on the shared-memory channel
+void drain_shm_requests() {
+    uint32_t epoch;
+    frame_header_t hdr;
+    char payload[SHM_MAX_PAYLOAD];
+    
+    while (shm_ring_pop(&channel->requests, &epoch, &hdr, payload) == 0) {
+        if (read_request(&hdr, payload) == -1) {
+            continue;
+        }
+        uint64_t received = trace_now();
+        buffer_t out = {0};
+        int ret;
+        if (expired(&hdr, payload, received)) {
+            ret = reject_request(&out, &hdr, payload, FRAME_FLAG_EXPIRED);
+        } else {
+            int submitted = submit_job(NULL, epoch, &hdr, payload, received);
+            if (submitted == 0) {
+                continue;
+            }
+            ret = submitted == 1 ? reject_request(&out, &hdr, payload, FRAME_FLAG_OVERLOAD)
+                                 : process_request(&out, &hdr, payload, received);
+        }
+        if (ret == 0) {
+            send_shm_response(epoch, &out);
+        }
+        buffer_free(&out);
+    }
+}
+
+void parse_args(int argc, char *argv[]) {
+    const char *transport = "socket";
+    int opt;
+    while ((opt = getopt(argc, argv, "w:t:r:q:D:L:S:")) != -1) {
+        switch (opt) {
+        case 'w':
+            num_workers = atoi(optarg);
+            break;
+        case 't':
+            transport = optarg;
+            break;
+        case 'r':
+            direct_return = strcmp(optarg, "direct") == 0;
+            if (!direct_return && strcmp(optarg, "proxied") != 0) {
+                optind = argc + 1;
+            }
+            break;
+        case 'q':
+            queue_limit = atoi(optarg);
+            break;
+        case 'D':
+            codel_target_ns = strtoull(optarg, NULL, 10) * 1000000;
+            break;
+        case 'L':
+            if (log_parse_level(optarg, &log_level) == -1) {
+                optind = argc + 1;
+            }
+            break;
+        case 'S':
+            log_sample = atoi(optarg);
+            break;
+        default:
+            optind = argc + 1; // Force the usage message below
+            break;
+        }
+    }
+    
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-w worker_threads] [-t socket|shm|shm-poll] [-r proxied|direct] "
+                "[-q queue_limit] [-D codel_target_ms] [-L debug|info|warn|error|off] [-S log_one_request_in] "
+                "<server_id>\n", argv[0]);
+        exit(1);
+    }
+    if (log_sample < 1) {
+        fprintf(stderr, "Log sampling must be at least 1\n");
+        exit(1);
+    }
+    if (num_workers < 0 || num_workers > MAX_WORKERS) {
+        fprintf(stderr, "Worker threads must be between 0 and %d\n", MAX_WORKERS);
+        exit(1);
+    }
+    if (queue_limit < 1 || queue_limit > JOB_QUEUE_SIZE) {
+        fprintf(stderr, "Queue limit must be between 1 and %d\n", JOB_QUEUE_SIZE);
         exit(1);
     }
     
-    server_id = atoi(argv[1]);
+    server_id = atoi(argv[optind]); // 0 for a standby, until it takes over a server
+    
+    if (strcmp(transport, "shm") == 0 || strcmp(transport, "shm-poll") == 0) {
+        use_shm = 1;
+        busy_poll = strcmp(transport, "shm-poll") == 0;
+    } else if (strcmp(transport, "socket") != 0) {
+        fprintf(stderr, "Unknown transport: %s\n", transport);
+        exit(1);
+    }
+}
+
+// Slot 0 is the listening socket, slot 1 the worker completion eventfd,
+// slot 2 the shared-memory request wakeup, slot 3 the handoff socket, slot 4
+// the stats socket and the rest are proxy (or handed-off client) connections
+// that stay open across requests.
+#define FIRST_CLIENT_SLOT 5
+
+static struct pollfd fds[MAX_CLIENTS + FIRST_CLIENT_SLOT];
+static client_conn_t *conns[MAX_CLIENTS + FIRST_CLIENT_SLOT];
+static int nfds = FIRST_CLIENT_SLOT;
+
+void release_connection(client_conn_t *conn) {
+    if (conn->closed && conn->refs == 0) {
+        buffer_free(&conn->in);
+        buffer_free(&conn->out);
+        free(conn);
+    }
+}
+
+void close_connection(client_conn_t *conn) {
+    int i = conn->slot;
+    
+    close(conn->fd);
+    conn->closed = 1;
+    
+    nfds--;
+    fds[i] = fds[nfds];
+    conns[i] = conns[nfds];
+    conns[i]->slot = i;
+    
+    release_connection(conn);
+}
+
+void update_connection(client_conn_t *conn) {
+    // Wait for the socket to drain when responses are still queued
+    fds[conn->slot].events = buffer_pending(&conn->out) > 0 ? POLLIN | POLLOUT : POLLIN;
+}
+
+// Gauges derived from the counters and the I/O thread's own state
+void add_gauges(buffer_t *out) {
+    uint64_t submitted = metrics_counter(SERVER_JOBS_SUBMITTED);
+    uint64_t started = metrics_counter(SERVER_JOBS_STARTED);
+    metrics_family(out, "server_job_queue_depth", "gauge", "Requests waiting for a worker");
+    metrics_sample(out, "server_job_queue_depth", NULL, submitted > started ? submitted - started : 0);
+    metrics_family(out, "server_jobs_in_flight", "gauge", "Connection requests not written back yet");
+    metrics_sample(out, "server_jobs_in_flight", NULL, jobs_in_flight);
+    metrics_family(out, "server_connections", "gauge", "Open proxy and client connections");
+    metrics_sample(out, "server_connections", NULL, nfds - FIRST_CLIENT_SLOT);
+    metrics_family(out, "server_workers", "gauge", "Worker threads");
+    metrics_sample(out, "server_workers", NULL, num_workers);
+    metrics_family(out, "server_queue_limit", "gauge", "Requests allowed to wait for a worker");
+    metrics_sample(out, "server_queue_limit", NULL, queue_limit);
+}
+
+// Registers a connected socket in the next free poll slot
+client_conn_t *add_connection(int client_sock) {
+    if (nfds == MAX_CLIENTS + FIRST_CLIENT_SLOT) {
+        LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND, "[Server #%d]: Too many connections\n", server_id);
+        close(client_sock);
+        return NULL;
+    }
+    
+    client_conn_t *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL || set_nonblocking(client_sock) == -1) {
+        perror("accept setup");
+        free(conn);
+        close(client_sock);
+        return NULL;
+    }
+    
+    conn->fd = client_sock;
+    conn->slot = nfds;
+    fds[nfds].fd = client_sock;
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+    conns[nfds] = conn;
+    nfds++;
+    metrics_add(SERVER_CONNECTIONS, 1);
+    return conn;
+}
+
+// Adopts the client connections proxies handed down and serves whatever
+// requests they had already read from them
+void accept_handoffs() {
+    int client_sock;
+    
+    while (1) {
+        buffer_t in = {0};
+        if (handoff_recv(handoff_sock, &client_sock, &in) == -1) {
+            buffer_free(&in);
+            if (errno == EPROTO) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("handoff_recv");
+            }
+            return;
+        }
+    
+        client_conn_t *conn = add_connection(client_sock);
+        if (conn == NULL) {
+            buffer_free(&in);
+            continue;
+        }
+        metrics_add(SERVER_HANDOFFS, 1);
+        conn->in = in;
+        if (handle_client(conn) == -1) {
+            close_connection(conn);
+            continue;
+        }
+        update_connection(conn);
+    }
+}
+
+// Writes responses computed by the workers back to their connections
+void drain_completions() {
+    uint64_t count;
+    if (read(done_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+    
+    job_t *job;
+    while (queue_pop(&done_queue, (void **)&job) == 0) {
+        client_conn_t *conn = job->conn;
+        jobs_in_flight--;
+        conn->refs--;
+    
+        if (!conn->closed) {
+            stamp_replied(&job->out);
+            if (job->failed) {
+                close_connection(conn);
+            } else if (buffer_append(&conn->out, job->out.data, job->out.len) == -1 ||
+                       buffer_flush_fd(&conn->out, conn->fd) == -1) {
+                LOG_RATE(LOG_WARN, LOG_ERRORS_PER_SECOND,
+                         "[Server #%d]: Error sending response\n", server_id);
+                close_connection(conn);
+            } else {
+                update_connection(conn);
+            }
+        } else {
+            release_connection(conn);
+        }
+    
+        buffer_free(&job->out);
+        free(job->payload);
+        free(job);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+    if (log_init(STDOUT_FILENO) == -1) {
+        perror("log_init"); // Messages are written directly instead
+    }
     
     setup_signals();
+    select_sqrt_kernel();
+    if (start_workers() == -1) {
+        exit(1);
+    }
+    metrics_init(server_counters, SERVER_COUNTERS, server_histograms, SERVER_HISTOGRAMS);
+    
+    // A standby has done everything above ahead of time and waits here for
+    // the server whose place it takes
+    int takeover = standby_wait();
+    if (takeover == -1) {
+        exit(0);
+    }
+    if (takeover > 0) {
+        server_id = takeover;
+    }
     
     if (create_server_socket() == -1) {
         exit(1);
     }
     
-    printf("[Server #%d]: Started\n", server_id);
+    if (use_shm) {
+        channel = shm_channel_open(server_id);
+        if (channel == NULL) {
+            log_msg(LOG_WARN, "[Server #%d]: Shared-memory channel unavailable, using sockets only\n", server_id);
+        }
+    }
+    cache = result_cache_open();
+    
+    char handoff_path[256];
+    snprintf(handoff_path, sizeof(handoff_path), "%s%d%s", SOCKET_PATH_BASE, server_id, HANDOFF_SUFFIX);
+    if (direct_return && (handoff_sock = handoff_socket(handoff_path)) == -1) {
+        perror("handoff socket");
+        exit(1);
+    }
+    
+    // Statistics are optional; serving works without them
+    char stats_path[256];
+    snprintf(stats_path, sizeof(stats_path), "%s%d%s", SOCKET_PATH_BASE, server_id, STATS_SUFFIX);
+    stats_socket = metrics_socket(stats_path);
+    
+    log_msg(LOG_INFO, "[Server #%d]: Started\n", server_id);
+    
+    fds[0].fd = server_socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = done_fd; // Ignored by poll() when the pool is disabled
+    fds[1].events = POLLIN;
+    fds[2].fd = channel != NULL && !busy_poll ? channel->requests.wake_fd : -1;
+    fds[2].events = POLLIN;
+    fds[3].fd = handoff_sock;
+    fds[3].events = POLLIN;
+    fds[4].fd = stats_socket;
+    fds[4].events = POLLIN;
+    notify_ready();
     
     while (!should_exit) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(server_socket, &readfds);
-        
-        struct timeval timeout = {1, 0}; // 1 second timeout
-        
-        int ready = select(server_socket + 1, &readfds, NULL, NULL, &timeout);
+        int timeout = 1000; // 1 second timeout
+        if (channel != NULL && (busy_poll || !shm_ring_prepare_wait(&channel->requests))) {
+            timeout = 0;
+        }
+    
+        int ready = poll(fds, nfds, timeout);
+        if (channel != NULL && !busy_poll) {
+            shm_ring_finish_wait(&channel->requests, ready > 0 && (fds[2].revents & POLLIN));
+        }
         if (ready == -1) {
             if (errno == EINTR) continue; // Interrupted by signal
-            perror("select");
+            perror("poll");
             break;
         }
-        
-        if (ready > 0 && FD_ISSET(server_socket, &readfds)) {
+    
+        if (channel != NULL) {
+            drain_shm_requests();
+        }
+    
+        for (int i = nfds - 1; i >= FIRST_CLIENT_SLOT; i--) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+    
+            client_conn_t *conn = conns[i];
+            if (handle_client(conn) == -1) {
+                close_connection(conn);
+                continue;
+            }
+            update_connection(conn);
+        }
+    
+        if (fds[1].revents & POLLIN) {
+            drain_completions();
+        }
+    
+        if (fds[3].revents & POLLIN) {
+            accept_handoffs();
+        }
+    
+        if (fds[4].revents & POLLIN) {
+            metrics_serve(stats_socket, -1, add_gauges);
+        }
+    
+        if (fds[0].revents & POLLIN) {
             int client_sock = accept(server_socket, NULL, NULL);
             if (client_sock == -1) {
                 if (errno == EINTR) continue;
                 perror("accept");
                 continue;
             }
-            
-            process_request(client_sock);
-            close(client_sock);
+            add_connection(client_sock);
         }
     }
     
+    stop_workers();
+    if (should_exit) {
+        log_msg(LOG_INFO, "[Server #%d]: Received SIGTERM from watchdog. Terminating.\n", server_id);
+    }
+    
+    for (int i = FIRST_CLIENT_SLOT; i < nfds; i++) {
+        close(fds[i].fd);
+    }
+    if (channel != NULL) {
+        shm_channel_close(channel);
+    }
+    if (cache != NULL) {
+        result_cache_close(cache);
+    }
+    
     if (server_socket != -1) {
         close(server_socket);
+    }
+    if (server_socket_bound) {
         char socket_path[256];
         snprintf(socket_path, sizeof(socket_path), "%s%d", SOCKET_PATH_BASE, server_id);
         unlink(socket_path);
     }
+    if (handoff_sock != -1) {
+        close(handoff_sock);
+        unlink(handoff_path);
+    }
+    if (stats_socket != -1) {
+        close(stats_socket);
+        unlink(stats_path);
+    }
     
     return 0;
-} 
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,230 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "shm_channel.h"
+
+#define SLOT_MASK (SHM_RING_SLOTS - 1)
+
+_Static_assert((SHM_RING_SLOTS & SLOT_MASK) == 0, "SHM_RING_SLOTS must be a power of two");
+
+static void channel_name(char *name, size_t size, int server_id) {
+    snprintf(name, size, "%s%d", SHM_CHANNEL_BASE, server_id);
+}
+
+static int ring_init(shm_ring_t *ring) {
+    for (size_t i = 0; i < SHM_RING_SLOTS; i++) {
+        atomic_init(&ring->slots[i].seq, i);
+    }
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->sleeping, 0);
+
+    // Not close-on-exec: every component the watchdog spawns inherits it
+    ring->wake_fd = eventfd(0, EFD_NONBLOCK);
+    return ring->wake_fd == -1 ? -1 : 0;
+}
+
+int shm_channel_create(int server_id) {
+    char name[64];
+    channel_name(name, sizeof(name), server_id);
+
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("shm_open");
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(shm_channel_t)) == -1) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    shm_channel_t *chan = mmap(NULL, sizeof(*chan), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (chan == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(name);
+        return -1;
+    }
+
+    atomic_init(&chan->epoch, 0);
+    if (ring_init(&chan->requests) == -1 || ring_init(&chan->responses) == -1) {
+        perror("eventfd");
+        munmap(chan, sizeof(*chan));
+        shm_unlink(name);
+        return -1;
+    }
+    chan->magic = SHM_CHANNEL_MAGIC;
+
+    munmap(chan, sizeof(*chan));
+    return 0;
+}
+
+void shm_channel_unlink(int server_id) {
+    char name[64];
+    channel_name(name, sizeof(name), server_id);
+    shm_unlink(name);
+}
+
+// The wakeup descriptors are only usable when this process inherited them
+static int is_eventfd(int fd) {
+    char path[64];
+    char target[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    ssize_t n = readlink(path, target, sizeof(target) - 1);
+    if (n == -1) {
+        return 0;
+    }
+    target[n] = '\0';
+    return strcmp(target, "anon_inode:[eventfd]") == 0;
+}
+
+shm_channel_t *shm_channel_open(int server_id) {
+    char name[64];
+    channel_name(name, sizeof(name), server_id);
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(shm_channel_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    shm_channel_t *chan = mmap(NULL, sizeof(*chan), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (chan == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (chan->magic != SHM_CHANNEL_MAGIC ||
+        !is_eventfd(chan->requests.wake_fd) || !is_eventfd(chan->responses.wake_fd)) {
+        munmap(chan, sizeof(*chan));
+        return NULL;
+    }
+    return chan;
+}
+
+void shm_channel_close(shm_channel_t *chan) {
+    munmap(chan, sizeof(*chan));
+}
+
+int shm_ring_push(shm_ring_t *ring, int multi_producer, uint32_t epoch,
+                  const frame_header_t *hdr, const void *payload) {
+    if (hdr->length > SHM_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    shm_slot_t *slot;
+    while (1) {
+        slot = &ring->slots[pos & SLOT_MASK];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (!multi_producer) {
+                atomic_store_explicit(&ring->tail, pos + 1, memory_order_relaxed);
+                break;
+            }
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; // Full
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->epoch = epoch;
+    slot->hdr = *hdr;
+    memcpy(slot->payload, payload, hdr->length);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+int shm_ring_pop(shm_ring_t *ring, uint32_t *epoch, frame_header_t *hdr, void *payload) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    shm_slot_t *slot = &ring->slots[pos & SLOT_MASK];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) {
+        return -1; // Empty
+    }
+
+    *epoch = slot->epoch;
+    *hdr = slot->hdr;
+    if (hdr->length > SHM_MAX_PAYLOAD) {
+        hdr->length = SHM_MAX_PAYLOAD; // Corrupt slot, let the frame check reject it
+    }
+    memcpy(payload, slot->payload, hdr->length);
+
+    atomic_store_explicit(&ring->head, pos + 1, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, pos + SHM_RING_SLOTS, memory_order_release);
+    return 0;
+}
+
+// A slot whose sequence still equals its position was claimed by a
+// producer that died before publishing it
+void shm_ring_release(shm_ring_t *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (size_t pos = head; pos != tail; pos++) {
+        shm_slot_t *slot = &ring->slots[pos & SLOT_MASK];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) == pos) {
+            slot->epoch = 0;
+            memset(&slot->hdr, 0, sizeof(slot->hdr));
+            atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+        }
+    }
+}
+
+void shm_ring_notify(shm_ring_t *ring) {
+    // Pairs with the fence in shm_ring_prepare_wait: either the consumer
+    // sees the new item or this sees the sleeping flag
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->sleeping, memory_order_relaxed) &&
+        atomic_exchange(&ring->sleeping, 0)) {
+        uint64_t one = 1;
+        if (write(ring->wake_fd, &one, sizeof(one)) == -1) {
+            perror("write");
+        }
+    }
+}
+
+int shm_ring_prepare_wait(shm_ring_t *ring) {
+    atomic_store_explicit(&ring->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    shm_slot_t *slot = &ring->slots[pos & SLOT_MASK];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) == pos + 1) {
+        atomic_store_explicit(&ring->sleeping, 0, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+void shm_ring_finish_wait(shm_ring_t *ring, int woken) {
+    atomic_store_explicit(&ring->sleeping, 0, memory_order_relaxed);
+
+    uint64_t count;
+    if (woken && read(ring->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "protocol.h"
+#include "queue.h"
+
+// Shared-memory transport between a reverse proxy and one of its servers.
+// The watchdog creates one segment per server before spawning anything. A
+// segment holds two rings of fixed-size slots: requests flow from the
+// proxy's event loop to the server (single producer, single consumer) and
+// responses flow back from the server's I/O thread and workers (multiple
+// producers, single consumer). Slots carry the same frames as the sockets,
+// so only frames whose payload fits a slot take this path; larger batches
+// and the connection itself, which tells each side the other is alive,
+// stay on the socket.
+//
+// A consumer that is about to block sets `sleeping` and waits on the ring's
+// eventfd; producers only write the eventfd when they find it set. The
+// eventfds are created by the watchdog and inherited by every component, so
+// their numbers are stored in the segment. In busy-poll mode consumers spin
+// on the rings instead and no wakeup syscalls are made at all.
+
+#define SHM_CHANNEL_BASE "/sqrt_channel_"
+#define SHM_CHANNEL_MAGIC 0x53484d31 // "SHM1"
+#define SHM_RING_SLOTS 1024
+#define SHM_MAX_PAYLOAD 152
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t seq;
+    uint32_t epoch; // proxy incarnation that sent the request
+    frame_header_t hdr;
+    char payload[SHM_MAX_PAYLOAD];
+} shm_slot_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // next slot to produce
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // next slot to consume
+    _Alignas(CACHE_LINE_SIZE) atomic_int sleeping;
+    int wake_fd;
+    shm_slot_t slots[SHM_RING_SLOTS];
+} shm_ring_t;
+
+typedef struct {
+    uint32_t magic;
+    atomic_uint epoch; // bumped by every proxy incarnation that attaches
+    shm_ring_t requests;
+    shm_ring_t responses;
+} shm_channel_t;
+
+// Creates and initializes the segment of a server. Called by the watchdog.
+int shm_channel_create(int server_id);
+void shm_channel_unlink(int server_id);
+
+// Maps an existing segment, or returns NULL when it is missing or its
+// eventfds were not inherited
+shm_channel_t *shm_channel_open(int server_id);
+void shm_channel_close(shm_channel_t *chan);
+
+// Return 0 on success, -1 when the ring is full (push) or empty (pop).
+// `multi_producer` must be set on rings several threads push to.
+int shm_ring_push(shm_ring_t *ring, int multi_producer, uint32_t epoch,
+                  const frame_header_t *hdr, const void *payload);
+int shm_ring_pop(shm_ring_t *ring, uint32_t *epoch, frame_header_t *hdr, void *payload);
+
+// Publishes the slots crashed producers claimed but never filled as
+// entries of epoch 0, which the consumer skips like any frame of another
+// proxy incarnation. The consumer may keep running, but no producer may, so
+// the watchdog calls it between a server's death and its replacement.
+void shm_ring_release(shm_ring_t *ring);
+
+// Producer side: wakes the consumer if it is blocked
+void shm_ring_notify(shm_ring_t *ring);
+
+// Consumer side: announces that it is about to block on wake_fd. Returns 1
+// when it may block and 0 when items arrived meanwhile and it must not.
+int shm_ring_prepare_wait(shm_ring_t *ring);
+
+// Consumer side: clears the sleeping flag, and the pending wakeup when the
+// wake_fd was reported readable
+void shm_ring_finish_wait(shm_ring_t *ring, int woken);
+
+#endif
@@ -2,292 +2,797 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
 
-static pid_t load_balancer_pid = 0;
-static pid_t reverse_proxy_pids[2] = {0, 0};
-static pid_t server_pids[6] = {0, 0, 0, 0, 0, 0};
-static volatile sig_atomic_t should_exit = 0;
+#include "shm_channel.h"
+#include "listen_socket.h"
+#include "result_cache.h"
 
-void sigchld_handler(int sig) {
-    (void)sig; // Unused parameter
-    
-    pid_t pid;
-    int status;
-    
-    // prompt : All children of the watchdog must be killed when the watchdog is killed. That includes the load balancer, reverse proxies, and servers. Update the code to ensure this.
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        if (pid == load_balancer_pid) {
-            if (!should_exit) {
-                printf("[Watchdog]: Load balancer has died. Re-creating.\n");
-                sleep(1); // Brief delay before respawning
-                
-                // Respawn load balancer
-                load_balancer_pid = fork();
-                if (load_balancer_pid == 0) {
-                    execl("./load_balancer", "load_balancer", NULL);
-                    perror("execl load_balancer");
-                    exit(1);
-                } else if (load_balancer_pid == -1) {
-                    perror("fork load_balancer");
-                    exit(1);
-                } else {
-                    printf("[Watchdog]: Load balancer respawned with PID %d\n", load_balancer_pid);
-                }
-            }
+#define MAX_PROXIES 64           // load balancer's limit
+#define MAX_SERVERS_PER_PROXY 64 // reverse proxy's limit
+#define MAX_WORKERS 64           // server's limit
+#define MAX_QUEUE_LIMIT 4096     // server's job queue size
+#define AUTO_WORKERS -1          // one worker per core, spread over the servers
+#define MAX_STANDBYS 16          // per tier
+
+#define LOAD_BALANCER_SOCKET "/tmp/load_balancer"
+#define PROXY_SOCKET_BASE "/tmp/reverse_proxy_"
+#define SERVER_SOCKET_BASE "/tmp/server_"
+
+#define RESPAWN_BACKOFF_MIN_MS 10ULL  // after the second crash in a row
+#define RESPAWN_BACKOFF_MAX_MS 5000ULL
+#define STABLE_UPTIME_MS 10000        // a component up this long is no longer crash looping
+
+// Cluster shape, read from an optional config file and then overridden by
+// command-line options, and handed to every component it spawns
+typedef struct {
+    int proxies;
+    int servers_per_proxy;
+    int server_workers;
+    int pool_size;      // load balancer connections per proxy
+    char policy[32];    // reverse proxy balancing policy
+    char transport[16]; // proxy-to-server transport: socket, shm or shm-poll
+    char io_backend[16]; // load balancer and proxy event loop: epoll or io_uring
+    char return_path[16]; // responses go back through every hop, or "direct"
+    char trace_sample[16]; // fraction of requests the load balancer traces
+    char log_level[16];    // debug, info, warn, error or off
+    int log_sample;        // log one in this many per-request messages
+    int queue_limit;       // requests each tier lets wait before shedding
+    int codel_target_ms;   // queue delay the servers and load balancer tolerate, 0 disables
+    int retries;           // other servers a proxy tries when one cannot be reached
+    int hedge_percentile;  // proxies hedge requests slower than this, 0 disables
+    int request_timeout_ms; // per-hop budget for requests without a tighter deadline, 0 disables
+    int standbys;          // warm spares kept for each of the proxy and server tiers
+    int cache_entries;     // results shared by the proxies and servers, 0 disables
+} topology_t;
+
+static topology_t topology = {2, 3, 2, 8, "p2c", "socket", "epoll", "proxied", "0", "info", 1,
+                              MAX_QUEUE_LIMIT, 5, 1, 95, 10000, 0, 0};
+static int num_servers = 6;
+
+typedef enum {
+    COMPONENT_LOAD_BALANCER,
+    COMPONENT_REVERSE_PROXY,
+    COMPONENT_SERVER
+} component_kind_t;
+
+// One supervised process. The table holds the load balancer, then the
+// proxies, then the servers, so proxy and server N sit at fixed indices,
+// and finally the standbys of both tiers.
+typedef struct {
+    component_kind_t kind;
+    int id;              // proxy or server number, from 1
+    int standby;         // waits to take over a role instead of having one
+    int listen_fd;       // kept open by the watchdog across respawns
+    int standby_fd;      // the watchdog's end of a standby's channel
+    int standby_peer;    // the standby's end, open only while it is spawned
+    pid_t pid;           // 0 while a respawn is pending
+    uint64_t started_ns;
+    int ready;           // has reported ready since it was last spawned
+    int failures;        // crashes in a row, for the backoff
+    uint64_t respawn_at; // when the pending respawn is due
+} component_t;
+
+static component_t *components = NULL;
+static int num_components = 0;
+static sigset_t original_mask; // what the children start with
+static int notify_fds[2] = {-1, -1};
+static uint64_t startup_ns;
+static int all_ready = 0; // every component has been ready once
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *component_name(const component_t *c, char *buf, size_t size) {
+    switch (c->kind) {
+    case COMPONENT_LOAD_BALANCER:
+        snprintf(buf, size, "Load Balancer");
+        break;
+    case COMPONENT_REVERSE_PROXY:
+        if (c->standby) {
+            snprintf(buf, size, "Standby Reverse Proxy");
         } else {
-            // Check reverse proxies
-            for (int i = 0; i < 2; i++) {
-                if (pid == reverse_proxy_pids[i] && !should_exit) {
-                    printf("[Watchdog]: Reverse Proxy has died. Re-creating.\n");
-                    sleep(1); // Brief delay before respawning
-                    
-                    // Respawn reverse proxy
-                    reverse_proxy_pids[i] = fork();
-                    if (reverse_proxy_pids[i] == 0) {
-                        char proxy_id_str[16];
-                        snprintf(proxy_id_str, sizeof(proxy_id_str), "%d", i + 1);
-                        execl("./reverse_proxy", "reverse_proxy", proxy_id_str, NULL);
-                        perror("execl reverse_proxy");
-                        exit(1);
-                    } else if (reverse_proxy_pids[i] == -1) {
-                        perror("fork reverse_proxy");
-                        exit(1);
-                    } else {
-                        printf("[Watchdog]: Reverse Proxy respawned with PID %d\n", reverse_proxy_pids[i]);
-                    }
-                    return;
-                }
-            }
-            
-            // Check servers
-            for (int i = 0; i < 6; i++) {
-                if (pid == server_pids[i] && !should_exit) {
-                    printf("[Watchdog]: Server has died. Re-creating.\n");
-                    sleep(1); // Brief delay before respawning
-                    
-                    // Respawn server
-                    server_pids[i] = fork();
-                    if (server_pids[i] == 0) {
-                        char server_id_str[16];
-                        snprintf(server_id_str, sizeof(server_id_str), "%d", i + 1);
-                        execl("./server", "server", server_id_str, NULL);
-                        perror("execl server");
-                        exit(1);
-                    } else if (server_pids[i] == -1) {
-                        perror("fork server");
-                        exit(1);
-                    }
-                    return;
-                }
-            }
-            
-            if (!should_exit) {
-                printf("[Watchdog]: Unknown child process %d has died.\n", pid);
-            }
+            snprintf(buf, size, "Reverse Proxy #%d", c->id);
+        }
+        break;
+    case COMPONENT_SERVER:
+        if (c->standby) {
+            snprintf(buf, size, "Standby Server");
+        } else {
+            snprintf(buf, size, "Server #%d", c->id);
         }
+        break;
     }
+    return buf;
 }
 
-// prompt: Implement signal handler for SIGINT and SIGTSTP. 
-void sigint_handler(int sig) {
-    (void)sig; // Unused parameter
-    
-    printf("\n[Watchdog]: Received SIGINT. Terminating all processes.\n");
-    should_exit = 1;
-    
-    // Send SIGTERM to all processes
-    if (load_balancer_pid > 0) {
-        kill(load_balancer_pid, SIGTERM);
+void component_path(const component_t *c, char *buf, size_t size) {
+    switch (c->kind) {
+    case COMPONENT_LOAD_BALANCER:
+        snprintf(buf, size, "%s", LOAD_BALANCER_SOCKET);
+        break;
+    case COMPONENT_REVERSE_PROXY:
+        snprintf(buf, size, "%s%d", PROXY_SOCKET_BASE, c->id);
+        break;
+    case COMPONENT_SERVER:
+        snprintf(buf, size, "%s%d", SERVER_SOCKET_BASE, c->id);
+        break;
     }
-    
-    for (int i = 0; i < 2; i++) {
-        if (reverse_proxy_pids[i] > 0) {
-            kill(reverse_proxy_pids[i], SIGTERM);
+}
+
+component_t *find_component(pid_t pid) {
+    for (int i = 0; i < num_components; i++) {
+        if (components[i].pid == pid) {
+            return &components[i];
+        }
+    }
+    return NULL;
+}
+
+void remove_shm_channels() {
+    if (strcmp(topology.transport, "socket") == 0) {
+        return;
+    }
+    for (int i = 0; i < num_servers; i++) {
+        shm_channel_unlink(i + 1);
+    }
+}
+
+// A server that died while publishing a response leaves a slot its proxy
+// would wait on forever. The slot is released before a replacement or a
+// standby takes the server's ID and starts producing on the channel again.
+void release_shm_channel(const component_t *c) {
+    if (c->kind != COMPONENT_SERVER || c->standby || strcmp(topology.transport, "socket") == 0) {
+        return;
+    }
+    shm_channel_t *chan = shm_channel_open(c->id);
+    if (chan != NULL) {
+        shm_ring_release(&chan->responses);
+        shm_channel_close(chan);
+    }
+}
+
+// The listening sockets belong to the watchdog, which hands each component
+// its own on every spawn. Only the socket files are removed here; the
+// descriptors go away with the watchdog.
+void remove_listen_sockets() {
+    char path[64];
+    for (int i = 0; i < num_components; i++) {
+        if (components[i].listen_fd != -1) {
+            component_path(&components[i], path, sizeof(path));
+            unlink(path);
+        }
+    }
+}
+
+// Forks and execs a component with its listening socket or standby
+// channel and the notify pipe, exiting the watchdog when fork fails
+pid_t spawn(const char *path, char *argv[], const component_t *c) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The watchdog's own signals are blocked for the signalfd
+        sigprocmask(SIG_SETMASK, &original_mask, NULL);
+        char notify_fd[16], standby_fd[16];
+        snprintf(notify_fd, sizeof(notify_fd), "%d", notify_fds[1]);
+        snprintf(standby_fd, sizeof(standby_fd), "%d", c->standby_peer);
+        if ((c->listen_fd != -1 && listen_socket_pass(c->listen_fd) == -1) ||
+            (c->standby_peer != -1 && setenv(STANDBY_FD_ENV, standby_fd, 1) == -1) ||
+            setenv(NOTIFY_FD_ENV, notify_fd, 1) == -1) {
+            perror("spawn");
+            exit(1);
         }
+        execv(path, argv);
+        perror("execv");
+        exit(1);
+    } else if (pid == -1) {
+        perror("fork");
+        exit(1);
     }
+    return pid;
+}
+
+pid_t spawn_load_balancer(const component_t *c) {
+    char proxies[16], pool_size[16], log_sample[16], queue_limit[16], codel_target[16], timeout[16];
+    snprintf(proxies, sizeof(proxies), "%d", topology.proxies);
+    snprintf(pool_size, sizeof(pool_size), "%d", topology.pool_size);
+    snprintf(log_sample, sizeof(log_sample), "%d", topology.log_sample);
+    snprintf(queue_limit, sizeof(queue_limit), "%d", topology.queue_limit);
+    snprintf(codel_target, sizeof(codel_target), "%d", topology.codel_target_ms);
+    snprintf(timeout, sizeof(timeout), "%d", topology.request_timeout_ms);
     
-    for (int i = 0; i < 6; i++) {
-        if (server_pids[i] > 0) {
-            kill(server_pids[i], SIGTERM);
+    char *argv[] = {"load_balancer", "-n", proxies, "-p", pool_size, "-e", topology.io_backend,
+                    "-r", topology.return_path, "-T", topology.trace_sample,
+                    "-q", queue_limit, "-D", codel_target, "-o", timeout,
+                    "-L", topology.log_level, "-S", log_sample, NULL};
+    return spawn("./load_balancer", argv, c);
+}
+
+pid_t spawn_reverse_proxy(const component_t *c) {
+    char proxy_id_str[16], servers[16], log_sample[16], queue_limit[16], retries[16], hedge[16];
+    char timeout[16];
+    snprintf(proxy_id_str, sizeof(proxy_id_str), "%d", c->id);
+    snprintf(servers, sizeof(servers), "%d", topology.servers_per_proxy);
+    snprintf(log_sample, sizeof(log_sample), "%d", topology.log_sample);
+    snprintf(queue_limit, sizeof(queue_limit), "%d", topology.queue_limit);
+    snprintf(retries, sizeof(retries), "%d", topology.retries);
+    snprintf(hedge, sizeof(hedge), "%d", topology.hedge_percentile);
+    snprintf(timeout, sizeof(timeout), "%d", topology.request_timeout_ms);
+    
+    char *argv[] = {"reverse_proxy", "-s", servers, "-b", topology.policy,
+                    "-t", topology.transport, "-e", topology.io_backend,
+                    "-r", topology.return_path, "-q", queue_limit, "-R", retries,
+                    "-H", hedge, "-o", timeout, "-L", topology.log_level,
+                    "-S", log_sample, proxy_id_str, NULL};
+    return spawn("./reverse_proxy", argv, c);
+}
+
+pid_t spawn_server(const component_t *c) {
+    char server_id_str[16], workers[16], log_sample[16], queue_limit[16], codel_target[16];
+    snprintf(server_id_str, sizeof(server_id_str), "%d", c->id);
+    snprintf(workers, sizeof(workers), "%d", topology.server_workers);
+    snprintf(log_sample, sizeof(log_sample), "%d", topology.log_sample);
+    snprintf(queue_limit, sizeof(queue_limit), "%d", topology.queue_limit);
+    snprintf(codel_target, sizeof(codel_target), "%d", topology.codel_target_ms);
+    
+    char *argv[] = {"server", "-w", workers, "-t", topology.transport,
+                    "-r", topology.return_path, "-q", queue_limit, "-D", codel_target,
+                    "-L", topology.log_level,
+                    "-S", log_sample, server_id_str, NULL};
+    return spawn("./server", argv, c);
+}
+
+void start_component(component_t *c) {
+    if (c->standby) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1 ||
+            fcntl(pair[1], F_SETFD, 0) == -1) {
+            perror("socketpair");
+            exit(1);
         }
+        c->standby_fd = pair[0];
+        c->standby_peer = pair[1];
     }
     
-    // Wait for all processes to terminate
-    if (load_balancer_pid > 0) {
-        waitpid(load_balancer_pid, NULL, 0);
+    switch (c->kind) {
+    case COMPONENT_LOAD_BALANCER:
+        c->pid = spawn_load_balancer(c);
+        break;
+    case COMPONENT_REVERSE_PROXY:
+        c->pid = spawn_reverse_proxy(c);
+        break;
+    case COMPONENT_SERVER:
+        c->pid = spawn_server(c);
+        break;
     }
+    c->started_ns = now_ns();
+    c->ready = 0;
     
-    for (int i = 0; i < 2; i++) {
-        if (reverse_proxy_pids[i] > 0) {
-            waitpid(reverse_proxy_pids[i], NULL, 0);
+    if (c->standby_peer != -1) {
+        close(c->standby_peer);
+        c->standby_peer = -1;
+    }
+}
+
+// Hands the role of `c` to a ready standby of the same kind, which is
+// replaced in the background. Returns 0 when one took over.
+int take_over(component_t *c, uint64_t now) {
+    for (int i = 0; i < num_components; i++) {
+        component_t *s = &components[i];
+        if (s->kind != c->kind || !s->standby || s->pid == 0 || !s->ready ||
+            standby_assign(s->standby_fd, c->id, c->listen_fd) == -1) {
+            continue;
         }
+        c->pid = s->pid;
+        c->started_ns = now;
+        c->ready = 1; // Initialized already
+        
+        close(s->standby_fd);
+        s->standby_fd = -1;
+        s->pid = 0;
+        s->ready = 0;
+        s->respawn_at = now;
+        return 0;
     }
-    
-    for (int i = 0; i < 6; i++) {
-        if (server_pids[i] > 0) {
-            waitpid(server_pids[i], NULL, 0);
+    return -1;
+}
+
+// A component that had been up for a while is respawned at once; one that
+// keeps crashing waits twice as long each time, up to RESPAWN_BACKOFF_MAX_MS
+void schedule_respawn(component_t *c, uint64_t now) {
+    char name[32];
+    if (c->ready && now - c->started_ns >= STABLE_UPTIME_MS * 1000000ULL) {
+        c->failures = 0;
+    }
+    uint64_t delay_ms = 0;
+    if (c->failures > 0) {
+        delay_ms = RESPAWN_BACKOFF_MAX_MS;
+        if (c->failures < 32 && (RESPAWN_BACKOFF_MIN_MS << (c->failures - 1)) < delay_ms) {
+            delay_ms = RESPAWN_BACKOFF_MIN_MS << (c->failures - 1);
         }
     }
+    c->failures++;
+    c->pid = 0;
+    release_shm_channel(c);
+    c->respawn_at = now + delay_ms * 1000000ULL;
+    if (c->standby_fd != -1) {
+        close(c->standby_fd);
+        c->standby_fd = -1;
+    }
     
-    printf("[Watchdog]: All processes terminated. Good bye.\n");
-    exit(0);
+    // Crash loops go through the backoff rather than using up the standbys
+    component_name(c, name, sizeof(name));
+    if (delay_ms == 0 && !c->standby && take_over(c, now) == 0) {
+        printf("[Watchdog]: %s has died. Standby PID %d took over.\n", name, c->pid);
+    } else if (delay_ms == 0) {
+        printf("[Watchdog]: %s has died. Re-creating.\n", name);
+    } else {
+        printf("[Watchdog]: %s has died %d times in a row. Re-creating in %llu ms.\n", name,
+               c->failures, (unsigned long long)delay_ms);
+    }
 }
 
-void sigtstp_handler(int sig) {
-    (void)sig; // Unused parameter
-    
-    printf("\n[Watchdog]: Received SIGTSTP. Terminating all processes.\n");
-    should_exit = 1;
+// prompt : All children of the watchdog must be killed when the watchdog is killed. That includes the load balancer, reverse proxies, and servers. Update the code to ensure this.
+// Runs from the event loop when the signalfd reports SIGCHLD. Several
+// deaths can arrive as one signal, so every exited child is reaped.
+void reap_children() {
+    pid_t pid;
+    int status;
+    uint64_t now = now_ns();
     
-    // Send SIGTERM to all processes
-    if (load_balancer_pid > 0) {
-        kill(load_balancer_pid, SIGTERM);
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        component_t *c = find_component(pid);
+        if (c == NULL) {
+            printf("[Watchdog]: Unknown child process %d has died.\n", pid);
+            continue;
+        }
+        schedule_respawn(c, now);
     }
-    
-    for (int i = 0; i < 2; i++) {
-        if (reverse_proxy_pids[i] > 0) {
-            kill(reverse_proxy_pids[i], SIGTERM);
+}
+
+void respawn_due(uint64_t now) {
+    char name[32];
+    for (int i = 0; i < num_components; i++) {
+        component_t *c = &components[i];
+        if (c->pid == 0 && c->respawn_at <= now) {
+            start_component(c);
+            printf("[Watchdog]: %s respawned with PID %d\n", component_name(c, name, sizeof(name)),
+                   c->pid);
+        }
+    }
+}
+
+// Milliseconds until the next pending respawn, or -1 when none is pending
+int respawn_timeout(uint64_t now) {
+    int timeout = -1;
+    for (int i = 0; i < num_components; i++) {
+        const component_t *c = &components[i];
+        if (c->pid != 0) {
+            continue;
+        }
+        int ms = c->respawn_at <= now ? 0 : (int)((c->respawn_at - now + 999999) / 1000000);
+        if (timeout == -1 || ms < timeout) {
+            timeout = ms;
         }
     }
+    return timeout;
+}
+
+// Children write their PID to the notify pipe once they are serving
+void read_notifications() {
+    char name[32];
+    pid_t pids[64];
+    ssize_t n;
+    uint64_t now = now_ns();
     
-    for (int i = 0; i < 6; i++) {
-        if (server_pids[i] > 0) {
-            kill(server_pids[i], SIGTERM);
+    while ((n = read(notify_fds[0], pids, sizeof(pids))) > 0) {
+        for (size_t i = 0; i < (size_t)n / sizeof(pid_t); i++) {
+            component_t *c = find_component(pids[i]);
+            if (c == NULL || c->ready) {
+                continue; // Died since, or already counted
+            }
+            c->ready = 1;
+            if (all_ready) {
+                printf("[Watchdog]: %s ready in %.1f ms\n", component_name(c, name, sizeof(name)),
+                       (now - c->started_ns) / 1e6);
+            }
         }
     }
     
-    // Wait for all processes to terminate
-    if (load_balancer_pid > 0) {
-        waitpid(load_balancer_pid, NULL, 0);
+    if (!all_ready) {
+        int ready = 0;
+        for (int i = 0; i < num_components; i++) {
+            ready += components[i].ready;
+        }
+        if (ready == num_components) {
+            all_ready = 1;
+            printf("[Watchdog]: All %d components ready in %.1f ms\n", num_components,
+                   (now - startup_ns) / 1e6);
+        }
     }
+}
+
+// prompt: Implement signal handler for SIGINT and SIGTSTP. 
+// Both arrive through the signalfd, like SIGCHLD, so this runs from the
+// event loop rather than in a handler.
+void terminate_all(const char *signal_name) {
+    printf("\n[Watchdog]: Received %s. Terminating all processes.\n", signal_name);
     
-    for (int i = 0; i < 2; i++) {
-        if (reverse_proxy_pids[i] > 0) {
-            waitpid(reverse_proxy_pids[i], NULL, 0);
+    // Send SIGTERM to all processes. Closing the standby channels also
+    // wakes a standby that the signal reached just before it started waiting.
+    for (int i = 0; i < num_components; i++) {
+        if (components[i].pid > 0) {
+            kill(components[i].pid, SIGTERM);
+        }
+        if (components[i].standby_fd != -1) {
+            close(components[i].standby_fd);
         }
     }
     
-    for (int i = 0; i < 6; i++) {
-        if (server_pids[i] > 0) {
-            waitpid(server_pids[i], NULL, 0);
+    // Wait for all processes to terminate
+    for (int i = 0; i < num_components; i++) {
+        if (components[i].pid > 0) {
+            waitpid(components[i].pid, NULL, 0);
         }
     }
     
+    remove_shm_channels();
+    remove_listen_sockets();
+    result_cache_unlink();
     printf("[Watchdog]: All processes terminated. Good bye.\n");
     exit(0);
 }
 
-void setup_signals() {
-    struct sigaction sa_chld, sa_int, sa_tstp;
-    
-    // Setup SIGCHLD handler
-    sa_chld.sa_handler = sigchld_handler;
-    sigemptyset(&sa_chld.sa_mask);
-    sa_chld.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    if (sigaction(SIGCHLD, &sa_chld, NULL) == -1) {
-        perror("sigaction SIGCHLD");
-        exit(1);
+void handle_signals(int signal_fd) {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD) {
+            reap_children();
+        } else if (info.ssi_signo == SIGINT) {
+            terminate_all("SIGINT");
+        } else if (info.ssi_signo == SIGTSTP) {
+            terminate_all("SIGTSTP");
+        }
     }
-    
-    // Setup SIGINT handler (Ctrl+C)
-    sa_int.sa_handler = sigint_handler;
-    sigemptyset(&sa_int.sa_mask);
-    sa_int.sa_flags = 0;
-    if (sigaction(SIGINT, &sa_int, NULL) == -1) {
-        perror("sigaction SIGINT");
+}
+
+// The signals the watchdog handles are blocked and read from a signalfd
+// instead, so respawning happens in the event loop and never inside a
+// handler
+int setup_signals() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);  // Ctrl+C
+    sigaddset(&mask, SIGTSTP); // Ctrl+Z
+    if (sigprocmask(SIG_BLOCK, &mask, &original_mask) == -1) {
+        perror("sigprocmask");
         exit(1);
     }
     
-    // Setup SIGTSTP handler (Ctrl+Z) 
-    sa_tstp.sa_handler = sigtstp_handler;
-    sigemptyset(&sa_tstp.sa_mask);
-    sa_tstp.sa_flags = 0;
-    if (sigaction(SIGTSTP, &sa_tstp, NULL) == -1) {
-        perror("sigaction SIGTSTP");
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        perror("signalfd");
         exit(1);
     }
+    return fd;
 }
 
-// prompt: Implement methods to spawn the load balancer, reverse proxies, and servers. 
-void create_load_balancer() {
-    printf("[Watchdog]: Creating Load Balancer\n");
-    
-    load_balancer_pid = fork();
-    if (load_balancer_pid == 0) {
-        // Child process - run load balancer
-        execl("./load_balancer", "load_balancer", NULL);
-        perror("execl load_balancer");
+// Every child inherits the write end and reports readiness on it; the
+// read end stays with the watchdog
+void create_notify_pipe() {
+    if (pipe(notify_fds) == -1 ||
+        fcntl(notify_fds[0], F_SETFD, FD_CLOEXEC) == -1 ||
+        fcntl(notify_fds[0], F_SETFL, O_NONBLOCK) == -1) {
+        perror("pipe");
         exit(1);
-    } else if (load_balancer_pid == -1) {
-        perror("fork load_balancer");
+    }
+}
+
+void create_components() {
+    num_components = 1 + topology.proxies + num_servers + 2 * topology.standbys;
+    components = calloc(num_components, sizeof(component_t));
+    if (components == NULL) {
+        perror("calloc");
         exit(1);
     }
-    
-    // Give load balancer time to start
-    sleep(1);
+    for (int i = 0; i < num_components; i++) {
+        component_t *c = &components[i];
+        c->listen_fd = -1;
+        c->standby_fd = -1;
+        c->standby_peer = -1;
+        if (i == 0) {
+            c->kind = COMPONENT_LOAD_BALANCER;
+        } else if (i <= topology.proxies) {
+            c->kind = COMPONENT_REVERSE_PROXY;
+            c->id = i;
+        } else if (i <= topology.proxies + num_servers) {
+            c->kind = COMPONENT_SERVER;
+            c->id = i - topology.proxies;
+        } else {
+            c->kind = (i - topology.proxies - num_servers) % 2 ? COMPONENT_REVERSE_PROXY : COMPONENT_SERVER;
+            c->standby = 1;
+        }
+    }
 }
 
-void create_reverse_proxies() {
-    for (int i = 0; i < 2; i++) {
-        printf("[Watchdog]: Creating Reverse Proxy #%d\n", i + 1);
-        
-        reverse_proxy_pids[i] = fork();
-        if (reverse_proxy_pids[i] == 0) {
-            // Child process - run reverse proxy
-            char proxy_id_str[16];
-            snprintf(proxy_id_str, sizeof(proxy_id_str), "%d", i + 1);
-            execl("./reverse_proxy", "reverse_proxy", proxy_id_str, NULL);
-            perror("execl reverse_proxy");
-            exit(1);
-        } else if (reverse_proxy_pids[i] == -1) {
-            perror("fork reverse_proxy");
+// Binds every component's listening socket up front, before anything else
+// takes a descriptor, so LISTEN_FDS_START in a child only ever replaces one
+// of these close-on-exec sockets and never an inherited descriptor
+void create_listen_sockets() {
+    char path[64];
+    for (int i = 0; i < num_components; i++) {
+        if (components[i].standby) {
+            continue; // Standbys are handed a socket when they take over
+        }
+        component_path(&components[i], path, sizeof(path));
+        components[i].listen_fd = listen_socket_create(path, SOMAXCONN);
+        if (components[i].listen_fd == -1) {
+            remove_listen_sockets();
             exit(1);
         }
     }
+}
+
+// Sets up the shared-memory channels before any component starts, so they
+// all inherit the channels' wakeup descriptors. Falls back to sockets when
+// a channel cannot be created.
+void create_shm_channels() {
+    if (strcmp(topology.transport, "socket") == 0) {
+        return;
+    }
     
-    // Give proxies time to start
-    sleep(1);
+    for (int i = 0; i < num_servers; i++) {
+        if (shm_channel_create(i + 1) == -1) {
+            printf("[Watchdog]: Cannot create shared-memory channels. Using sockets.\n");
+            remove_shm_channels();
+            strcpy(topology.transport, "socket");
+            return;
+        }
+    }
 }
 
-void create_servers() {
-    for (int i = 0; i < 6; i++) {
-        printf("[Watchdog]: Creating Server #%d\n", i + 1);
-        
-        server_pids[i] = fork();
-        if (server_pids[i] == 0) {
-            // Child process - run server
-            char server_id_str[16];
-            snprintf(server_id_str, sizeof(server_id_str), "%d", i + 1);
-            execl("./server", "server", server_id_str, NULL);
-            perror("execl server");
-            exit(1);
-        } else if (server_pids[i] == -1) {
-            perror("fork server");
+// Components look the result cache up by name when they start, so it has
+// to exist before them. A segment left behind by an earlier run is removed
+// even when the cache is disabled, or the components would use it.
+void create_result_cache() {
+    result_cache_unlink();
+    if (topology.cache_entries > 0 && result_cache_create(topology.cache_entries) == -1) {
+        printf("[Watchdog]: Cannot create the result cache. Running without it.\n");
+    }
+}
+
+// prompt: Implement methods to spawn the load balancer, reverse proxies, and servers. 
+// Every socket is already bound, so nothing has to wait for the component
+// it connects to: all of them start at once and connections queue until
+// their peer accepts.
+void start_components() {
+    char name[32];
+    startup_ns = now_ns();
+    for (int i = 0; i < num_components; i++) {
+        printf("[Watchdog]: Creating %s\n", component_name(&components[i], name, sizeof(name)));
+        start_component(&components[i]);
+    }
+}
+
+// Applies one topology setting from the config file or the command line.
+// Returns 0 on success and -1 for an unknown key or a bad value.
+int set_option(const char *key, const char *value) {
+    char *end;
+    long n = strtol(value, &end, 10);
+    int numeric = *value != '\0' && *end == '\0';
+    
+    if (strcmp(key, "proxies") == 0 && numeric) {
+        topology.proxies = n;
+    } else if (strcmp(key, "servers_per_proxy") == 0 && numeric) {
+        topology.servers_per_proxy = n;
+    } else if (strcmp(key, "server_workers") == 0 && strcmp(value, "auto") == 0) {
+        topology.server_workers = AUTO_WORKERS;
+    } else if (strcmp(key, "server_workers") == 0 && numeric) {
+        topology.server_workers = n;
+    } else if (strcmp(key, "pool_size") == 0 && numeric) {
+        topology.pool_size = n;
+    } else if (strcmp(key, "balancing_policy") == 0 && strlen(value) < sizeof(topology.policy)) {
+        strcpy(topology.policy, value);
+    } else if (strcmp(key, "transport") == 0 && (strcmp(value, "socket") == 0 ||
+               strcmp(value, "shm") == 0 || strcmp(value, "shm-poll") == 0)) {
+        strcpy(topology.transport, value);
+    } else if (strcmp(key, "io_backend") == 0 && (strcmp(value, "epoll") == 0 ||
+               strcmp(value, "io_uring") == 0)) {
+        strcpy(topology.io_backend, value);
+    } else if (strcmp(key, "return_path") == 0 && (strcmp(value, "proxied") == 0 ||
+               strcmp(value, "direct") == 0)) {
+        strcpy(topology.return_path, value);
+    } else if (strcmp(key, "trace_sample") == 0 && *value != '\0' &&
+               strlen(value) < sizeof(topology.trace_sample) &&
+               strtod(value, &end) >= 0 && *end == '\0' && strtod(value, NULL) <= 1) {
+        strcpy(topology.trace_sample, value);
+    } else if (strcmp(key, "log_level") == 0 && (strcmp(value, "debug") == 0 ||
+               strcmp(value, "info") == 0 || strcmp(value, "warn") == 0 ||
+               strcmp(value, "error") == 0 || strcmp(value, "off") == 0)) {
+        strcpy(topology.log_level, value);
+    } else if (strcmp(key, "log_sample") == 0 && numeric && n >= 1) {
+        topology.log_sample = n;
+    } else if (strcmp(key, "queue_limit") == 0 && numeric && n >= 1 && n <= MAX_QUEUE_LIMIT) {
+        topology.queue_limit = n;
+    } else if (strcmp(key, "codel_target_ms") == 0 && numeric && n >= 0) {
+        topology.codel_target_ms = n;
+    } else if (strcmp(key, "retries") == 0 && numeric && n >= 0) {
+        topology.retries = n;
+    } else if (strcmp(key, "hedge_percentile") == 0 && numeric && n >= 0 && n <= 99) {
+        topology.hedge_percentile = n;
+    } else if (strcmp(key, "request_timeout_ms") == 0 && numeric && n >= 0) {
+        topology.request_timeout_ms = n;
+    } else if (strcmp(key, "standbys") == 0 && numeric && n >= 0 && n <= MAX_STANDBYS) {
+        topology.standbys = n;
+    } else if (strcmp(key, "cache_entries") == 0 && numeric && n >= 0) {
+        topology.cache_entries = n;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads "key = value" lines; '#' starts a comment
+int load_config(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    
+    char line[256];
+    int line_no = 0;
+    int ret = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+    
+        char key[64], value[64], extra;
+        int fields = sscanf(line, " %63[^= \t\n] = %63s %c", key, value, &extra);
+        if (fields == -1) {
+            continue; // Blank line
+        }
+        if (fields != 2 || set_option(key, value) == -1) {
+            fprintf(stderr, "%s:%d: invalid setting\n", path, line_no);
+            ret = -1;
+        }
+    }
+    
+    fclose(file);
+    return ret;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c config_file] [-p proxies] [-s servers_per_proxy] "
+            "[-w server_workers|auto] [-l lb_pool_size] [-b balancing_policy] "
+            "[-t socket|shm|shm-poll] [-e epoll|io_uring] [-r proxied|direct] "
+            "[-T trace_sample] [-q queue_limit] [-D codel_target_ms] [-R retries] "
+            "[-H hedge_percentile] [-o request_timeout_ms] [-k standbys] [-C cache_entries] "
+            "[-L log_level] "
+            "[-S log_sample]\n", prog);
+    exit(1);
+}
+
+// The config file is applied first so command-line options override it
+void parse_args(int argc, char *argv[]) {
+    static const struct {
+        char opt;
+        const char *key;
+    } options[] = {
+        {'p', "proxies"},
+        {'s', "servers_per_proxy"},
+        {'w', "server_workers"},
+        {'l', "pool_size"},
+        {'b', "balancing_policy"},
+        {'t', "transport"},
+        {'e', "io_backend"},
+        {'r', "return_path"},
+        {'T', "trace_sample"},
+        {'q', "queue_limit"},
+        {'D', "codel_target_ms"},
+        {'R', "retries"},
+        {'H', "hedge_percentile"},
+        {'o', "request_timeout_ms"},
+        {'k', "standbys"},
+        {'C', "cache_entries"},
+        {'L', "log_level"},
+        {'S', "log_sample"},
+    };
+    const char *optstring = "c:p:s:w:l:b:t:e:r:T:q:D:R:H:o:k:C:L:S:";
+    int opt;
+    
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        if (opt == '?') {
+            usage(argv[0]);
+        }
+        if (opt == 'c' && load_config(optarg) == -1) {
             exit(1);
         }
     }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
     
-    // Give servers time to start
-    sleep(1);
+    optind = 1;
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+            if (options[i].opt == opt && set_option(options[i].key, optarg) == -1) {
+                fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+                exit(1);
+            }
+        }
+    }
+    
+    if (topology.proxies < 1 || topology.proxies > MAX_PROXIES) {
+        fprintf(stderr, "Proxies must be between 1 and %d\n", MAX_PROXIES);
+        exit(1);
+    }
+    if (topology.servers_per_proxy < 1 || topology.servers_per_proxy > MAX_SERVERS_PER_PROXY) {
+        fprintf(stderr, "Servers per proxy must be between 1 and %d\n", MAX_SERVERS_PER_PROXY);
+        exit(1);
+    }
+    if (topology.pool_size < 1) {
+        fprintf(stderr, "Pool size must be at least 1\n");
+        exit(1);
+    }
+    num_servers = topology.proxies * topology.servers_per_proxy;
+    
+    if (topology.server_workers == AUTO_WORKERS) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        topology.server_workers = cores > num_servers ? cores / num_servers : 1;
+    }
+    if (topology.server_workers < 0 || topology.server_workers > MAX_WORKERS) {
+        fprintf(stderr, "Server workers must be between 0 and %d\n", MAX_WORKERS);
+        exit(1);
+    }
 }
 
-int main() {
-    printf("[Watchdog]: Started\n");
+int main(int argc, char *argv[]) {
+    setvbuf(stdout, NULL, _IOLBF, 0); // Keep the log current when it goes to a file
+    parse_args(argc, argv);
+    
+    printf("[Watchdog]: Started with %d proxies, %d servers per proxy and %d workers per server\n",
+           topology.proxies, topology.servers_per_proxy, topology.server_workers);
     
-    setup_signals();
-    create_load_balancer();
-    create_reverse_proxies();
-    create_servers();
+    create_components();
+    create_listen_sockets();
+    create_notify_pipe();
+    int signal_fd = setup_signals();
+    create_shm_channels();
+    create_result_cache();
+    start_components();
     
     // Main watchdog loop
-    while (!should_exit) {
-        pause(); // Wait for signals
+    struct pollfd fds[2] = {{signal_fd, POLLIN, 0}, {notify_fds[0], POLLIN, 0}};
+    for (;;) {
+        if (poll(fds, 2, respawn_timeout(now_ns())) == -1 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        if (fds[0].revents & POLLIN) {
+            handle_signals(signal_fd);
+        }
+        if (fds[1].revents & POLLIN) {
+            read_notifications();
+        }
+        respawn_due(now_ns());
     }
     
     return 0;
-} 
\ No newline at end of file
+}